@@ -2,19 +2,62 @@
 #define FREE_SPACE_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #define FILEPATH "/dev/dax0.0"
 
 #define FILESIZE (2L * 1024 * 1024 * 1024) // 2GB
 
+// Allocation granule: every block size is a multiple of it
+#define ALLOC_ALIGN 8
+
+// Bytes at the start of NVRAM kept for the superblock region
+#define NVRAM_RESERVED (3 * 4096)
+
+// Fixed address the region is mapped at, so NVRAM pointers stay valid
+// across restarts
+#define NVRAM_MAP_BASE ((void *)0x500000000000UL)
+
+// The persistent high-water mark advances in steps of this size
+#define ALLOC_ROOT_STEP (1024 * 1024)
+
+// Base address of the mapped NVRAM region
+extern void *nvram_map;
+
 extern pthread_mutex_t free_space_mutex;
 
+// Back NVRAM with another device or a regular file (created and sized
+// as needed) instead of FILEPATH. Call before db_init.
+void set_nvram_path(const char *path);
+const char *get_nvram_path();
+
 // Initialize free space management system
 void init_free_space();
 
+// Use a persistent word as the allocator root. NVRAM at or above the offset
+// it holds is free. If existing is true, the region below it is treated as
+// allocated until free_space_rebuild; otherwise the root is initialized.
+void free_space_attach_root(uint64_t *root, bool existing);
+
+// NVRAM block in use, for free_space_rebuild
+typedef struct UsedBlock
+{
+    size_t offset;
+    size_t size;
+} UsedBlock;
+
+// Replace the free list with the gaps between the blocks in use (sorted in
+// place; they may overlap) and lower the root to the end of the last one.
+// Only valid while nothing else allocates or frees.
+bool free_space_rebuild(UsedBlock *used, int count);
+
 // Allocate memory from NVRAM using first-fit
 void *allocate_memory(size_t size);
 
+// Allocate memory at an NVRAM offset that is a multiple of align
+void *allocate_aligned(size_t size, size_t align);
+
 // Free allocated memory and merge adjacent blocks
 void free_memory(void *ptr, size_t size);
 
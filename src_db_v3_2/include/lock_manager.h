@@ -5,45 +5,111 @@
 #include <stdbool.h>
 #include <pthread.h>
 
+#define LOCK_TABLE_BUCKETS 1024 // Hash buckets of the lock table (a power of two)
+#define TXN_TABLE_BUCKETS 1024  // Hash buckets of running transactions (a power of two)
+#define LOCK_SPIN_ITERATIONS 2000 // Checks for a handed-over lock before a lone waiter sleeps;
+                                  // divided among the requests waiting at once
+#define LOCK_WAIT_TIMEOUT_MS 1000 // Default time lock_acquire waits for a lock
+#define LOCK_DEADLOCK_INTERVAL_MS 10 // How often the deadlock detector looks for cycles
+
 // Lock modes
 typedef enum {
     LOCK_SHARED,    // Read lock
     LOCK_EXCLUSIVE  // Write lock
 } LockMode;
 
+// How deadlocks between waiting transactions are resolved. Victims are
+// marked so that their lock requests and their commit fail; the database
+// layer then aborts them. A transaction that has started committing is
+// never made a victim.
+typedef enum {
+    DEADLOCK_TIMEOUT,   // Only the wait timeout ends a deadlock
+    DEADLOCK_DETECT,    // A background thread finds cycles of waiting transactions
+                        // and picks the youngest of each as victim
+    DEADLOCK_WAIT_DIE,  // An older transaction waits for a younger one; a younger
+                        // one that would wait for an older one is the victim
+    DEADLOCK_WOUND_WAIT // An older transaction makes the younger holders it waits
+                        // for victims and releases their locks at once; a younger
+                        // one waits for an older one
+} DeadlockPolicy;
+
+// Outcome of a waiting lock request
+typedef enum {
+    LOCK_WAITING,  // Not decided yet
+    LOCK_GRANTED,  // Handed over by a release
+    LOCK_REFUSED,  // Its transaction finished while it waited
+    LOCK_DEADLOCK  // Its transaction was made a deadlock victim
+} LockWaitStatus;
+
 // Lock request structure
 typedef struct LockRequest {
     int transaction_id;
     int resource_id;  // Table ID or row ID
     bool is_table;    // true if table lock, false if row lock
     LockMode mode;
+    LockWaitStatus status;   // Waiting requests only: set last by the thread deciding it
+    pthread_cond_t *wakeup;  // Waiting requests only: signalled when the status is set
     struct LockRequest *next;
 } LockRequest;
 
-// Lock table entry
+// Transaction holding a shared lock
+typedef struct LockHolder {
+    int transaction_id;
+    int count;  // Times it acquired the lock
+    struct LockHolder *next;
+} LockHolder;
+
+// Lock table entry, freed once no transaction holds or waits for it
 typedef struct LockEntry {
     int resource_id;
     bool is_table;
     int shared_count;
+    LockHolder *shared_holders;
     int exclusive_owner;  // -1 if no exclusive owner
-    LockRequest *waiting_list;
+    int exclusive_count;  // Times the exclusive owner acquired it
+    LockRequest *waiting_list; // Requests of waiting threads, granted in order
     struct LockEntry *next;
 } LockEntry;
 
-// Transaction structure
+// Bucket of the lock table. Each has its own latch and cache line, so
+// threads locking different resources do not contend.
+typedef struct LockBucket {
+    pthread_mutex_t latch; // Protects the bucket's entries and their waiting lists
+    LockEntry *entries;
+} __attribute__((aligned(64))) LockBucket;
+
+// Transaction structure. Finished transactions are reused for new ones, so
+// a transaction is only touched with its latch held after finding it by ID.
 typedef struct Transaction {
     int id;
     bool active;
+    bool victim;             // Chosen to break a deadlock
+    bool committing;         // Passed transaction_prepare, so it can no longer be a victim
     LockRequest *held_locks;
+    LockRequest *waiting;    // Request its thread waits on, if any
+    pthread_mutex_t latch; // Protects the fields above; a release in any bucket may grant a lock
     struct Transaction *next;
 } Transaction;
 
-// Lock manager structure
+// Bucket of the transaction table
+typedef struct TxnBucket {
+    pthread_mutex_t latch; // Protects the bucket's list
+    Transaction *txns;
+} __attribute__((aligned(64))) TxnBucket;
+
+// Lock manager structure. Latch order: the mutex, then a lock table bucket,
+// then a transaction table bucket, then a transaction latch.
 typedef struct {
-    LockEntry *lock_table;
-    Transaction *transactions;
-    pthread_mutex_t mutex;
+    LockBucket lock_table[LOCK_TABLE_BUCKETS]; // Hashed by resource
+    TxnBucket txn_table[TXN_TABLE_BUCKETS];    // Running transactions, hashed by ID
+    Transaction *free_txns;                    // Finished transactions to reuse
+    pthread_mutex_t mutex; // Protects next_txn_id and free_txns; held while a transaction is added
     int next_txn_id;
+    int wait_timeout_ms; // How long lock_acquire waits; negative waits forever
+    int waiters;         // Requests waiting now
+    DeadlockPolicy deadlock_policy;
+    pthread_t detector_thread;
+    bool detector_running;
 } LockManager;
 
 // Initialize lock manager
@@ -52,13 +118,41 @@ void lock_manager_init(LockManager *lm);
 // Start a new transaction
 int transaction_begin(LockManager *lm);
 
-// Commit a transaction
+// Start committing a transaction: from now on it cannot be made a deadlock
+// victim, so its locks stay held until transaction_commit. Fails if it
+// already is one; it can then only be aborted.
+bool transaction_prepare(LockManager *lm, int txn_id);
+
+// Commit a transaction. Fails for a deadlock victim, which stays running
+// until it is aborted.
 bool transaction_commit(LockManager *lm, int txn_id);
 
 // Abort a transaction
 bool transaction_abort(LockManager *lm, int txn_id);
 
-// Acquire a lock
+// Has a transaction begun and not yet committed or aborted?
+bool transaction_is_active(LockManager *lm, int txn_id);
+
+// Was a running transaction made a deadlock victim? Its lock requests and
+// its commit fail, so it can only be aborted.
+bool transaction_is_victim(LockManager *lm, int txn_id);
+
+// Smallest ID of a running transaction; every transaction with a smaller ID
+// has committed or aborted
+int transaction_oldest_active(LockManager *lm);
+
+// Set how long lock_acquire waits for a conflicting lock to be released
+// (negative: no limit, 0: not at all)
+void lock_manager_set_wait_timeout(LockManager *lm, int timeout_ms);
+
+// Choose how deadlocks are resolved (DEADLOCK_DETECT by default). Not to be
+// called concurrently with itself or lock_manager_cleanup.
+void lock_manager_set_deadlock_policy(LockManager *lm, DeadlockPolicy policy);
+
+// Acquire a lock. A conflicting request waits until the lock is handed
+// over by a release, or fails once the wait timeout passes or the
+// transaction is made a deadlock victim. A shared lock held only by this
+// transaction can be upgraded to exclusive.
 bool lock_acquire(LockManager *lm, int txn_id, int resource_id, bool is_table, LockMode mode);
 
 // Release a lock
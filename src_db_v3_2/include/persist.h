@@ -0,0 +1,44 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Copies of at least this many bytes bypass the cache (non-temporal stores)
+#define PERSIST_STREAM_MIN 1024
+
+// Where a store becomes persistent
+typedef enum PersistDomain {
+    PERSIST_ADR,  // Memory controller: dirty cache lines must be written back
+    PERSIST_EADR, // CPU caches: stores persist once visible, only ordering fences are needed
+    PERSIST_NONE  // Nothing persists (e.g. DRAM standing in for NVRAM): no write-backs or fences
+} PersistDomain;
+
+// Pick the persistence domain and the cache line write-back instruction.
+// The domain comes from the NVRAM_PERSIST_DOMAIN environment variable
+// ("adr", "eadr" or "none") if set, otherwise from the platform's report
+// for device, otherwise ADR. The instruction is the best of clwb,
+// clflushopt and clflush the CPU supports. Call before writing NVRAM.
+void persist_init(const char *device);
+PersistDomain persist_get_domain();
+void persist_set_domain(PersistDomain domain);
+const char *persist_domain_name(PersistDomain domain);
+const char *persist_flush_name(); // Write-back instruction in use ("none" if not needed)
+
+// Write back every cache line overlapping [start, start + size) and fence
+void flush_range(void *start, size_t size);
+// Write back without a fence. A batch of ranges that must be durable
+// together is followed by one persist_fence.
+void flush_range_nofence(void *start, size_t size);
+// Write back a batch of distinct cache lines with a single fence
+void flush_lines(uintptr_t *lines, size_t count);
+// Order earlier write-backs and stores before later stores
+void persist_fence();
+// Copy size bytes to NVRAM and make them durable with a single fence.
+// Large copies use non-temporal stores so that they neither read the
+// destination lines into the cache nor evict the DRAM index from it.
+void persist_copy(void *dest, const void *src, size_t size);
+// Store an aligned 64-bit word atomically and persistently
+void atomic_write_64(void *dest, uint64_t val);
+
+#endif // PERSIST_H
@@ -3,7 +3,10 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "lock_manager.h"
+#include "sec_index.h"
+#include "replication.h"
 
 // Define the order of the B+ Tree (maximum number of children)
 #define BP_ORDER 5
@@ -16,6 +19,46 @@ typedef struct BPTreeNode BPTreeNode;
 typedef struct BPTree BPTree;
 typedef struct Table Table;
 
+// Per-table B+ Tree maintenance policy
+typedef struct TablePolicy {
+    int leaf_split_keys; // Keys kept in the left leaf when a full leaf splits (1..BP_ORDER-2)
+    int leaf_min_keys;   // Leaves with fewer keys are underfull (0..(BP_ORDER-1)/2)
+    bool lazy_delete;    // Skip rebalancing on delete and leave it to the compactor
+} TablePolicy;
+
+// How a commit is made durable
+typedef enum {
+    DURABILITY_SYNC,   // Commit returns once its commit record is persistent
+    DURABILITY_ASYNC,  // Commit returns at once; a background flusher persists the
+                       // record within ASYNC_COMMIT_INTERVAL_US (see wal_durable_lsn)
+    DURABILITY_DEFAULT // Transactions only: asynchronous if every table written is
+} Durability;
+
+// Outcome of db_put_row
+typedef enum {
+    PUT_FAILED,   // Not inserted: invalid table, lock not acquired or out of space
+    PUT_INSERTED, // Staged for commit
+    PUT_EXISTS    // Not inserted: the key already has a row
+} PutStatus;
+
+// Seek modes for positioning a cursor relative to a (possibly absent) key
+typedef enum {
+    SEEK_KEY_GE, // First key >= target (lower bound)
+    SEEK_KEY_GT, // First key > target (upper bound)
+    SEEK_KEY_LE, // Last key <= target
+    SEEK_KEY_LT  // Last key < target
+} SeekMode;
+
+// Cursor over a table's leaves for ordered scans in either direction.
+// If the tree is modified between steps, the cursor re-seeks from its last key.
+typedef struct RowCursor {
+    Table *table;
+    BPTreeNode *leaf;        // Current leaf (NULL once the scan is exhausted)
+    int pos;                 // Position within the leaf
+    int key;                 // Current key
+    unsigned long mod_count; // Tree modification count when positioned
+} RowCursor;
+
 // Global lock manager
 extern LockManager g_lock_manager;
 
@@ -28,20 +71,66 @@ void db_init();
 // Shutdown database system
 void db_shutdown();
 
-// Transaction operations
+// Transaction operations. Writes are staged privately and reach the
+// indexes (and other transactions) only at commit; a transaction reads its
+// own writes through db_get_row, but not through cursors or index lookups.
 int db_begin_transaction();
 bool db_commit_transaction(int txn_id);
 bool db_abort_transaction(int txn_id);
+// Make one transaction commit synchronously or asynchronously whatever the
+// durability of its tables (DURABILITY_DEFAULT goes by the tables again).
+// After a commit, wal_last_commit_lsn gives its LSN to wait on.
+bool db_set_txn_durability(int txn_id, Durability durability);
+
+// Rebuild all tables from the committed entries of their WALs. The first
+// call after opening an existing database also rebuilds the NVRAM
+// allocators, so make it before running any transaction.
+bool db_recover();
+
+// Fold the committed head of every table's WAL into its checkpoint and free
+// the folded entries. Returns the number of entries truncated.
+int db_checkpoint();
+
+// Add every table and committed row to a replication snapshot (a
+// ReplSnapshotFn for repl_start_leader)
+void db_replication_snapshot(ReplBatch *batch);
 
 // Table operations
 int db_create_table(const char *name);
 Table* db_open_table(const char *name);
 void db_close_table(Table *table);
+void db_get_table_policy(Table *table, TablePolicy *policy);
+bool db_set_table_durability(Table *table, Durability durability);
+Durability db_get_table_durability(Table *table);
+bool db_set_table_policy(Table *table, const TablePolicy *policy);
+bool db_compact_table(Table *table);
+
+// Secondary index operations
+bool db_create_index(Table *table, const char *name, const IndexSpec *spec);
+bool db_drop_index(Table *table, const char *name);
+int db_index_lookup(Table *table, const char *name, int value, int *keys, int max_keys);
 
 // Row operations
 NVRAMPtr db_get_row(Table *table, int txn_id, int key, size_t *size);
-bool db_put_row(Table *table, int txn_id, int key, void *data, size_t size);
+PutStatus db_put_row(Table *table, int txn_id, int key, void *data, size_t size);
+bool db_update_row(Table *table, int txn_id, int key, void *data, size_t size);
+bool db_upsert_row(Table *table, int txn_id, int key, void *data, size_t size);
+bool db_update_field(Table *table, int txn_id, int key, size_t offset, size_t len, const void *bytes);
+bool db_incr(Table *table, int txn_id, int key, size_t offset, int64_t delta, int64_t *new_value);
 bool db_delete_row(Table *table, int txn_id, int key);
 int db_get_next_row(Table *table, int current_key);
+int db_get_prev_row(Table *table, int current_key);
+
+// Ordered scans (no row locks are taken, like db_get_next_row)
+bool db_cursor_seek(RowCursor *cursor, Table *table, int key, SeekMode mode);
+bool db_cursor_first(RowCursor *cursor, Table *table);
+bool db_cursor_last(RowCursor *cursor, Table *table);
+bool db_seek_rank(RowCursor *cursor, Table *table, int rank);
+bool db_cursor_next(RowCursor *cursor);
+bool db_cursor_prev(RowCursor *cursor);
+NVRAMPtr db_cursor_data(const RowCursor *cursor, size_t *size);
+
+// Order statistics in O(log n) from per-subtree row counts
+int db_count_range(Table *table, int lo, int hi);
 
 #endif // RAM_BPTREE_H
\ No newline at end of file
@@ -0,0 +1,70 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define REPL_MAX_FOLLOWERS 8    // Followers a leader ships to at once
+#define REPL_MAX_BACKLOG 65536  // Commits a follower may fall behind before it is dropped
+#define REPL_HEARTBEAT_MS 100   // Idle time after which the leader sends a heartbeat
+#define REPL_RETRY_MS 1000      // Delay before a follower reconnects or retries a commit
+#define REPL_BATCH_BYTES 65536  // Snapshot records sent per message
+
+// Message types
+#define REPL_MSG_SNAPSHOT 1     // Committed rows of the leader's tables
+#define REPL_MSG_SNAPSHOT_END 2 // Snapshot complete; commits from seq on follow
+#define REPL_MSG_COMMIT 3       // Writes of one committed transaction
+#define REPL_MSG_HEARTBEAT 4    // Leader is idle; seq is its next commit
+
+// Record operations
+#define REPL_OP_TABLE 1  // Table table_id is named by the data (a snapshot also empties it)
+#define REPL_OP_PUT 2    // Row inserted or replaced by the data
+#define REPL_OP_DELETE 3 // Row removed
+
+// Header of every message on a replication connection. Leader and
+// followers run on the same kind of machine, so fields are in host order.
+typedef struct ReplHeader {
+    uint32_t type;    // REPL_MSG_*
+    uint32_t length;  // Bytes of records after the header
+    uint64_t seq;     // REPL_MSG_COMMIT: position of the commit in the stream
+    uint64_t time_us; // Leader clock when the commit was published (or the message sent)
+} ReplHeader;
+
+// One record of a message, followed by size bytes of data
+typedef struct ReplRecord {
+    uint32_t op; // REPL_OP_*
+    int32_t table_id;
+    int32_t key;
+    uint32_t size;
+} ReplRecord;
+
+// Records collected for one message
+typedef struct ReplBatch ReplBatch;
+
+// Called for each new follower to add every table and committed row to a
+// snapshot. Commits published while it runs are shipped after it, so a row
+// it reads mid-update is corrected by the stream.
+typedef void (*ReplSnapshotFn)(ReplBatch *batch);
+
+// Leader: accept followers on port and ship them a snapshot, then every
+// published commit
+bool repl_start_leader(int port, ReplSnapshotFn snapshot);
+int repl_follower_count();
+
+// Collect the writes of one commit. repl_batch_begin returns NULL when no
+// follower is connected, so nothing is collected. Publishing ships the
+// batch and frees it; commits are shipped in the order they are published.
+ReplBatch *repl_batch_begin();
+bool repl_batch_add(ReplBatch *batch, int op, int table_id, int key, const void *data, size_t size);
+void repl_batch_publish(ReplBatch *batch);
+
+// Follower: replicate from the leader at host:port into the local tables
+// until shutdown, reconnecting (with a fresh snapshot) if the link drops
+bool repl_start_follower(const char *host, int port);
+// Commits the follower is known to be behind the leader, and how old the
+// last applied commit was when it was applied (0 once caught up).
+// Returns false if this process is not a follower.
+bool repl_get_lag(uint64_t *commits, uint64_t *lag_ms);
+
+#endif // REPLICATION_H
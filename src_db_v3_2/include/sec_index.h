@@ -0,0 +1,62 @@
+#ifndef SEC_INDEX_H
+#define SEC_INDEX_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MAX_INDEX_NAME 64
+#define INDEX_FIELD_DELIMITER '|'  // Field separator of text rows
+
+// How a secondary index extracts its integer key from a row
+typedef enum {
+    INDEX_FIELD_TEXT,  // N-th delimited field of a text row, parsed as an integer
+    INDEX_FIELD_INT32  // 4-byte integer at a byte offset of a binary row
+} IndexFieldType;
+
+// Definition of the indexed field
+typedef struct IndexSpec {
+    IndexFieldType type;
+    int field;  // Field number (TEXT) or byte offset (INT32)
+} IndexSpec;
+
+// Hash index entry: one (field value, primary key) pair
+typedef struct IndexEntry {
+    int value;
+    int row_key;
+    struct IndexEntry *next;
+} IndexEntry;
+
+// Non-unique secondary index from a field value to primary keys (in RAM)
+typedef struct SecondaryIndex {
+    char name[MAX_INDEX_NAME];
+    IndexSpec spec;
+    IndexEntry **buckets;
+    size_t bucket_count;
+    size_t entry_count;
+    bool incomplete;  // Rows are missing after an allocation failure
+} SecondaryIndex;
+
+// Create an empty secondary index
+SecondaryIndex *sec_index_create(const char *name, const IndexSpec *spec);
+
+// Free a secondary index and all its entries
+void sec_index_destroy(SecondaryIndex *index);
+
+// Extract the indexed value from a row. Returns false if the row has no such field
+bool sec_index_extract(const IndexSpec *spec, const void *data, size_t size, int *value);
+
+// Allocate entries ahead of time, so that inserts that must not fail can
+// take them from spares
+bool sec_index_reserve(IndexEntry **spares, int count);
+void sec_index_free_spares(IndexEntry *spares);
+
+// Add or remove a (value, primary key) pair. An insert takes its entry from
+// spares (which may be NULL) while there is one, and allocates it otherwise.
+bool sec_index_insert(SecondaryIndex *index, int value, int row_key, IndexEntry **spares);
+bool sec_index_remove(SecondaryIndex *index, int value, int row_key);
+
+// Find the primary keys of rows with the given value.
+// Fills up to max_keys keys and returns the total number of matches.
+int sec_index_lookup(SecondaryIndex *index, int value, int *keys, int max_keys);
+
+#endif // SEC_INDEX_H
@@ -0,0 +1,55 @@
+#ifndef SMALL_ALLOC_H
+#define SMALL_ALLOC_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CACHE_LINE_SIZE 64
+#define SMALL_PAGE_SIZE 4096 // NVRAM page shared by small rows
+#define SMALL_ROW_MAX 128    // Larger rows get an allocation of their own
+#define SMALL_PAGE_MAGIC 0x534d4c50u
+
+// Header at the start of every small-row page (exactly one cache line).
+// Only magic, slot_size, slot_count and bitmap are persistent; the rest is
+// bookkeeping of the running allocator.
+typedef struct SmallPage {
+    uint32_t magic;                 // SMALL_PAGE_MAGIC once the page is formatted
+    uint32_t slot_size;             // Bytes per slot
+    uint32_t slot_count;            // Slots following the header
+    uint32_t free_count;            // Free slots
+    uint64_t bitmap[2];             // Bit set = slot holds a row
+    struct SmallPage *next_partial; // Next page of the size class with free slots
+    uint32_t on_partial;            // Page is linked in that list
+    uint32_t reserved;
+    struct SmallPage *prev_partial; // Previous page in that list
+    uint64_t reserved2;
+} SmallPage;
+
+// Allocate NVRAM for a row. Rows up to SMALL_ROW_MAX bytes share pages.
+// The caller must make the row and its page header line durable before
+// the row is committed (see small_page_of).
+void *allocate_row(size_t size);
+
+// Free a row allocated with allocate_row (size must match). The page's
+// slot bitmap is persisted before returning. A page left without rows goes
+// back to the free space, unless it is the last one of its size class with
+// free slots.
+void free_row(void *ptr, size_t size);
+
+// Does a row of this size live in a shared page?
+bool row_is_small(size_t size);
+
+// Header of the shared page holding a small row
+SmallPage *small_page_of(void *ptr);
+
+// Rebuild the allocator after a restart from the small rows that survive
+// recovery (rows is sorted in place). The slot bitmaps of their pages are
+// reset to exactly those rows and persisted, and pages with free slots go
+// back on the partial lists. Call before any small row is allocated or freed.
+bool small_alloc_rebuild(void **rows, int count);
+
+// Release the allocator's bookkeeping (pages stay in NVRAM)
+void cleanup_small_alloc();
+
+#endif // SMALL_ALLOC_H
@@ -0,0 +1,74 @@
+#ifndef SUPERBLOCK_H
+#define SUPERBLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "wal.h"
+#include "sec_index.h"
+
+#define SUPERBLOCK_MAGIC 0x4e56524d44425342ULL // "NVRMDBSB"
+#define SUPERBLOCK_VERSION 6
+#define SUPERBLOCK_COPY_SIZE 4096 // Each of the two superblock copies
+#define CATALOG_NAME_SIZE 64
+#define CATALOG_MAX_INDEXES 4 // Secondary indexes recorded per table
+
+// Superblock region at NVRAM offset 0: two alternating copies, then the
+// allocator's persistent high-water mark on its own cache line
+#define SUPERBLOCK_ALLOC_ROOT_OFFSET (2 * SUPERBLOCK_COPY_SIZE)
+
+// Persistent definition of a secondary index. The index itself lives in
+// DRAM and is rebuilt from the table's rows at recovery.
+typedef struct CatalogIndex {
+    char name[MAX_INDEX_NAME];
+    int32_t type;  // IndexFieldType
+    int32_t field; // IndexSpec field
+} CatalogIndex;
+
+// Persistent catalog entry of one table
+typedef struct CatalogEntry {
+    char name[CATALOG_NAME_SIZE];
+    int32_t table_id;     // -1 if the entry is unused
+    uint32_t index_count; // Entries of indexes in use
+    uint64_t wal_root;    // NVRAM offset of the table's WALTable
+    CatalogIndex indexes[CATALOG_MAX_INDEXES];
+} CatalogEntry;
+
+// Versioned superblock. Updates write the older copy with a higher
+// generation and a new checksum; the newest valid copy wins at startup.
+typedef struct Superblock {
+    uint64_t magic;
+    uint32_t version;      // Layout version (SUPERBLOCK_VERSION)
+    uint32_t table_count;
+    uint64_t generation;
+    uint64_t map_base;     // Address the region was mapped at (WAL links are absolute)
+    uint64_t alloc_root;   // NVRAM offset of the allocator high-water mark
+    uint64_t commit_log;   // NVRAM offset of the commit log WALTable (0 if none)
+    int32_t next_table_id;
+    int32_t txn_id_lease;  // Transaction IDs below this may have been used
+    CatalogEntry tables[MAX_TABLES];
+    uint64_t checksum;     // Over all preceding bytes
+} Superblock;
+
+// Load the newest valid superblock, or format a new one if the region holds
+// none. Exits if it holds one of another layout version or only damaged
+// copies. Returns true if an existing database was found.
+bool superblock_open();
+
+// Current superblock (DRAM copy; read-only for callers)
+const Superblock *superblock_get();
+
+// Record a new table and its WAL root (crash-atomic)
+bool superblock_add_table(const char *name, int table_id, void *wal_root);
+
+// Record a secondary index of a table, or forget it (crash-atomic)
+bool superblock_add_index(int table_id, const char *name, const IndexSpec *spec);
+bool superblock_drop_index(int table_id, const char *name);
+
+// Record the commit log (crash-atomic)
+bool superblock_set_commit_log(void *commit_log);
+
+// Persist that transaction IDs below lease may be in use, so a restarted
+// server never reuses the ID of a logged transaction
+bool superblock_set_txn_lease(int lease);
+
+#endif // SUPERBLOCK_H
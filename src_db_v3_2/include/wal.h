@@ -3,39 +3,172 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <pthread.h> // For mutex support
+#include "persist.h"
 
 #define MAX_TABLES 10   // Maximum number of tables
+#define GROUP_COMMIT_WINDOW_US 0 // Default time a group commit leader waits for followers
+#define WAL_CHECKPOINT_MIN_ENTRIES 1024 // Entries a table logs before a checkpoint is due
+#define WAL_CHECKPOINT_IMAGE_RATIO 4    // ...and at least 1/N of its checkpoint's rows
+#define WAL_RING_ENTRIES 1024 // Initial record slots of a log partition (doubled when full)
+#define WAL_PARTITIONS 8      // Partitions of a table log; each thread appends to one
+#define WAL_FIELD_MAX_WORDS 2 // Aligned 8-byte words a field record carries
 
-// WAL Entry Structure
+// WAL operation types
+#define WAL_OP_DELETE 0 // Row removed (data_ptr is the deleted version)
+#define WAL_OP_INSERT 1 // Row added
+#define WAL_OP_UPDATE 2 // Row replaced by a new copy-on-write version
+#define WAL_OP_FIELD  3 // Words of the committed row to overwrite in place at commit
+#define WAL_OP_COMMIT 4 // Commit record of a transaction (in the commit log)
+
+// WAL record, one cache line. A ring slot holds the record for a log
+// position only if its lsn matches and the checksum is valid, so a torn or
+// stale slot ends the log without any tail pointer.
 typedef struct WALEntry {
-    int op_flag;           // Operation type (0 = Add, 1 = Delete)
+    uint64_t lsn;          // Position of the record in its partition
+    uint64_t seq;          // Global order of the record across partitions
+    int op_flag;           // Operation type (WAL_OP_*)
     int key;               // Key of row/data (formerly row_id)
+    int txn_id;            // Transaction that wrote the entry
+    uint32_t checksum;     // Checksum of the record with this field zero
     void *data_ptr;        // Pointer to actual data in NVRAM (KP in diagram)
-    size_t data_size;      // Size of the data
-    struct WALEntry *next; // Pointer to next WAL entry
+    uint32_t data_size;    // Size of the data (WAL_OP_COMMIT: bitmask of tables written)
+    uint32_t field_offset; // WAL_OP_FIELD: offset in the row of the first word (8-byte aligned)
+    uint64_t field_words[WAL_FIELD_MAX_WORDS]; // WAL_OP_FIELD: new contents of data_size / 8 words
 } WALEntry;
 
-// WAL Table Structure
+// Contiguous record slots of a log. Position lsn lives in slot
+// lsn % capacity.
+typedef struct WALRing {
+    uint64_t capacity;    // Record slots (a power of two)
+    uint64_t reserved[7];
+    WALEntry entries[];
+} WALRing;
+
+// One committed row of a checkpoint
+typedef struct WALCheckpointRow {
+    int key;
+    uint32_t size;
+    void *data_ptr;
+} WALCheckpointRow;
+
+// Checkpoint image: the committed rows of a table, sorted by key, as of
+// global position cut_seq. Replay starts from the image and skips records
+// before the cut that are still in the partitions.
+typedef struct WALCheckpoint {
+    uint64_t row_count;
+    uint64_t cut_seq;
+    WALCheckpointRow rows[];
+} WALCheckpoint;
+
+// One partition of a log: a ring appended to under its own mutex
+typedef struct WALPartition {
+    WALRing *ring;         // Record slots
+    uint64_t head;         // LSN of the first live record
+    uint64_t tail;         // Next LSN to write (DRAM; found by scanning at startup)
+    pthread_mutex_t mutex; // Serializes appends to this partition
+} __attribute__((aligned(64))) WALPartition;
+
+// WAL Table Structure. Allocate with 64-byte alignment so that partitions
+// do not share cache lines.
 typedef struct WALTable {
     int table_id;              // Unique Table ID
-    WALEntry *entry_head;      // Pointer to first WAL entry
-    WALEntry *entry_tail;      // Pointer to last WAL entry (for fast append)
-    WALEntry *commit_ptr;      // Commit pointer (points to last committed entry)
-    pthread_mutex_t mutex;     // Mutex for thread-safe WAL operations
+    int partition_count;       // Partitions in use (1 for the commit log)
+    WALCheckpoint *checkpoint; // Rows covered by truncated entries (NULL if none)
+    pthread_mutex_t mutex;     // Held by readers of all partitions and by checkpoints
+    WALPartition parts[WAL_PARTITIONS];
 } WALTable;
 
 extern WALTable *wal_tables[MAX_TABLES];
 
-// Function Declarations
-void flush_range(void *start, size_t size);
-void atomic_write_64(void *dest, uint64_t val);
+// Global log of commit records, one per writing transaction. A table entry
+// counts as committed only if its transaction has a valid commit record.
+extern WALTable *wal_commit_log;
 
 // WAL Operations
 int wal_create_table(int table_id, void *memory_ptr);
-int wal_add_entry(int table_id, int key, void *data_ptr, int op, void *entry_ptr, size_t data_size);
-void wal_advance_commit_ptr(int table_id, int txn_id);
-void wal_show_data();
-void wal_recover();  // New function for crash recovery
+int wal_create_commit_log(void *memory_ptr);
+int wal_attach_table(int table_id, void *memory_ptr);  // Existing table found at startup
+int wal_attach_commit_log(void *memory_ptr);
+void wal_detach_table(int table_id);
+void wal_detach_all();
+int wal_add_entry(int table_id, int txn_id, int key, void *data_ptr, int op, size_t data_size);
+// Log new contents for word_count aligned words of a row, starting at offset
+// (at most WAL_FIELD_MAX_WORDS). Redone by recovery once the transaction's
+// commit record is durable.
+int wal_add_field_entry(int table_id, int txn_id, int key, size_t offset, const uint64_t *words, int word_count);
+// Append a transaction's commit record and persist it, batched with
+// concurrent committers. table_mask has bit i set if table i was written.
+// An asynchronous commit returns once the record is queued; it becomes
+// durable with the next group, which wal_flush_commits forces.
+int wal_group_commit(int txn_id, unsigned int table_mask, int async);
+void wal_set_group_commit_window(unsigned int usec);
+// Commit LSNs number the commit groups: every commit with an LSN at or
+// below the durable LSN survives a crash.
+uint64_t wal_last_commit_lsn(); // Commit LSN of the calling thread's last commit
+uint64_t wal_durable_lsn();
+// Wait until commit LSN lsn (or every queued commit, if later) is durable.
+// Returns the durable LSN.
+uint64_t wal_wait_durable(uint64_t lsn);
+uint64_t wal_flush_commits(); // Make every queued commit durable
+
+// Summary of the records in a set of logs
+typedef struct WALStats {
+    int tables;
+    uint64_t entries;         // Records in the partitions
+    uint64_t bytes;           // NVRAM the records take up
+    uint64_t committed;       // Records of transactions with a durable commit record
+    uint64_t capacity;        // Record slots of the partitions' rings
+    uint64_t checkpoint_rows; // Rows folded into checkpoints
+    uint64_t commit_records;  // Records in the commit log
+    int oldest_uncommitted_txn; // Transaction of the oldest uncommitted record (-1 if none)
+    uint64_t oldest_uncommitted_seq;
+} WALStats;
+
+// One record of an inspected log
+typedef struct WALEntryInfo {
+    int table_id;
+    uint64_t seq;
+    int txn_id;
+    int key;
+    int op; // WAL_OP_*
+    uint32_t size;
+    int committed;
+} WALEntryInfo;
+
+// Inspect a table's log (table_id -1: every table) without holding up
+// writers: appends continue while a snapshot of the partitions is read.
+// Fills entries with up to limit records from start_seq on, in seq order
+// (page on with the last seq + 1), and stats, if not NULL, for the whole
+// snapshot.
+// Returns the number of entries, or -1 for an unknown table.
+int wal_inspect(int table_id, uint64_t start_seq, WALEntryInfo *entries, int limit, WALStats *stats);
+const char *wal_op_name(int op); // Printable name of a WAL_OP_*
+void wal_recover();  // Print what crash recovery replays
+
+// Walk a table's log in order. fn first sees the rows of the table's
+// checkpoint as committed inserts, then every entry after the checkpoint,
+// its partitions merged by seq, with committed set if its transaction has a
+// durable commit record.
+// Returns the number of committed entries, or -1 for an unknown table.
+typedef void (*WALReplayFn)(const WALEntry *entry, int committed, void *arg);
+int wal_replay_table(int table_id, WALReplayFn fn, void *arg);
+
+// Checkpointing. A checkpoint folds the committed entries of a table's log
+// into a new checkpoint image, up to the first entry (by seq) of a
+// transaction with an ID of at least oldest_active (all older transactions
+// have finished), and releases the folded entries' slots.
+// Returns the number of entries truncated, or -1 on error.
+int wal_checkpoint_due(int table_id);
+int wal_checkpoint_table(int table_id, int oldest_active);
+// Release the commit records at the head of the commit log that no
+// remaining table entry refers to
+int wal_trim_commit_log();
+
+// Report every NVRAM block of the attached logs (log tables, rings and
+// checkpoint images) to fn, so the allocator can be rebuilt after a restart
+typedef void (*WALBlockFn)(void *ptr, size_t size, void *arg);
+void wal_list_blocks(WALBlockFn fn, void *arg);
 
-#endif // WAL_H
\ No newline at end of file
+#endif // WAL_H
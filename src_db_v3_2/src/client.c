@@ -46,7 +46,8 @@ int main()
         printf("7. Get Row\n");
         printf("8. Delete Row\n");
         printf("9. Show WAL\n");
-        printf("10. Exit\n");
+        printf("10. Scan Rows\n");
+        printf("11. Exit\n");
         printf("Enter choice: ");
 
         int choice;
@@ -151,6 +152,23 @@ int main()
             break;
         }
         case 10:
+        { // Scan Rows
+            printf("Enter start key: ");
+            int key;
+            scanf("%d", &key);
+            printf("Enter number of rows: ");
+            int limit;
+            scanf("%d", &limit);
+            getchar();
+            printf("Descending? (y/n): ");
+            char answer = getchar();
+            if (answer != '\n')
+                getchar();
+            snprintf(buffer, BUFFER_SIZE, "SCAN %d %d %s\n", key, limit,
+                     (answer == 'y' || answer == 'Y') ? "DESC" : "ASC");
+            break;
+        }
+        case 11:
         { // Exit
             snprintf(buffer, BUFFER_SIZE, "EXIT\n");
             send(sock, buffer, strlen(buffer), 0);
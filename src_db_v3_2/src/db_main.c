@@ -7,10 +7,111 @@
 #include "../include/ram_bptree.h"
 #include "../include/free_space.h"
 #include "../include/wal.h"
+#include "../include/replication.h"
 #include <unistd.h>
 
 #define PORT 8080
 #define BUFFER_SIZE 1024
+#define MAX_LOOKUP_ROWS 64
+#define WAL_PAGE_ENTRIES 10 // Default records per SHOW WAL page (a response holds about this many)
+
+// A replica applies the leader's commits and serves reads only
+static bool read_only = false;
+
+// Commands that change tables. Secondary indexes are derived from the rows
+// in RAM, so a replica may build its own.
+static bool is_write_command(const char *command, const char *buffer)
+{
+    return (strcmp(command, "CREATE") == 0 && strncmp(buffer, "CREATE INDEX", 12) != 0) ||
+           strcmp(command, "INSERT") == 0 ||
+           strcmp(command, "UPDATE") == 0 || strcmp(command, "UPSERT") == 0 ||
+           strcmp(command, "DELETE") == 0;
+}
+
+// After a failed operation, tell the client if its transaction was aborted
+// to break a deadlock
+static bool report_deadlock_victim(int client_socket, int *txn_id)
+{
+    if (*txn_id < 0 || transaction_is_active(&g_lock_manager, *txn_id))
+        return false;
+    send(client_socket, "Transaction aborted: deadlock\n", 30, 0);
+    *txn_id = -1;
+    return true;
+}
+
+static bool parse_deadlock_policy(const char *name, DeadlockPolicy *out)
+{
+    if (strcmp(name, "detect") == 0)
+        *out = DEADLOCK_DETECT;
+    else if (strcmp(name, "wait-die") == 0)
+        *out = DEADLOCK_WAIT_DIE;
+    else if (strcmp(name, "wound-wait") == 0)
+        *out = DEADLOCK_WOUND_WAIT;
+    else if (strcmp(name, "timeout") == 0)
+        *out = DEADLOCK_TIMEOUT;
+    else
+        return false;
+    return true;
+}
+
+// Parse "<CMD> ROW <key> '<data>'" into key and data
+static bool parse_row_args(char *buffer, int *key, char *data, size_t data_size)
+{
+    char *ptr = strstr(buffer, "ROW") + 3;
+    while (*ptr == ' ')
+        ptr++;
+    *key = atoi(ptr);
+    while (*ptr != ' ' && *ptr != '\0')
+        ptr++;
+    while (*ptr == ' ')
+        ptr++;
+    if (*ptr != '\'')
+        return false;
+
+    ptr++;
+    char *data_start = ptr;
+    while (*ptr != '\'' && *ptr != '\0')
+        ptr++;
+    if (*ptr != '\'')
+        return false;
+
+    size_t data_len = ptr - data_start;
+    if (data_len >= data_size)
+        return false;
+    memcpy(data, data_start, data_len);
+    data[data_len] = '\0';
+    return true;
+}
+
+// Send up to limit rows starting at a positioned cursor
+static void send_rows(int client_socket, RowCursor *cursor, bool found, int limit, bool descending)
+{
+    char response[BUFFER_SIZE];
+    size_t len = 0;
+    int count = 0;
+    while (found && count < limit)
+    {
+        size_t size;
+        char *data = (char *)db_cursor_data(cursor, &size);
+        int written = snprintf(response + len, sizeof(response) - len, "Row %d: %s\n",
+                               cursor->key, data ? data : "");
+        if (written < 0 || (size_t)written >= sizeof(response) - len)
+        {
+            break; // Response buffer full
+        }
+        len += written;
+        count++;
+        found = descending ? db_cursor_prev(cursor) : db_cursor_next(cursor);
+    }
+    if (count == 0)
+    {
+        send(client_socket, "No rows found\n", 14, 0);
+    }
+    else
+    {
+        send(client_socket, response, len, 0);
+    }
+}
 
 // Client handling function
 void *handle_client(void *arg)
@@ -36,9 +137,35 @@ void *handle_client(void *arg)
         {
             *newline = '\0';
             char command[32];
-            sscanf(buffer, "%s", command);
+            sscanf(buffer, "%31s", command);
 
-            if (strcmp(command, "CREATE") == 0 && strstr(buffer, "TABLE"))
+            if (read_only && is_write_command(command, buffer))
+            {
+                send(client_socket, "Read-only replica\n", 18, 0);
+                continue;
+            }
+
+            if (strcmp(command, "CREATE") == 0 && strncmp(buffer, "CREATE INDEX", 12) == 0)
+            {
+                // CREATE INDEX <name> ON <table> FIELD <n>
+                char index_name[64], table_name[64];
+                IndexSpec spec = {INDEX_FIELD_TEXT, 0};
+                if (sscanf(buffer, "CREATE INDEX %63s ON %63s FIELD %d", index_name, table_name, &spec.field) != 3)
+                {
+                    send(client_socket, "Invalid format\n", 15, 0);
+                    continue;
+                }
+                Table *table = db_open_table(table_name);
+                if (table && db_create_index(table, index_name, &spec))
+                {
+                    send(client_socket, "Index created\n", 14, 0);
+                }
+                else
+                {
+                    send(client_socket, "Failed to create index\n", 23, 0);
+                }
+            }
+            else if (strcmp(command, "CREATE") == 0 && strstr(buffer, "TABLE"))
             {
                 char table_name[64];
                 sscanf(buffer, "CREATE TABLE %s", table_name);
@@ -87,7 +214,7 @@ void *handle_client(void *arg)
                         send(client_socket, "Transaction committed\n", 22, 0);
                         current_txn_id = -1;
                     }
-                    else
+                    else if (!report_deadlock_victim(client_socket, &current_txn_id))
                     {
                         send(client_socket, "Failed to commit transaction\n", 29, 0);
                     }
@@ -130,47 +257,58 @@ void *handle_client(void *arg)
                 }
                 int key;
                 char data[256];
-                char *ptr = strstr(buffer, "ROW") + 3;
-                while (*ptr == ' ')
-                    ptr++;
-                key = atoi(ptr);
-                while (*ptr != ' ' && *ptr != '\0')
-                    ptr++;
-                while (*ptr == ' ')
-                    ptr++;
-                if (*ptr == '\'')
-                {
-                    ptr++;
-                    char *data_start = ptr;
-                    while (*ptr != '\'' && *ptr != '\0')
-                        ptr++;
-                    if (*ptr == '\'')
-                    {
-                        size_t data_len = ptr - data_start;
-                        strncpy(data, data_start, data_len);
-                        data[data_len] = '\0';
-                        int status = db_put_row(current_table, current_txn_id, key, data, strlen(data) + 1);
-                        if (status == 0)
-                        {
-                            send(client_socket, "Row inserted\n", 13, 0);
-                        }
-                        else if (status == 1)
-                        {
-                            send(client_socket, "Row already exists\n", 19, 0);
-                        }
-                        else
-                        {
-                            send(client_socket, "Failed to insert row\n", 21, 0);
-                        }
-                    }
-                    else
-                    {
-                        send(client_socket, "Invalid format\n", 15, 0);
-                    }
+                if (!parse_row_args(buffer, &key, data, sizeof(data)))
+                {
+                    send(client_socket, "Invalid format\n", 15, 0);
+                    continue;
+                }
+                PutStatus status = db_put_row(current_table, current_txn_id, key, data, strlen(data) + 1);
+                if (report_deadlock_victim(client_socket, &current_txn_id))
+                {
+                    continue;
+                }
+                if (status == PUT_INSERTED)
+                {
+                    send(client_socket, "Row inserted\n", 13, 0);
+                }
+                else if (status == PUT_EXISTS)
+                {
+                    send(client_socket, "Row already exists\n", 19, 0);
                 }
                 else
+                {
+                    send(client_socket, "Failed to insert row\n", 21, 0);
+                }
+            }
+            else if ((strcmp(command, "UPDATE") == 0 || strcmp(command, "UPSERT") == 0) && strstr(buffer, "ROW"))
+            {
+                if (!current_table)
+                {
+                    send(client_socket, "No table selected\n", 18, 0);
+                    continue;
+                }
+                if (current_txn_id < 0)
+                {
+                    send(client_socket, "No active transaction\n", 22, 0);
+                    continue;
+                }
+                int key;
+                char data[256];
+                if (!parse_row_args(buffer, &key, data, sizeof(data)))
                 {
                     send(client_socket, "Invalid format\n", 15, 0);
+                    continue;
+                }
+                bool ok = (strcmp(command, "UPDATE") == 0)
+                              ? db_update_row(current_table, current_txn_id, key, data, strlen(data) + 1)
+                              : db_upsert_row(current_table, current_txn_id, key, data, strlen(data) + 1);
+                if (ok)
+                {
+                    send(client_socket, "Row updated\n", 12, 0);
+                }
+                else if (!report_deadlock_victim(client_socket, &current_txn_id))
+                {
+                    send(client_socket, "Failed to update row\n", 21, 0);
                 }
             }
             else if (strcmp(command, "GET") == 0 && strstr(buffer, "ROW"))
@@ -195,7 +333,7 @@ void *handle_client(void *arg)
                     snprintf(response, sizeof(response), "Row %d: %s\n", key, (char *)data);
                     send(client_socket, response, strlen(response), 0);
                 }
-                else
+                else if (!report_deadlock_victim(client_socket, &current_txn_id))
                 {
                     send(client_socket, "Row not found\n", 14, 0);
                 }
@@ -218,15 +356,246 @@ void *handle_client(void *arg)
                 {
                     send(client_socket, "Row deleted\n", 12, 0);
                 }
-                else
+                else if (!report_deadlock_victim(client_socket, &current_txn_id))
                 {
                     send(client_socket, "Failed to delete row\n", 21, 0);
                 }
             }
+            else if (strcmp(command, "LOOKUP") == 0)
+            {
+                if (!current_table)
+                {
+                    send(client_socket, "No table selected\n", 18, 0);
+                    continue;
+                }
+                // LOOKUP <index> <value>
+                char index_name[64];
+                int value;
+                if (sscanf(buffer, "LOOKUP %63s %d", index_name, &value) != 2)
+                {
+                    send(client_socket, "Invalid format\n", 15, 0);
+                    continue;
+                }
+                int keys[MAX_LOOKUP_ROWS];
+                int count = db_index_lookup(current_table, index_name, value, keys, MAX_LOOKUP_ROWS);
+                if (count < 0)
+                {
+                    send(client_socket, "Index not found\n", 16, 0);
+                    continue;
+                }
+                if (count == 0)
+                {
+                    send(client_socket, "No rows found\n", 14, 0);
+                    continue;
+                }
+                char response[BUFFER_SIZE];
+                size_t len = 0;
+                for (int i = 0; i < count && i < MAX_LOOKUP_ROWS; i++)
+                {
+                    int written = snprintf(response + len, sizeof(response) - len, "Row %d\n", keys[i]);
+                    if (written < 0 || (size_t)written >= sizeof(response) - len)
+                    {
+                        break; // Response buffer full
+                    }
+                    len += written;
+                }
+                send(client_socket, response, len, 0);
+            }
+            else if (strcmp(command, "SCAN") == 0)
+            {
+                if (!current_table)
+                {
+                    send(client_socket, "No table selected\n", 18, 0);
+                    continue;
+                }
+                // SCAN <start_key> <limit> [ASC|DESC]
+                int start_key, limit;
+                char order[8] = "ASC";
+                if (sscanf(buffer, "SCAN %d %d %7s", &start_key, &limit, order) < 2 || limit <= 0)
+                {
+                    send(client_socket, "Invalid format\n", 15, 0);
+                    continue;
+                }
+                bool descending = (strcmp(order, "DESC") == 0);
+
+                // Seek to the nearest key once, then walk the leaf chain
+                RowCursor cursor;
+                bool found = db_cursor_seek(&cursor, current_table, start_key,
+                                            descending ? SEEK_KEY_LE : SEEK_KEY_GE);
+                send_rows(client_socket, &cursor, found, limit, descending);
+            }
+            else if (strcmp(command, "PAGE") == 0)
+            {
+                if (!current_table)
+                {
+                    send(client_socket, "No table selected\n", 18, 0);
+                    continue;
+                }
+                // PAGE <offset> <limit>: rows by position in key order
+                int offset, limit;
+                if (sscanf(buffer, "PAGE %d %d", &offset, &limit) != 2 || offset < 0 || limit <= 0)
+                {
+                    send(client_socket, "Invalid format\n", 15, 0);
+                    continue;
+                }
+
+                RowCursor cursor;
+                bool found = db_seek_rank(&cursor, current_table, offset);
+                send_rows(client_socket, &cursor, found, limit, false);
+            }
+            else if (strcmp(command, "COUNT") == 0)
+            {
+                if (!current_table)
+                {
+                    send(client_socket, "No table selected\n", 18, 0);
+                    continue;
+                }
+                // COUNT <lo> <hi>: rows with lo <= key <= hi
+                int lo, hi;
+                if (sscanf(buffer, "COUNT %d %d", &lo, &hi) != 2)
+                {
+                    send(client_socket, "Invalid format\n", 15, 0);
+                    continue;
+                }
+
+                char response[64];
+                int len = snprintf(response, sizeof(response), "Count: %d\n",
+                                   db_count_range(current_table, lo, hi));
+                send(client_socket, response, len, 0);
+            }
             else if (strcmp(command, "SHOW") == 0 && strstr(buffer, "WAL"))
             {
-                wal_show_data();
-                send(client_socket, "WAL data displayed in server console\n", 37, 0);
+                // SHOW WAL [<table_id>|ALL [<start_seq> [<limit>]]]
+                char scope[16] = "ALL";
+                unsigned long long start = 0;
+                int limit = WAL_PAGE_ENTRIES;
+                sscanf(buffer, "SHOW WAL %15s %llu %d", scope, &start, &limit);
+                int table_id = strcmp(scope, "ALL") == 0 ? -1 : atoi(scope);
+                if (limit <= 0 || limit > MAX_LOOKUP_ROWS)
+                    limit = WAL_PAGE_ENTRIES;
+
+                WALEntryInfo entries[MAX_LOOKUP_ROWS];
+                WALStats stats;
+                int count = wal_inspect(table_id, start, entries, limit, &stats);
+                if (count < 0)
+                {
+                    send(client_socket, "WAL table not found\n", 20, 0);
+                    continue;
+                }
+
+                char response[BUFFER_SIZE];
+                int len = snprintf(response, sizeof(response),
+                                   "WAL: %d tables, %llu entries (%llu bytes of %llu slots), %llu committed, "
+                                   "%llu checkpointed rows, %llu commit records\n",
+                                   stats.tables, (unsigned long long)stats.entries,
+                                   (unsigned long long)stats.bytes, (unsigned long long)stats.capacity,
+                                   (unsigned long long)stats.committed, (unsigned long long)stats.checkpoint_rows,
+                                   (unsigned long long)stats.commit_records);
+                if (stats.oldest_uncommitted_txn >= 0)
+                {
+                    len += snprintf(response + len, sizeof(response) - len,
+                                    "Oldest uncommitted: txn %d at seq %llu\n", stats.oldest_uncommitted_txn,
+                                    (unsigned long long)stats.oldest_uncommitted_seq);
+                }
+
+                // Leave room for the line that continues the listing
+                size_t room = sizeof(response) - 64;
+                int shown = 0;
+                for (; shown < count; shown++)
+                {
+                    const WALEntryInfo *e = &entries[shown];
+                    int written = snprintf(response + len, room - len,
+                                           "Entry %llu: Table: %d | Txn: %d | Key: %d | Operation: %s | Size: %u | %s\n",
+                                           (unsigned long long)e->seq, e->table_id, e->txn_id, e->key,
+                                           wal_op_name(e->op), e->size, e->committed ? "COMMITTED" : "");
+                    if (written < 0 || (size_t)written >= room - len)
+                    {
+                        break; // Response buffer full
+                    }
+                    len += written;
+                }
+                if (shown > 0)
+                {
+                    len += snprintf(response + len, sizeof(response) - len, "Next: SHOW WAL %s %llu %d\n", scope,
+                                    (unsigned long long)entries[shown - 1].seq + 1, limit);
+                }
+                send(client_socket, response, len, 0);
+            }
+            else if (strcmp(command, "SET") == 0 && strstr(buffer, "DURABILITY"))
+            {
+                // SET DURABILITY TABLE SYNC|ASYNC, or
+                // SET DURABILITY TRANSACTION SYNC|ASYNC|DEFAULT
+                char scope[16], level[16];
+                if (sscanf(buffer, "SET DURABILITY %15s %15s", scope, level) != 2)
+                {
+                    send(client_socket, "Invalid format\n", 15, 0);
+                    continue;
+                }
+                Durability durability = strcmp(level, "SYNC") == 0    ? DURABILITY_SYNC
+                                        : strcmp(level, "ASYNC") == 0 ? DURABILITY_ASYNC
+                                                                      : DURABILITY_DEFAULT;
+                bool ok = false;
+                if (strcmp(scope, "TABLE") == 0 && current_table)
+                {
+                    ok = db_set_table_durability(current_table, durability);
+                }
+                else if (strcmp(scope, "TRANSACTION") == 0 && current_txn_id >= 0 &&
+                         (durability != DURABILITY_DEFAULT || strcmp(level, "DEFAULT") == 0))
+                {
+                    ok = db_set_txn_durability(current_txn_id, durability);
+                }
+                if (ok)
+                {
+                    send(client_socket, "Durability set\n", 15, 0);
+                }
+                else
+                {
+                    send(client_socket, "Failed to set durability\n", 25, 0);
+                }
+            }
+            else if (strcmp(command, "DURABLE") == 0)
+            {
+                // DURABLE [WAIT [lsn]]: the durable LSN, optionally once
+                // lsn (by default this connection's last commit) is durable
+                unsigned long long lsn = wal_last_commit_lsn();
+                uint64_t durable;
+                if (strstr(buffer, "WAIT"))
+                {
+                    sscanf(buffer, "DURABLE WAIT %llu", &lsn);
+                    durable = wal_wait_durable(lsn);
+                }
+                else
+                {
+                    durable = wal_durable_lsn();
+                }
+
+                char response[96];
+                int len = snprintf(response, sizeof(response), "Durable LSN: %llu (last commit: %llu)\n",
+                                   (unsigned long long)durable, (unsigned long long)wal_last_commit_lsn());
+                send(client_socket, response, len, 0);
+            }
+            else if (strcmp(command, "CHECKPOINT") == 0)
+            {
+                char response[64];
+                int len = snprintf(response, sizeof(response), "Checkpointed %d WAL entries\n",
+                                   db_checkpoint());
+                send(client_socket, response, len, 0);
+            }
+            else if (strcmp(command, "LAG") == 0)
+            {
+                char response[96];
+                int len;
+                uint64_t commits, lag_ms;
+                if (repl_get_lag(&commits, &lag_ms))
+                {
+                    len = snprintf(response, sizeof(response), "Replication lag: %llu commits, %llu ms\n",
+                                   (unsigned long long)commits, (unsigned long long)lag_ms);
+                }
+                else
+                {
+                    len = snprintf(response, sizeof(response), "Followers: %d\n", repl_follower_count());
+                }
+                send(client_socket, response, len, 0);
             }
             else if (strcmp(command, "EXIT") == 0)
             {
@@ -251,16 +620,95 @@ void db_init_with_recovery() {
     // Initialize database structures
     db_init();
     
-    // Recover WAL if needed
-    wal_recover();
+    // Rebuild the tables from their committed WAL entries
+    db_recover();
     
     printf("Database initialization with WAL recovery complete\n");
 }
 
 
-int main()
+static void usage(const char *program)
 {
+    printf("Usage: %s [window_us] [--port N] [--nvram PATH] [--ship-port N] [--replica-of HOST:PORT] [--lock-timeout MS]\n"
+           "       [--deadlock detect|wait-die|wound-wait|timeout]\n", program);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int port = PORT;
+    int ship_port = 0;
+    char *leader = NULL;
+    int lock_timeout_ms = LOCK_WAIT_TIMEOUT_MS;
+    DeadlockPolicy deadlock_policy = DEADLOCK_DETECT;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--port") == 0 && has_value)
+        {
+            port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--nvram") == 0 && has_value)
+        {
+            // Each process on a machine needs its own region or file
+            set_nvram_path(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--ship-port") == 0 && has_value)
+        {
+            // Ship committed transactions to followers connecting here
+            ship_port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--replica-of") == 0 && has_value)
+        {
+            leader = argv[++i];
+        }
+        else if (strcmp(argv[i], "--lock-timeout") == 0 && has_value)
+        {
+            // How long a conflicting lock request waits (-1: no limit)
+            lock_timeout_ms = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--deadlock") == 0 && has_value)
+        {
+            if (!parse_deadlock_policy(argv[++i], &deadlock_policy))
+            {
+                usage(argv[0]);
+            }
+        }
+        else if (i == 1 && argv[i][0] != '-')
+        {
+            // Group commit window in microseconds
+            wal_set_group_commit_window((unsigned int)atoi(argv[i]));
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+
+    char *leader_port = leader ? strrchr(leader, ':') : NULL;
+    if (leader && !leader_port)
+    {
+        usage(argv[0]);
+    }
+
     db_init_with_recovery();
+    lock_manager_set_wait_timeout(&g_lock_manager, lock_timeout_ms);
+    lock_manager_set_deadlock_policy(&g_lock_manager, deadlock_policy);
+
+    if (ship_port > 0 && !repl_start_leader(ship_port, db_replication_snapshot))
+    {
+        exit(1);
+    }
+    if (leader)
+    {
+        *leader_port = '\0';
+        read_only = true;
+        if (!repl_start_follower(leader, atoi(leader_port + 1)))
+        {
+            exit(1);
+        }
+    }
 
     int server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0)
@@ -273,7 +721,7 @@ int main()
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(port);
 
     if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
     {
@@ -287,7 +735,7 @@ int main()
         exit(1);
     }
 
-    printf("Server listening on port %d\n", PORT);
+    printf("Server listening on port %d%s\n", port, read_only ? " (read-only replica)" : "");
 
     while (1)
     {
@@ -1,14 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
+#include "../include/free_space.h"
+#include "../include/wal.h"
 
 #define FILEPATH "/dev/dax0.0"
 #define FILESIZE (2L * 1024 * 1024 * 1024) // 2GB
 
+// Every block is a multiple of ALLOC_ALIGN, so every block starts aligned
+// and 8-byte words inside rows can be written atomically
+#define ALIGN_UP(size) (((size) + ALLOC_ALIGN - 1) & ~(size_t)(ALLOC_ALIGN - 1))
+
 pthread_mutex_t free_space_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Structure for free space block
@@ -22,18 +29,62 @@ typedef struct FreeBlock
 FreeBlock *freeList = NULL; // Head of free space list
 void *nvram_map = NULL;     // Pointer to mapped NVRAM
 int fd = -1;
+static uint64_t *alloc_root = NULL; // Persistent high-water mark (superblock region)
+static const char *nvram_path = FILEPATH;
+static bool nvram_path_set = false; // A file backend may be created
+
+// Advance the persistent high-water mark past a new allocation (mutex held)
+static void note_allocated(size_t end)
+{
+    if (alloc_root && end > *alloc_root)
+    {
+        *alloc_root = (end + ALLOC_ROOT_STEP - 1) & ~(uint64_t)(ALLOC_ROOT_STEP - 1);
+        flush_range(alloc_root, sizeof(uint64_t));
+    }
+}
+
+void set_nvram_path(const char *path)
+{
+    nvram_path = path;
+    nvram_path_set = true;
+}
+
+const char *get_nvram_path()
+{
+    return nvram_path;
+}
 
 // Initialize NVRAM mapping and free space list
 void init_free_space()
 {
-    fd = open(FILEPATH, O_RDWR);
+    fd = open(nvram_path, nvram_path_set ? O_RDWR | O_CREAT : O_RDWR, 0600);
     if (fd == -1)
     {
         perror("Error opening NVRAM file");
         exit(1);
     }
 
-    nvram_map = mmap(NULL, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // A file backend must cover the whole mapping
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < FILESIZE && ftruncate(fd, FILESIZE) != 0)
+    {
+        perror("Error sizing NVRAM file");
+        close(fd);
+        exit(1);
+    }
+
+    // WAL links and row slots hold absolute addresses, so always map at the
+    // same place
+#ifdef MAP_FIXED_NOREPLACE
+    nvram_map = mmap(NVRAM_MAP_BASE, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+#else
+    nvram_map = mmap(NVRAM_MAP_BASE, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+#endif
+    if (nvram_map == MAP_FAILED)
+    {
+        printf("Warning: Could not map NVRAM at %p\n", NVRAM_MAP_BASE);
+        nvram_map = mmap(NULL, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
     if (nvram_map == MAP_FAILED)
     {
         perror("Error mapping NVRAM file");
@@ -41,16 +92,117 @@ void init_free_space()
         exit(1);
     }
 
-    // Initially, all 2GB is free
+    // Initially, all 2GB except the superblock region is free
     freeList = (FreeBlock *)malloc(sizeof(FreeBlock));
-    freeList->size = FILESIZE;
-    freeList->offset = 0;
+    freeList->size = FILESIZE - NVRAM_RESERVED;
+    freeList->offset = NVRAM_RESERVED;
     freeList->next = NULL;
 }
 
+// Attach the persistent allocator root
+void free_space_attach_root(uint64_t *root, bool existing)
+{
+    pthread_mutex_lock(&free_space_mutex);
+    alloc_root = root;
+
+    if (!existing || *root < NVRAM_RESERVED || *root > (uint64_t)FILESIZE)
+    {
+        // Nothing allocated before this run survives
+        *root = NVRAM_RESERVED;
+        flush_range(root, sizeof(uint64_t));
+    }
+    else
+    {
+        // Blocks of the previous run below the mark stay allocated until
+        // recovery knows which of them are still reachable
+        while (freeList && freeList->offset + freeList->size <= *root)
+        {
+            FreeBlock *temp = freeList;
+            freeList = freeList->next;
+            free(temp);
+        }
+        if (freeList && freeList->offset < *root)
+        {
+            freeList->size -= *root - freeList->offset;
+            freeList->offset = *root;
+        }
+    }
+
+    pthread_mutex_unlock(&free_space_mutex);
+}
+
+// Sort helper for used blocks
+static int compare_used_blocks(const void *a, const void *b)
+{
+    const UsedBlock *x = (const UsedBlock *)a, *y = (const UsedBlock *)b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Append a free block to a list being built (NULL on allocation failure)
+static FreeBlock **append_free_block(FreeBlock **tail, size_t offset, size_t size)
+{
+    FreeBlock *block = (FreeBlock *)malloc(sizeof(FreeBlock));
+    if (!block)
+        return NULL;
+    block->offset = offset;
+    block->size = size;
+    block->next = NULL;
+    *tail = block;
+    return &block->next;
+}
+
+// Rebuild the free list from the blocks still in use after a restart
+bool free_space_rebuild(UsedBlock *used, int count)
+{
+    qsort(used, count, sizeof(UsedBlock), compare_used_blocks);
+
+    FreeBlock *list = NULL, **tail = &list;
+    size_t end = NVRAM_RESERVED;
+    for (int i = 0; i < count && tail; i++)
+    {
+        if (used[i].offset > end)
+            tail = append_free_block(tail, end, used[i].offset - end);
+        if (used[i].offset + ALIGN_UP(used[i].size) > end)
+            end = used[i].offset + ALIGN_UP(used[i].size);
+    }
+    if (tail && end < (size_t)FILESIZE)
+        tail = append_free_block(tail, end, FILESIZE - end);
+
+    if (!tail)
+    {
+        // Keep the old list: it only wastes the blocks it does not know
+        while (list)
+        {
+            FreeBlock *temp = list;
+            list = list->next;
+            free(temp);
+        }
+        return false;
+    }
+
+    pthread_mutex_lock(&free_space_mutex);
+    FreeBlock *old = freeList;
+    freeList = list;
+    if (alloc_root)
+    {
+        *alloc_root = (end + ALLOC_ROOT_STEP - 1) & ~(uint64_t)(ALLOC_ROOT_STEP - 1);
+        flush_range(alloc_root, sizeof(uint64_t));
+    }
+    pthread_mutex_unlock(&free_space_mutex);
+
+    while (old)
+    {
+        FreeBlock *temp = old;
+        old = old->next;
+        free(temp);
+    }
+    return true;
+}
+
 // Allocate memory using first-fit algorithm
 void *allocate_memory(size_t size)
 {
+    size = ALIGN_UP(size);
     pthread_mutex_lock(&free_space_mutex);
     FreeBlock *current = freeList, *prev = NULL;
 
@@ -76,6 +228,7 @@ void *allocate_memory(size_t size)
                 current->offset += size;
                 current->size -= size;
             }
+            note_allocated((char *)allocated_memory - (char *)nvram_map + size);
             pthread_mutex_unlock(&free_space_mutex);
             return allocated_memory;
         }
@@ -86,9 +239,63 @@ void *allocate_memory(size_t size)
     return NULL;
 }
 
+// Allocate memory whose NVRAM offset is a multiple of align (a power of two).
+// Padding in front of the block stays on the free list.
+void *allocate_aligned(size_t size, size_t align)
+{
+    size = ALIGN_UP(size);
+    pthread_mutex_lock(&free_space_mutex);
+    FreeBlock *current = freeList, *prev = NULL;
+
+    while (current)
+    {
+        size_t start = (current->offset + align - 1) & ~(align - 1);
+        size_t pad = start - current->offset;
+        if (current->size >= pad + size)
+        {
+            size_t tail = current->size - pad - size;
+            if (tail > 0)
+            {
+                FreeBlock *rest = (FreeBlock *)malloc(sizeof(FreeBlock));
+                if (!rest)
+                    break;
+                rest->offset = start + size;
+                rest->size = tail;
+                rest->next = current->next;
+                current->next = rest;
+            }
+
+            if (pad > 0)
+            {
+                current->size = pad;
+            }
+            else
+            {
+                if (prev)
+                {
+                    prev->next = current->next;
+                }
+                else
+                {
+                    freeList = current->next;
+                }
+                free(current);
+            }
+            note_allocated(start + size);
+            pthread_mutex_unlock(&free_space_mutex);
+            return (char *)nvram_map + start;
+        }
+        prev = current;
+        current = current->next;
+    }
+    pthread_mutex_unlock(&free_space_mutex);
+    return NULL;
+}
+
 // Free allocated memory and merge free blocks
 void free_memory(void *ptr, size_t size)
 {
+    size = ALIGN_UP(size);
     pthread_mutex_lock(&free_space_mutex);
     size_t offset = (char *)ptr - (char *)nvram_map;
     FreeBlock *newBlock = (FreeBlock *)malloc(sizeof(FreeBlock));
@@ -1,15 +1,46 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <immintrin.h>  // For _mm_pause
 #include "../include/lock_manager.h"
 
 // Initialize lock manager
 void lock_manager_init(LockManager *lm)
 {
-    lm->lock_table = NULL;
-    lm->transactions = NULL;
+    for (int i = 0; i < LOCK_TABLE_BUCKETS; i++)
+    {
+        pthread_mutex_init(&lm->lock_table[i].latch, NULL);
+        lm->lock_table[i].entries = NULL;
+    }
+    for (int i = 0; i < TXN_TABLE_BUCKETS; i++)
+    {
+        pthread_mutex_init(&lm->txn_table[i].latch, NULL);
+        lm->txn_table[i].txns = NULL;
+    }
+    lm->free_txns = NULL;
     pthread_mutex_init(&lm->mutex, NULL);
     lm->next_txn_id = 1;
+    lm->wait_timeout_ms = LOCK_WAIT_TIMEOUT_MS;
+    lm->waiters = 0;
+    lm->deadlock_policy = DEADLOCK_TIMEOUT;
+    lm->detector_running = false;
+    lock_manager_set_deadlock_policy(lm, DEADLOCK_DETECT);
+}
+
+// Set how long lock_acquire waits for a lock
+void lock_manager_set_wait_timeout(LockManager *lm, int timeout_ms)
+{
+    __atomic_store_n(&lm->wait_timeout_ms, timeout_ms, __ATOMIC_RELAXED);
+}
+
+// Bucket of a transaction. IDs are handed out in order, so consecutive
+// transactions land in consecutive buckets.
+static TxnBucket *txn_bucket(LockManager *lm, int txn_id)
+{
+    return &lm->txn_table[(unsigned int)txn_id & (TXN_TABLE_BUCKETS - 1)];
 }
 
 // Start a new transaction
@@ -17,21 +48,37 @@ int transaction_begin(LockManager *lm)
 {
     pthread_mutex_lock(&lm->mutex);
 
-    // Create new transaction
-    Transaction *txn = (Transaction *)malloc(sizeof(Transaction));
-    if (!txn)
+    // Reuse a finished transaction, or create a new one
+    Transaction *txn = lm->free_txns;
+    if (txn)
     {
-        pthread_mutex_unlock(&lm->mutex);
-        return -1;
+        lm->free_txns = txn->next;
+    }
+    else
+    {
+        txn = (Transaction *)malloc(sizeof(Transaction));
+        if (!txn)
+        {
+            pthread_mutex_unlock(&lm->mutex);
+            return -1;
+        }
+        pthread_mutex_init(&txn->latch, NULL);
     }
 
     txn->id = lm->next_txn_id++;
     txn->active = true;
+    txn->victim = false;
+    txn->committing = false;
     txn->held_locks = NULL;
+    txn->waiting = NULL;
 
-    // Add to transaction list
-    txn->next = lm->transactions;
-    lm->transactions = txn;
+    // Add to the transaction table before the mutex is released, so
+    // transaction_oldest_active sees every ID below next_txn_id that runs
+    TxnBucket *bucket = txn_bucket(lm, txn->id);
+    pthread_mutex_lock(&bucket->latch);
+    txn->next = bucket->txns;
+    bucket->txns = txn;
+    pthread_mutex_unlock(&bucket->latch);
 
     int txn_id = txn->id;
     pthread_mutex_unlock(&lm->mutex);
@@ -39,25 +86,66 @@ int transaction_begin(LockManager *lm)
     return txn_id;
 }
 
-// Find a transaction by ID
-static Transaction *find_transaction(LockManager *lm, int txn_id)
+// Find a running transaction by ID and lock its latch. Returns NULL if it
+// has finished (or never existed).
+static Transaction *lock_transaction(LockManager *lm, int txn_id)
 {
-    Transaction *txn = lm->transactions;
+    TxnBucket *bucket = txn_bucket(lm, txn_id);
+    pthread_mutex_lock(&bucket->latch);
+    Transaction *txn = bucket->txns;
     while (txn)
     {
         if (txn->id == txn_id)
         {
-            return txn;
+            pthread_mutex_lock(&txn->latch);
+            break;
         }
         txn = txn->next;
     }
-    return NULL;
+    pthread_mutex_unlock(&bucket->latch);
+    return txn;
+}
+
+// Take a finished transaction out of the table and keep it for reuse
+static void recycle_transaction(LockManager *lm, int txn_id)
+{
+    TxnBucket *bucket = txn_bucket(lm, txn_id);
+    pthread_mutex_lock(&bucket->latch);
+    Transaction **link = &bucket->txns;
+    while (*link && (*link)->id != txn_id)
+    {
+        link = &(*link)->next;
+    }
+    Transaction *txn = *link;
+    if (txn)
+    {
+        *link = txn->next;
+
+        // Wait out a thread that found it before it was unlinked
+        pthread_mutex_lock(&txn->latch);
+        pthread_mutex_unlock(&txn->latch);
+    }
+    pthread_mutex_unlock(&bucket->latch);
+    if (!txn)
+        return;
+
+    pthread_mutex_lock(&lm->mutex);
+    txn->next = lm->free_txns;
+    lm->free_txns = txn;
+    pthread_mutex_unlock(&lm->mutex);
+}
+
+// Bucket of a resource
+static LockBucket *lock_bucket(LockManager *lm, int resource_id, bool is_table)
+{
+    unsigned int hash = ((unsigned int)resource_id * 2654435761u) ^ (is_table ? 0x9e3779b9u : 0);
+    return &lm->lock_table[(hash ^ (hash >> 16)) & (LOCK_TABLE_BUCKETS - 1)];
 }
 
-// Find a lock entry
-static LockEntry *find_lock_entry(LockManager *lm, int resource_id, bool is_table)
+// Find a lock entry (bucket latch held)
+static LockEntry *find_lock_entry(LockBucket *bucket, int resource_id, bool is_table)
 {
-    LockEntry *entry = lm->lock_table;
+    LockEntry *entry = bucket->entries;
     while (entry)
     {
         if (entry->resource_id == resource_id && entry->is_table == is_table)
@@ -69,12 +157,28 @@ static LockEntry *find_lock_entry(LockManager *lm, int resource_id, bool is_tabl
     return NULL;
 }
 
-// Add a lock request to transaction's held locks
-static void add_lock_to_transaction(Transaction *txn, int resource_id, bool is_table, LockMode mode)
+// Free an entry nobody holds or waits for (bucket latch held), so the
+// table only holds the resources in use
+static void free_if_idle(LockBucket *bucket, LockEntry *entry)
+{
+    if (entry->shared_count > 0 || entry->exclusive_owner != -1 || entry->waiting_list)
+        return;
+
+    LockEntry **link = &bucket->entries;
+    while (*link != entry)
+    {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    free(entry);
+}
+
+// Add a lock request to transaction's held locks (transaction latch held)
+static bool add_lock_to_transaction(Transaction *txn, int resource_id, bool is_table, LockMode mode)
 {
     LockRequest *req = (LockRequest *)malloc(sizeof(LockRequest));
     if (!req)
-        return;
+        return false;
 
     req->transaction_id = txn->id;
     req->resource_id = resource_id;
@@ -83,9 +187,101 @@ static void add_lock_to_transaction(Transaction *txn, int resource_id, bool is_t
 
     req->next = txn->held_locks;
     txn->held_locks = req;
+    return true;
 }
 
-// Can a lock be granted?
+// Link of a transaction's shared hold in an entry (bucket latch held).
+// Points at NULL if it holds none.
+static LockHolder **find_holder(LockEntry *entry, int txn_id)
+{
+    LockHolder **link = &entry->shared_holders;
+    while (*link && (*link)->transaction_id != txn_id)
+    {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Shared locks a transaction holds on an entry (bucket latch held)
+static int shared_holds(LockEntry *entry, int txn_id)
+{
+    LockHolder *holder = *find_holder(entry, txn_id);
+    return holder ? holder->count : 0;
+}
+
+// Record a granted lock in its entry and in the transaction (bucket latch
+// held). A transaction that has finished, or was made a deadlock victim,
+// gets no more locks.
+static bool grant_lock(LockManager *lm, LockEntry *entry, int txn_id, LockMode mode)
+{
+    LockHolder **link = find_holder(entry, txn_id);
+    if (mode == LOCK_SHARED && !*link)
+    {
+        *link = (LockHolder *)malloc(sizeof(LockHolder));
+        if (!*link)
+            return false;
+        (*link)->transaction_id = txn_id;
+        (*link)->count = 0;
+        (*link)->next = NULL;
+    }
+
+    Transaction *txn = lock_transaction(lm, txn_id);
+    bool granted = false;
+    if (txn)
+    {
+        granted = txn->active && !txn->victim && add_lock_to_transaction(txn, entry->resource_id, entry->is_table, mode);
+        pthread_mutex_unlock(&txn->latch);
+    }
+    if (!granted)
+    {
+        if (mode == LOCK_SHARED && (*link)->count == 0)
+        {
+            LockHolder *unused = *link;
+            *link = unused->next;
+            free(unused);
+        }
+        return false;
+    }
+
+    if (mode == LOCK_SHARED)
+    {
+        entry->shared_count++;
+        (*link)->count++;
+    }
+    else if (entry->exclusive_owner == txn_id)
+    {
+        entry->exclusive_count++;
+    }
+    else
+    { // LOCK_EXCLUSIVE
+        entry->exclusive_owner = txn_id;
+        entry->exclusive_count = 1;
+    }
+    return true;
+}
+
+// Give back a held lock in its entry (bucket latch held). The exclusive
+// owner keeps the lock until it has released every acquisition.
+static void drop_lock(LockEntry *entry, int txn_id, LockMode mode)
+{
+    if (mode == LOCK_SHARED)
+    {
+        entry->shared_count--;
+        LockHolder **link = find_holder(entry, txn_id);
+        LockHolder *holder = *link;
+        if (holder && --holder->count == 0)
+        {
+            *link = holder->next;
+            free(holder);
+        }
+    }
+    else if (--entry->exclusive_count == 0)
+    { // LOCK_EXCLUSIVE
+        entry->exclusive_owner = -1;
+    }
+}
+
+// Can a lock be granted? (bucket latch held)
 static bool can_grant_lock(LockEntry *entry, LockMode mode, int txn_id)
 {
     if (mode == LOCK_SHARED)
@@ -98,167 +294,408 @@ static bool can_grant_lock(LockEntry *entry, LockMode mode, int txn_id)
     else
     { // LOCK_EXCLUSIVE
         // Exclusive lock can be granted if:
-        // 1. No exclusive lock and no shared locks
+        // 1. No exclusive lock and no shared locks but the transaction's own
         // 2. The transaction already holds the exclusive lock
-        return ((entry->exclusive_owner == -1 && entry->shared_count == 0) ||
-                entry->exclusive_owner == txn_id);
+        if (entry->exclusive_owner == txn_id)
+            return true;
+        return entry->exclusive_owner == -1 &&
+               entry->shared_count == shared_holds(entry, txn_id);
     }
 }
 
-// Process waiting lock requests
+// Hand the lock to waiting requests in order, up to the first that still
+// conflicts (bucket latch held)
 static void process_waiting_requests(LockManager *lm, LockEntry *entry)
 {
-    LockRequest *prev = NULL;
-    LockRequest *curr = entry->waiting_list;
+    while (entry->waiting_list)
+    {
+        LockRequest *req = entry->waiting_list;
+        if (!can_grant_lock(entry, req->mode, req->transaction_id))
+            break;
 
-    while (curr)
+        // Grant the lock, unless its transaction has finished
+        LockWaitStatus status = grant_lock(lm, entry, req->transaction_id, req->mode) ? LOCK_GRANTED : LOCK_REFUSED;
+        entry->waiting_list = req->next;
+
+        // The waiter may return as soon as it sees the status, so the
+        // request is not touched after it is set
+        pthread_cond_signal(req->wakeup);
+        __atomic_store_n(&req->status, status, __ATOMIC_RELEASE);
+    }
+}
+
+// Growable list of transaction IDs
+typedef struct TxnList {
+    int *ids;
+    int count;
+    int capacity;
+} TxnList;
+
+static bool txn_list_add(TxnList *list, int txn_id)
+{
+    if (list->count == list->capacity)
     {
-        if (can_grant_lock(entry, curr->mode, curr->transaction_id))
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        int *ids = (int *)realloc(list->ids, capacity * sizeof(int));
+        if (!ids)
+            return false;
+        list->ids = ids;
+        list->capacity = capacity;
+    }
+    list->ids[list->count++] = txn_id;
+    return true;
+}
+
+// Collect the transactions a request waits for (bucket latch held): the
+// holders of conflicting locks, and the conflicting requests queued ahead
+// of it, which are those before ahead_end in the waiting list
+static void collect_blockers(LockEntry *entry, int txn_id, LockMode mode, LockRequest *ahead_end, TxnList *out)
+{
+    if (entry->exclusive_owner != -1 && entry->exclusive_owner != txn_id)
+        txn_list_add(out, entry->exclusive_owner);
+
+    if (mode == LOCK_EXCLUSIVE)
+    {
+        for (LockHolder *holder = entry->shared_holders; holder; holder = holder->next)
         {
-            // Grant the lock
-            Transaction *txn = find_transaction(lm, curr->transaction_id);
-            if (txn)
-            {
-                if (curr->mode == LOCK_SHARED)
-                {
-                    entry->shared_count++;
-                }
-                else
-                { // LOCK_EXCLUSIVE
-                    entry->exclusive_owner = txn->id;
-                }
+            if (holder->transaction_id != txn_id)
+                txn_list_add(out, holder->transaction_id);
+        }
+    }
 
-                add_lock_to_transaction(txn, curr->resource_id, curr->is_table, curr->mode);
-            }
+    for (LockRequest *req = entry->waiting_list; req && req != ahead_end; req = req->next)
+    {
+        if (req->transaction_id != txn_id && (mode == LOCK_EXCLUSIVE || req->mode == LOCK_EXCLUSIVE))
+            txn_list_add(out, req->transaction_id);
+    }
+}
 
-            // Remove from waiting list
-            if (prev)
-            {
-                prev->next = curr->next;
-            }
-            else
-            {
-                entry->waiting_list = curr->next;
-            }
+// Make a running transaction a deadlock victim, unless it has started
+// committing. If its thread is waiting, it is woken; without the latch of
+// the bucket it waits in, the wakeup can be missed, so the caller holds that
+// latch or calls wake_victim after.
+static bool mark_victim(LockManager *lm, int txn_id)
+{
+    Transaction *txn = lock_transaction(lm, txn_id);
+    if (!txn)
+        return false;
+    bool marked = txn->active && !txn->victim && !txn->committing;
+    if (marked)
+    {
+        txn->victim = true;
+        if (txn->waiting)
+            pthread_cond_signal(txn->waiting->wakeup);
+    }
+    pthread_mutex_unlock(&txn->latch);
+    return marked;
+}
 
-            LockRequest *to_free = curr;
-            curr = curr->next;
-            free(to_free);
+static void release_all_locks(LockManager *lm, int txn_id);
+
+// Wake a victim waiting for a lock (no latch held)
+static void wake_victim(LockManager *lm, int txn_id)
+{
+    Transaction *txn = lock_transaction(lm, txn_id);
+    if (!txn)
+        return;
+    bool waiting = txn->waiting != NULL;
+    int resource_id = waiting ? txn->waiting->resource_id : 0;
+    bool is_table = waiting ? txn->waiting->is_table : false;
+    pthread_mutex_unlock(&txn->latch);
+    if (!waiting)
+        return;
+
+    // With the bucket latch held, the waiter is either asleep or has not
+    // checked whether it is a victim yet
+    LockBucket *bucket = lock_bucket(lm, resource_id, is_table);
+    pthread_mutex_lock(&bucket->latch);
+    txn = lock_transaction(lm, txn_id);
+    if (txn)
+    {
+        if (txn->waiting)
+            pthread_cond_signal(txn->waiting->wakeup);
+        pthread_mutex_unlock(&txn->latch);
+    }
+    pthread_mutex_unlock(&bucket->latch);
+}
+
+// Abort a wounded transaction without waiting for its thread (no latch
+// held). Its locks are released now and it gets no new ones; its thread
+// finds it is a victim at its next request or at commit, and the database
+// layer then discards its staged writes.
+static void abort_victim(LockManager *lm, int txn_id)
+{
+    wake_victim(lm, txn_id);
+    release_all_locks(lm, txn_id);
+}
+
+// An upgrade goes ahead of the waiting requests, which then wait for it
+// too. Can it, under a timestamp policy? Under wound-wait an older waiter
+// would wound it; under wait-die the younger waiters die. (bucket latch held)
+static bool upgrade_may_pass(LockManager *lm, LockEntry *entry, int txn_id, DeadlockPolicy policy)
+{
+    for (LockRequest *req = entry->waiting_list; req; req = req->next)
+    {
+        if (policy == DEADLOCK_WOUND_WAIT && req->transaction_id < txn_id)
+            return false;
+        if (policy == DEADLOCK_WAIT_DIE && req->transaction_id > txn_id)
+            mark_victim(lm, req->transaction_id);
+    }
+    return true;
+}
+
+// Take a waiting request that was not granted off the waiting list
+// (bucket latch held). Requests queued behind it may be grantable now.
+static void withdraw_request(LockManager *lm, LockBucket *bucket, LockEntry *entry, LockRequest *req,
+                             LockWaitStatus status)
+{
+    LockRequest **link = &entry->waiting_list;
+    while (*link != req)
+    {
+        link = &(*link)->next;
+    }
+    *link = req->next;
+    req->status = status;
+    process_waiting_requests(lm, entry);
+    free_if_idle(bucket, entry);
+}
+
+// Sleep until a waiting request is decided or the timeout passes (bucket
+// latch held). A request that times out, or whose transaction is made a
+// deadlock victim, is taken off the waiting list.
+static void wait_for_request(LockManager *lm, LockBucket *bucket, LockEntry *entry, LockRequest *req)
+{
+    int timeout_ms = __atomic_load_n(&lm->wait_timeout_ms, __ATOMIC_RELAXED);
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    while (req->status == LOCK_WAITING)
+    {
+        if (transaction_is_victim(lm, req->transaction_id))
+        {
+            withdraw_request(lm, bucket, entry, req, LOCK_DEADLOCK);
+            return;
         }
-        else
+
+        if (timeout_ms < 0)
         {
-            prev = curr;
-            curr = curr->next;
+            pthread_cond_wait(req->wakeup, &bucket->latch);
+        }
+        else if (pthread_cond_timedwait(req->wakeup, &bucket->latch, &deadline) == ETIMEDOUT)
+        {
+            break;
         }
     }
+    if (req->status == LOCK_WAITING)
+        withdraw_request(lm, bucket, entry, req, LOCK_REFUSED);
 }
 
 // Acquire a lock
 bool lock_acquire(LockManager *lm, int txn_id, int resource_id, bool is_table, LockMode mode)
 {
-    pthread_mutex_lock(&lm->mutex);
-
     // Find the transaction
-    Transaction *txn = find_transaction(lm, txn_id);
-    if (!txn || !txn->active)
+    Transaction *txn = lock_transaction(lm, txn_id);
+    if (!txn)
+    {
+        return false;
+    }
+    // A deadlock victim gets no more locks
+    bool active = txn->active && !txn->victim;
+    pthread_mutex_unlock(&txn->latch);
+    if (!active)
     {
-        pthread_mutex_unlock(&lm->mutex);
         return false;
     }
 
+    LockBucket *bucket = lock_bucket(lm, resource_id, is_table);
+    pthread_mutex_lock(&bucket->latch);
+
     // Find or create lock entry
-    LockEntry *entry = find_lock_entry(lm, resource_id, is_table);
+    LockEntry *entry = find_lock_entry(bucket, resource_id, is_table);
     if (!entry)
     {
         entry = (LockEntry *)malloc(sizeof(LockEntry));
         if (!entry)
         {
-            pthread_mutex_unlock(&lm->mutex);
+            pthread_mutex_unlock(&bucket->latch);
             return false;
         }
 
         entry->resource_id = resource_id;
         entry->is_table = is_table;
         entry->shared_count = 0;
+        entry->shared_holders = NULL;
         entry->exclusive_owner = -1;
+        entry->exclusive_count = 0;
         entry->waiting_list = NULL;
 
-        entry->next = lm->lock_table;
-        lm->lock_table = entry;
+        entry->next = bucket->entries;
+        bucket->entries = entry;
+    }
+
+    // Check if lock can be granted immediately. Waiting requests go first,
+    // unless the transaction holds the lock already and they wait for it.
+    DeadlockPolicy policy = __atomic_load_n(&lm->deadlock_policy, __ATOMIC_RELAXED);
+    bool holds = entry->waiting_list &&
+                 (entry->exclusive_owner == txn_id || shared_holds(entry, txn_id) > 0);
+    if (holds && mode == LOCK_EXCLUSIVE && entry->exclusive_owner != txn_id &&
+        !upgrade_may_pass(lm, entry, txn_id, policy))
+    {
+        mark_victim(lm, txn_id);
+        pthread_mutex_unlock(&bucket->latch);
+        return false;
+    }
+    if ((!entry->waiting_list || holds) && can_grant_lock(entry, mode, txn_id))
+    {
+        bool granted = grant_lock(lm, entry, txn_id, mode);
+        free_if_idle(bucket, entry);
+        pthread_mutex_unlock(&bucket->latch);
+        return granted;
+    }
+
+    if (__atomic_load_n(&lm->wait_timeout_ms, __ATOMIC_RELAXED) == 0)
+    {
+        free_if_idle(bucket, entry);
+        pthread_mutex_unlock(&bucket->latch);
+        return false;
     }
 
-    // Check if lock can be granted immediately
-    if (can_grant_lock(entry, mode, txn_id))
+    // Under a timestamp policy, compare the transaction with the ones it
+    // would wait for; smaller IDs are older. An upgrade waits only for the
+    // other holders, so it goes first.
+    TxnList blockers = {NULL, 0, 0};
+    if (policy == DEADLOCK_WAIT_DIE || policy == DEADLOCK_WOUND_WAIT)
+    {
+        collect_blockers(entry, txn_id, mode, holds ? entry->waiting_list : NULL, &blockers);
+    }
+    if (policy == DEADLOCK_WAIT_DIE)
     {
-        if (mode == LOCK_SHARED)
+        for (int i = 0; i < blockers.count; i++)
         {
-            entry->shared_count++;
+            if (blockers.ids[i] < txn_id)
+            {
+                // Waiting for an older transaction: die
+                free(blockers.ids);
+                mark_victim(lm, txn_id);
+                free_if_idle(bucket, entry);
+                pthread_mutex_unlock(&bucket->latch);
+                return false;
+            }
         }
-        else
-        { // LOCK_EXCLUSIVE
-            entry->exclusive_owner = txn_id;
+        blockers.count = 0;
+    }
+    else if (policy == DEADLOCK_WOUND_WAIT)
+    {
+        // Wound the younger ones; they are aborted once the latch is released.
+        // One that has started committing cannot be wounded, and is waited for.
+        int wounded = 0;
+        for (int i = 0; i < blockers.count; i++)
+        {
+            if (blockers.ids[i] > txn_id && mark_victim(lm, blockers.ids[i]))
+                blockers.ids[wounded++] = blockers.ids[i];
         }
+        blockers.count = wounded;
+    }
+
+    // Lock cannot be granted immediately - wait until a release hands it
+    // over
+    pthread_cond_t wakeup;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wakeup, &attr);
+    pthread_condattr_destroy(&attr);
 
-        add_lock_to_transaction(txn, resource_id, is_table, mode);
-        pthread_mutex_unlock(&lm->mutex);
-        return true;
+    LockRequest req;
+    req.transaction_id = txn_id;
+    req.resource_id = resource_id;
+    req.is_table = is_table;
+    req.mode = mode;
+    req.status = LOCK_WAITING;
+    req.wakeup = &wakeup;
+    req.next = NULL;
+
+    LockRequest **link = &entry->waiting_list;
+    while (*link && !holds)
+    {
+        link = &(*link)->next;
     }
+    req.next = *link;
+    *link = &req;
 
-    // Lock cannot be granted immediately - add to waiting list
-    // Note: This is a simplified version without deadlock detection
-    LockRequest *req = (LockRequest *)malloc(sizeof(LockRequest));
-    if (!req)
+    txn = lock_transaction(lm, txn_id);
+    if (txn)
     {
-        pthread_mutex_unlock(&lm->mutex);
-        return false;
+        txn->waiting = &req;
+        pthread_mutex_unlock(&txn->latch);
     }
+    int waiters = __atomic_add_fetch(&lm->waiters, 1, __ATOMIC_RELAXED);
 
-    req->transaction_id = txn_id;
-    req->resource_id = resource_id;
-    req->is_table = is_table;
-    req->mode = mode;
-    req->next = NULL;
+    pthread_mutex_unlock(&bucket->latch);
 
-    // Add to end of waiting list
-    if (entry->waiting_list == NULL)
+    for (int i = 0; i < blockers.count; i++)
     {
-        entry->waiting_list = req;
+        abort_victim(lm, blockers.ids[i]);
     }
-    else
+    free(blockers.ids);
+
+    // Locks are mostly held briefly, so check for a while before sleeping.
+    // Waiters spinning together take the cores their holders need to finish,
+    // so the spin is shared among the requests waiting now.
+    int spins = LOCK_SPIN_ITERATIONS / waiters;
+    for (int i = 0; i < spins; i++)
     {
-        LockRequest *last = entry->waiting_list;
-        while (last->next)
-        {
-            last = last->next;
-        }
-        last->next = req;
+        if (__atomic_load_n(&req.status, __ATOMIC_ACQUIRE) != LOCK_WAITING)
+            break;
+        _mm_pause();
     }
 
-    pthread_mutex_unlock(&lm->mutex);
+    if (__atomic_load_n(&req.status, __ATOMIC_ACQUIRE) == LOCK_WAITING)
+    {
+        pthread_mutex_lock(&bucket->latch);
+        wait_for_request(lm, bucket, entry, &req);
+        pthread_mutex_unlock(&bucket->latch);
+    }
+
+    // Nobody signals the request once it is off the transaction
+    txn = lock_transaction(lm, txn_id);
+    if (txn)
+    {
+        txn->waiting = NULL;
+        pthread_mutex_unlock(&txn->latch);
+    }
+    __atomic_sub_fetch(&lm->waiters, 1, __ATOMIC_RELAXED);
 
-    // In a real implementation, we would wait here and return when the lock is granted
-    // For simplicity, we just return false to indicate the lock couldn't be acquired immediately
-    return false;
+    pthread_cond_destroy(&wakeup);
+    return req.status == LOCK_GRANTED;
 }
 
 // Release a lock
 bool lock_release(LockManager *lm, int txn_id, int resource_id, bool is_table)
 {
-    pthread_mutex_lock(&lm->mutex);
+    LockBucket *bucket = lock_bucket(lm, resource_id, is_table);
+    pthread_mutex_lock(&bucket->latch);
 
-    // Find the transaction
-    Transaction *txn = find_transaction(lm, txn_id);
-    if (!txn)
+    // Find the lock entry
+    LockEntry *entry = find_lock_entry(bucket, resource_id, is_table);
+    if (!entry)
     {
-        pthread_mutex_unlock(&lm->mutex);
+        pthread_mutex_unlock(&bucket->latch);
         return false;
     }
 
-    // Find the lock entry
-    LockEntry *entry = find_lock_entry(lm, resource_id, is_table);
-    if (!entry)
+    // Find the transaction
+    Transaction *txn = lock_transaction(lm, txn_id);
+    if (!txn)
     {
-        pthread_mutex_unlock(&lm->mutex);
+        pthread_mutex_unlock(&bucket->latch);
         return false;
     }
 
@@ -280,18 +717,9 @@ bool lock_release(LockManager *lm, int txn_id, int resource_id, bool is_table)
                 txn->held_locks = curr->next;
             }
 
-            LockMode mode = curr->mode;
-            free(curr);
-
             // Update lock entry
-            if (mode == LOCK_SHARED)
-            {
-                entry->shared_count--;
-            }
-            else
-            { // LOCK_EXCLUSIVE
-                entry->exclusive_owner = -1;
-            }
+            drop_lock(entry, txn_id, curr->mode);
+            free(curr);
 
             found = true;
             break;
@@ -300,116 +728,391 @@ bool lock_release(LockManager *lm, int txn_id, int resource_id, bool is_table)
         prev = curr;
         curr = curr->next;
     }
+    pthread_mutex_unlock(&txn->latch);
 
-    if (!found)
+    if (found)
     {
-        pthread_mutex_unlock(&lm->mutex);
-        return false;
+        // Process waiting requests
+        process_waiting_requests(lm, entry);
+        free_if_idle(bucket, entry);
     }
 
-    // Process waiting requests
-    process_waiting_requests(lm, entry);
-
-    pthread_mutex_unlock(&lm->mutex);
-    return true;
+    pthread_mutex_unlock(&bucket->latch);
+    return found;
 }
 
-// Release all locks held by a transaction
-static void release_all_locks(LockManager *lm, Transaction *txn)
+// Release all locks held by a transaction that is no longer active
+static void release_all_locks(LockManager *lm, int txn_id)
 {
-    while (txn->held_locks)
+    while (1)
     {
+        Transaction *txn = lock_transaction(lm, txn_id);
+        if (!txn)
+            break;
         LockRequest *req = txn->held_locks;
-        txn->held_locks = req->next;
+        if (req)
+            txn->held_locks = req->next;
+        pthread_mutex_unlock(&txn->latch);
+        if (!req)
+            break;
 
         // Find the lock entry
-        LockEntry *entry = find_lock_entry(lm, req->resource_id, req->is_table);
+        LockBucket *bucket = lock_bucket(lm, req->resource_id, req->is_table);
+        pthread_mutex_lock(&bucket->latch);
+        LockEntry *entry = find_lock_entry(bucket, req->resource_id, req->is_table);
         if (entry)
         {
-            if (req->mode == LOCK_SHARED)
-            {
-                entry->shared_count--;
-            }
-            else
-            { // LOCK_EXCLUSIVE
-                entry->exclusive_owner = -1;
-            }
+            drop_lock(entry, txn_id, req->mode);
 
             // Process waiting requests
             process_waiting_requests(lm, entry);
+            free_if_idle(bucket, entry);
         }
+        pthread_mutex_unlock(&bucket->latch);
 
         free(req);
     }
 }
 
-// Commit a transaction
-bool transaction_commit(LockManager *lm, int txn_id)
+// Edge of the wait-for graph
+typedef struct WaitEdge {
+    int waiter;
+    int holder;
+} WaitEdge;
+
+static int compare_edges(const void *a, const void *b)
 {
-    pthread_mutex_lock(&lm->mutex);
+    const WaitEdge *x = (const WaitEdge *)a;
+    const WaitEdge *y = (const WaitEdge *)b;
+    if (x->waiter != y->waiter)
+        return x->waiter < y->waiter ? -1 : 1;
+    return (x->holder > y->holder) - (x->holder < y->holder);
+}
 
-    // Find the transaction
-    Transaction *txn = find_transaction(lm, txn_id);
-    if (!txn || !txn->active)
+// First edge of a waiter in the sorted edges, or -1 if it waits for nothing
+static int first_edge(const WaitEdge *edges, int count, int waiter)
+{
+    int low = 0, high = count;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (edges[mid].waiter < waiter)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return (low < count && edges[low].waiter == waiter) ? low : -1;
+}
+
+// Find a cycle in the wait-for graph and return its youngest transaction,
+// or -1 if there is none. A waiter is identified by its first edge, which
+// indexes state: 0 unvisited, 1 on the current path, 2 done, 3 removed.
+static int find_cycle_victim(const WaitEdge *edges, int count, char *state, int *path, int *cursor)
+{
+    for (int start = 0; start < count; start++)
+    {
+        if (state[start] != 0 || (start > 0 && edges[start - 1].waiter == edges[start].waiter))
+            continue;
+
+        int depth = 0;
+        path[0] = start;
+        cursor[0] = start;
+        state[start] = 1;
+        while (depth >= 0)
+        {
+            int node = path[depth];
+            int e = cursor[depth];
+            if (e == count || edges[e].waiter != edges[node].waiter)
+            {
+                state[node] = 2;
+                depth--;
+                continue;
+            }
+            cursor[depth]++;
+
+            int next = first_edge(edges, count, edges[e].holder);
+            if (next < 0 || state[next] >= 2)
+                continue;
+            if (state[next] == 1)
+            {
+                int victim = edges[next].waiter;
+                for (int d = depth; path[d] != next; d--)
+                {
+                    if (edges[path[d]].waiter > victim)
+                        victim = edges[path[d]].waiter;
+                }
+                return victim;
+            }
+            depth++;
+            path[depth] = next;
+            cursor[depth] = next;
+            state[next] = 1;
+        }
+    }
+    return -1;
+}
+
+// Break every cycle of waiting transactions by making its youngest one a
+// victim. All bucket latches are held, in order, so the graph is consistent
+// and no victim can miss its wakeup.
+static void detect_deadlocks(LockManager *lm)
+{
+    for (int i = 0; i < LOCK_TABLE_BUCKETS; i++)
+    {
+        pthread_mutex_lock(&lm->lock_table[i].latch);
+    }
+
+    // Edges from each waiting request to the transactions it waits for
+    WaitEdge *edges = NULL;
+    int count = 0, capacity = 0;
+    TxnList blockers = {NULL, 0, 0};
+    for (int i = 0; i < LOCK_TABLE_BUCKETS; i++)
+    {
+        for (LockEntry *entry = lm->lock_table[i].entries; entry; entry = entry->next)
+        {
+            for (LockRequest *req = entry->waiting_list; req; req = req->next)
+            {
+                blockers.count = 0;
+                collect_blockers(entry, req->transaction_id, req->mode, req, &blockers);
+                for (int b = 0; b < blockers.count; b++)
+                {
+                    if (count == capacity)
+                    {
+                        // Out of memory only hides cycles until the next pass
+                        WaitEdge *grown = (WaitEdge *)realloc(edges, (capacity ? capacity * 2 : 64) * sizeof(WaitEdge));
+                        if (!grown)
+                            break;
+                        edges = grown;
+                        capacity = capacity ? capacity * 2 : 64;
+                    }
+                    edges[count].waiter = req->transaction_id;
+                    edges[count].holder = blockers.ids[b];
+                    count++;
+                }
+            }
+        }
+    }
+
+    if (count > 0)
+    {
+        qsort(edges, count, sizeof(WaitEdge), compare_edges);
+        char *state = (char *)calloc(count, 1);
+        int *path = (int *)malloc(count * sizeof(int));
+        int *cursor = (int *)malloc(count * sizeof(int));
+        int victim;
+        while (state && path && cursor &&
+               (victim = find_cycle_victim(edges, count, state, path, cursor)) >= 0)
+        {
+            mark_victim(lm, victim);
+
+            // The victim's requests fail, so it stops waiting; look again
+            // without it
+            for (int e = 0; e < count; e++)
+            {
+                if (state[e] != 3)
+                    state[e] = 0;
+            }
+            state[first_edge(edges, count, victim)] = 3;
+        }
+        free(state);
+        free(path);
+        free(cursor);
+    }
+
+    free(edges);
+    free(blockers.ids);
+    for (int i = LOCK_TABLE_BUCKETS - 1; i >= 0; i--)
+    {
+        pthread_mutex_unlock(&lm->lock_table[i].latch);
+    }
+}
+
+static void *deadlock_detector_main(void *arg)
+{
+    LockManager *lm = (LockManager *)arg;
+    while (__atomic_load_n(&lm->detector_running, __ATOMIC_ACQUIRE))
+    {
+        usleep(LOCK_DEADLOCK_INTERVAL_MS * 1000);
+        if (__atomic_load_n(&lm->waiters, __ATOMIC_RELAXED) > 1)
+            detect_deadlocks(lm);
+    }
+    return NULL;
+}
+
+// Choose how deadlocks are resolved
+void lock_manager_set_deadlock_policy(LockManager *lm, DeadlockPolicy policy)
+{
+    if (lm->detector_running && policy != DEADLOCK_DETECT)
+    {
+        __atomic_store_n(&lm->detector_running, false, __ATOMIC_RELEASE);
+        pthread_join(lm->detector_thread, NULL);
+    }
+    __atomic_store_n(&lm->deadlock_policy, policy, __ATOMIC_RELAXED);
+    if (!lm->detector_running && policy == DEADLOCK_DETECT)
+    {
+        lm->detector_running = true;
+        if (pthread_create(&lm->detector_thread, NULL, deadlock_detector_main, lm) != 0)
+        {
+            printf("Error: Failed to start the deadlock detector\n");
+            lm->detector_running = false;
+        }
+    }
+}
+
+// Start committing a transaction
+bool transaction_prepare(LockManager *lm, int txn_id)
+{
+    Transaction *txn = lock_transaction(lm, txn_id);
+    if (!txn)
     {
-        pthread_mutex_unlock(&lm->mutex);
         return false;
     }
 
-    // Release all locks
-    release_all_locks(lm, txn);
+    bool prepared = txn->active && !txn->victim;
+    if (prepared)
+    {
+        txn->committing = true;
+    }
+    pthread_mutex_unlock(&txn->latch);
+    return prepared;
+}
 
-    // Mark transaction as inactive
-    txn->active = false;
+// Helper to end a transaction. A commit is refused to a deadlock victim,
+// which stays running until it is aborted.
+static bool finish_transaction(LockManager *lm, int txn_id, bool commit)
+{
+    // Find the transaction
+    Transaction *txn = lock_transaction(lm, txn_id);
+    if (!txn)
+    {
+        return false;
+    }
 
-    pthread_mutex_unlock(&lm->mutex);
+    // Mark transaction as inactive first, so no waiting request of it is
+    // granted while its locks are released
+    bool was_active = txn->active && !(commit && txn->victim);
+    if (was_active)
+    {
+        txn->active = false;
+    }
+    pthread_mutex_unlock(&txn->latch);
+    if (!was_active)
+    {
+        return false;
+    }
+
+    // Release all locks, then reuse the transaction
+    release_all_locks(lm, txn_id);
+    recycle_transaction(lm, txn_id);
     return true;
 }
 
+// Commit a transaction
+bool transaction_commit(LockManager *lm, int txn_id)
+{
+    return finish_transaction(lm, txn_id, true);
+}
+
 // Abort a transaction
 bool transaction_abort(LockManager *lm, int txn_id)
 {
-    // In a real implementation, we would also undo any changes made by the transaction
+    // The database layer discards the transaction's staged writes; only the
+    // locks are left to release
+    return finish_transaction(lm, txn_id, false);
+}
 
-    return transaction_commit(lm, txn_id);
+// Has a transaction begun and not finished?
+bool transaction_is_active(LockManager *lm, int txn_id)
+{
+    Transaction *txn = lock_transaction(lm, txn_id);
+    if (!txn)
+        return false;
+    bool active = txn->active;
+    pthread_mutex_unlock(&txn->latch);
+    return active;
+}
+
+// Was a running transaction made a deadlock victim?
+bool transaction_is_victim(LockManager *lm, int txn_id)
+{
+    Transaction *txn = lock_transaction(lm, txn_id);
+    if (!txn)
+        return false;
+    bool victim = txn->active && txn->victim;
+    pthread_mutex_unlock(&txn->latch);
+    return victim;
+}
+
+// Find the oldest running transaction
+int transaction_oldest_active(LockManager *lm)
+{
+    pthread_mutex_lock(&lm->mutex);
+    int oldest = lm->next_txn_id;
+    for (int i = 0; i < TXN_TABLE_BUCKETS; i++)
+    {
+        TxnBucket *bucket = &lm->txn_table[i];
+        pthread_mutex_lock(&bucket->latch);
+        for (Transaction *txn = bucket->txns; txn; txn = txn->next)
+        {
+            if (txn->active && txn->id < oldest)
+                oldest = txn->id;
+        }
+        pthread_mutex_unlock(&bucket->latch);
+    }
+    pthread_mutex_unlock(&lm->mutex);
+    return oldest;
 }
 
 // Clean up lock manager
 void lock_manager_cleanup(LockManager *lm)
 {
+    lock_manager_set_deadlock_policy(lm, DEADLOCK_TIMEOUT);
+
     // Free all lock entries
-    while (lm->lock_table)
+    for (int i = 0; i < LOCK_TABLE_BUCKETS; i++)
     {
-        LockEntry *entry = lm->lock_table;
-        lm->lock_table = entry->next;
-
-        // Free waiting list
-        while (entry->waiting_list)
+        LockBucket *bucket = &lm->lock_table[i];
+        while (bucket->entries)
         {
-            LockRequest *req = entry->waiting_list;
-            entry->waiting_list = req->next;
-            free(req);
-        }
+            LockEntry *entry = bucket->entries;
+            bucket->entries = entry->next;
+
+            while (entry->shared_holders)
+            {
+                LockHolder *holder = entry->shared_holders;
+                entry->shared_holders = holder->next;
+                free(holder);
+            }
 
-        free(entry);
+            // Waiting requests belong to their waiting threads
+            free(entry);
+        }
+        pthread_mutex_destroy(&bucket->latch);
     }
 
-    // Free all transactions
-    while (lm->transactions)
+    // Free all transactions, running or reusable
+    for (int i = 0; i <= TXN_TABLE_BUCKETS; i++)
     {
-        Transaction *txn = lm->transactions;
-        lm->transactions = txn->next;
-
-        // Free held locks
-        while (txn->held_locks)
+        Transaction **list = (i < TXN_TABLE_BUCKETS) ? &lm->txn_table[i].txns : &lm->free_txns;
+        while (*list)
         {
-            LockRequest *req = txn->held_locks;
-            txn->held_locks = req->next;
-            free(req);
-        }
+            Transaction *txn = *list;
+            *list = txn->next;
 
-        free(txn);
+            // Free held locks
+            while (txn->held_locks)
+            {
+                LockRequest *req = txn->held_locks;
+                txn->held_locks = req->next;
+                free(req);
+            }
+
+            pthread_mutex_destroy(&txn->latch);
+            free(txn);
+        }
+        if (i < TXN_TABLE_BUCKETS)
+            pthread_mutex_destroy(&lm->txn_table[i].latch);
     }
 
     pthread_mutex_destroy(&lm->mutex);
-}
\ No newline at end of file
+}
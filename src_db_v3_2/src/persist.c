@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <cpuid.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <immintrin.h>  // For Intel intrinsics (_mm_clwb, _mm_stream_si64, etc.)
+#include "../include/persist.h"
+
+#define LINE_SIZE 64
+
+// Until persist_init runs, use the conservative choice
+static PersistDomain domain = PERSIST_ADR;
+static void (*writeback_line)(void *line) = NULL;
+static void (*writeback_insn)(void *line) = NULL;
+static const char *writeback_name = "clflush";
+static bool stream_avx = false; // Stream 32 bytes per store instead of 16
+
+__attribute__((target("clwb")))
+static void writeback_clwb(void *line) {
+    _mm_clwb(line);
+}
+
+__attribute__((target("clflushopt")))
+static void writeback_clflushopt(void *line) {
+    _mm_clflushopt(line);
+}
+
+static void writeback_clflush(void *line) {
+    _mm_clflush(line);
+}
+
+// Pick the cheapest write-back instruction the CPU has. clwb keeps the line
+// cached; clflushopt evicts it; clflush evicts it and is serialized.
+static void select_writeback() {
+    unsigned int eax, ebx, ecx, edx;
+    writeback_insn = writeback_clflush;
+    writeback_name = "clflush";
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        if (ebx & bit_CLWB) {
+            writeback_insn = writeback_clwb;
+            writeback_name = "clwb";
+        } else if (ebx & bit_CLFLUSHOPT) {
+            writeback_insn = writeback_clflushopt;
+            writeback_name = "clflushopt";
+        }
+    }
+}
+
+static bool parse_domain(const char *name, PersistDomain *out) {
+    if (strcmp(name, "adr") == 0) {
+        *out = PERSIST_ADR;
+    } else if (strcmp(name, "eadr") == 0) {
+        *out = PERSIST_EADR;
+    } else if (strcmp(name, "none") == 0) {
+        *out = PERSIST_NONE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Read the persistence domain Linux reports for the NVDIMM region holding
+// device: sysfs has a persistence_domain file in the region directory above
+// the device ("cpu_cache" for eADR, "memory_controller" for ADR).
+static bool detect_domain(const char *device, PersistDomain *out) {
+    struct stat st;
+    if (stat(device, &st) != 0 || !(S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)))
+        return false;
+
+    char link[64], dir[PATH_MAX];
+    snprintf(link, sizeof(link), "/sys/dev/%s/%u:%u", S_ISCHR(st.st_mode) ? "char" : "block",
+             major(st.st_rdev), minor(st.st_rdev));
+    if (!realpath(link, dir))
+        return false;
+
+    for (int level = 0; level < 4; level++) {
+        char path[PATH_MAX + 32];
+        snprintf(path, sizeof(path), "%s/persistence_domain", dir);
+        FILE *f = fopen(path, "r");
+        if (f) {
+            char value[64] = "";
+            if (!fgets(value, sizeof(value), f))
+                value[0] = '\0';
+            fclose(f);
+            if (strncmp(value, "cpu_cache", 9) == 0) {
+                *out = PERSIST_EADR;
+                return true;
+            }
+            if (strncmp(value, "memory_controller", 17) == 0) {
+                *out = PERSIST_ADR;
+                return true;
+            }
+            return false;
+        }
+        char *slash = strrchr(dir, '/');
+        if (!slash || slash == dir)
+            break;
+        *slash = '\0';
+    }
+    return false;
+}
+
+void persist_init(const char *device) {
+    select_writeback();
+    __builtin_cpu_init();
+    stream_avx = __builtin_cpu_supports("avx");
+
+    PersistDomain chosen = PERSIST_ADR;
+    const char *env = getenv("NVRAM_PERSIST_DOMAIN");
+    if (env && !parse_domain(env, &chosen)) {
+        printf("Warning: Unknown NVRAM_PERSIST_DOMAIN '%s', using adr\n", env);
+    } else if (!env && device) {
+        detect_domain(device, &chosen);
+    }
+    persist_set_domain(chosen);
+    printf("Persistence domain: %s (write-back: %s)\n", persist_domain_name(domain), persist_flush_name());
+}
+
+PersistDomain persist_get_domain() {
+    return domain;
+}
+
+void persist_set_domain(PersistDomain new_domain) {
+    if (!writeback_insn)
+        select_writeback();
+    domain = new_domain;
+    // Only ADR needs cache lines written back
+    writeback_line = (domain == PERSIST_ADR) ? writeback_insn : NULL;
+}
+
+const char *persist_domain_name(PersistDomain d) {
+    switch (d) {
+    case PERSIST_ADR:  return "adr";
+    case PERSIST_EADR: return "eadr";
+    case PERSIST_NONE: return "none";
+    default:           return "unknown";
+    }
+}
+
+const char *persist_flush_name() {
+    return (domain == PERSIST_ADR) ? writeback_name : "none";
+}
+
+// NVRAM persistence functions
+void flush_range_nofence(void *start, size_t size) {
+    void (*writeback)(void *) = writeback_line;
+    if (!writeback || size == 0)
+        return;
+
+    // Every line the range touches, including a partial last line
+    uintptr_t line = (uintptr_t)start & ~(uintptr_t)(LINE_SIZE - 1);
+    uintptr_t end = (uintptr_t)start + size;
+    for (; line < end; line += LINE_SIZE) {
+        writeback((void *)line);
+    }
+}
+
+void flush_range(void *start, size_t size) {
+    flush_range_nofence(start, size);
+    persist_fence();
+}
+
+void flush_lines(uintptr_t *lines, size_t count) {
+    void (*writeback)(void *) = writeback_line;
+    if (writeback) {
+        for (size_t i = 0; i < count; i++) {
+            writeback((void *)lines[i]);
+        }
+    }
+    persist_fence();
+}
+
+void persist_fence() {
+    // Without a persistence domain there is nothing to order
+    if (domain != PERSIST_NONE)
+        _mm_sfence();
+}
+
+// Non-temporal copy of whole vectors to an aligned destination
+__attribute__((target("avx")))
+static void stream_copy_avx(char *dest, const char *src, size_t size) {
+    for (size_t i = 0; i < size; i += 32) {
+        _mm256_stream_si256((__m256i *)(dest + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+    }
+}
+
+static void stream_copy_sse(char *dest, const char *src, size_t size) {
+    for (size_t i = 0; i < size; i += 16) {
+        _mm_stream_si128((__m128i *)(dest + i), _mm_loadu_si128((const __m128i *)(src + i)));
+    }
+}
+
+void persist_copy(void *dest, const void *src, size_t size) {
+    if (size < PERSIST_STREAM_MIN) {
+        memcpy(dest, src, size);
+        flush_range(dest, size);
+        return;
+    }
+
+    // Cached stores up to the first aligned vector and after the last one;
+    // the vectors in between go straight to memory
+    size_t width = stream_avx ? 32 : 16;
+    size_t head = (width - ((uintptr_t)dest & (width - 1))) & (width - 1);
+    size_t body = (size - head) & ~(width - 1);
+    size_t tail = size - head - body;
+    char *d = (char *)dest;
+    const char *s = (const char *)src;
+
+    memcpy(d, s, head);
+    flush_range_nofence(d, head);
+    if (stream_avx) {
+        stream_copy_avx(d + head, s + head, body);
+    } else {
+        stream_copy_sse(d + head, s + head, body);
+    }
+    memcpy(d + head + body, s + head + body, tail);
+    flush_range_nofence(d + head + body, tail);
+
+    // Non-temporal stores are weakly ordered in every domain
+    _mm_sfence();
+}
+
+void atomic_write_64(void *dest, uint64_t val) {
+    if (domain == PERSIST_ADR) {
+        // Non-temporal store (movnti) goes straight to memory
+        _mm_stream_si64((long long *)dest, (long long)val);
+        _mm_sfence();
+    } else {
+        // A cached store is persistent once visible; keep the line cached
+        __atomic_store_n((uint64_t *)dest, val, __ATOMIC_RELEASE);
+        persist_fence();
+    }
+}
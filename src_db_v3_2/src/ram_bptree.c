@@ -1,20 +1,47 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "../include/free_space.h"
 #include "../include/ram_bptree.h"
 #include "../include/wal.h"
 #include "../include/lock_manager.h"
+#include "../include/sec_index.h"
+#include "../include/small_alloc.h"
+#include "../include/superblock.h"
+#include "../include/replication.h"
 
 // Maximum number of tables
 #define MAX_TABLES 10
 #define MAX_TABLE_NAME 64
+#define MAX_INDEXES 4 // Secondary indexes per table
+
+_Static_assert(MAX_INDEXES <= CATALOG_MAX_INDEXES, "The catalog must record every index of a table");
+
+// Background compaction of lazy-delete tables
+#define COMPACT_INTERVAL_MS 1000  // How often the compactor looks at tables
+#define COMPACT_UNDERFULL_RATIO 4 // Compact once 1/N of the nodes are underfull
+#define COMPACT_BATCH_LEAVES 64   // Leaves the compactor visits per latch hold
+
+// Background WAL checkpointing
+#define CHECKPOINT_INTERVAL_MS 1000 // How often the checkpointer looks at the logs
+
+// Asynchronous commits become durable within this many microseconds
+#define ASYNC_COMMIT_INTERVAL_US 1000
+
+// Rows are allocated in whole 8-byte words, so field writes may store the
+// word holding a row's last bytes
+#define ALIGN_ROW(size) (((size) + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1))
 
 // B+ Tree node structure (in RAM)
 struct BPTreeNode
 {
     bool is_leaf;           // Is this a leaf node?
     int num_keys;           // Number of keys currently stored
+    int count;              // Internal node: number of rows in the subtree
     int keys[BP_ORDER - 1]; // Array of keys (row IDs)
 
     union
@@ -22,12 +49,12 @@ struct BPTreeNode
         BPTreeNode *children[BP_ORDER]; // Internal node: pointers to children
         struct
         {
-            NVRAMPtr data_ptrs[BP_ORDER - 1]; // Leaf node: pointers to data in NVRAM
-            size_t data_sizes[BP_ORDER - 1];  // Size of each data item
+            uint64_t slots[BP_ORDER - 1]; // Leaf node: packed NVRAM offset and size of each row
         };
     };
 
     BPTreeNode *next_leaf; // Pointer to next leaf (for range queries)
+    BPTreeNode *prev_leaf; // Pointer to previous leaf (for reverse scans)
 };
 
 // B+ Tree structure (in RAM)
@@ -37,6 +64,10 @@ struct BPTree
     int height;       // Height of the tree
     int node_count;   // Number of nodes
     int record_count; // Number of records
+    unsigned long mod_count; // Bumped on every insert/delete (invalidates cursors)
+    TablePolicy policy;      // Split point and delete-time rebalancing policy
+    int pending_merges;      // Underfull leaves left behind by lazy deletes
+    pthread_rwlock_t latch;  // Protects the tree structure
 };
 
 // Table structure (in RAM)
@@ -46,16 +77,123 @@ struct Table
     int table_id;              // Unique ID
     BPTree *index;             // B+ Tree index
     bool is_open;              // Is table open
+    SecondaryIndex *indexes[MAX_INDEXES]; // Secondary indexes (guarded by the tree latch)
+    int index_count;                      // Number of secondary indexes
+    Durability durability;                // Commit durability of transactions writing only such tables
 };
 
 // Global state
 static Table *tables[MAX_TABLES] = {NULL};
 static int next_table_id = 0;
 static bool is_initialized = false;
+// Opened an existing database whose allocators db_recover has yet to rebuild
+// (checkpoints wait for it, as they allocate and free log blocks)
+static volatile bool allocators_stale = false;
+
+// Old row version replaced by a copy-on-write update
+typedef struct RetiredVersion
+{
+    NVRAMPtr data;
+    size_t size;
+    struct RetiredVersion *next;
+} RetiredVersion;
+
+// Aligned 8-byte word of a committed row that a transaction overwrites
+typedef struct FieldDelta
+{
+    uint32_t offset; // Offset of the word in the row
+    uint64_t value;  // New contents of the word
+    struct FieldDelta *next;
+} FieldDelta;
+
+// Row written by a transaction. The new version is staged in NVRAM and
+// logged, but reaches the table's index only when the transaction commits.
+// Field writes to a committed row are staged as word deltas instead, and
+// stored into the row in place at commit.
+typedef struct WriteSetEntry
+{
+    Table *table;
+    int key;
+    NVRAMPtr data; // Staged version (NULL if the transaction deleted the row)
+    size_t size;
+    FieldDelta *fields; // Words to overwrite in the committed row (data is then NULL)
+    void *view;         // Copy of the row with the field writes laid over, for reads
+    struct WriteSetEntry *hash_next; // Next entry in the same bucket
+    struct WriteSetEntry *next;      // Next entry of the transaction
+} WriteSetEntry;
+
+#define WRITE_SET_MIN_BUCKETS 16
+
+// Per-transaction state kept by the database layer (in RAM)
+typedef struct TxnContext
+{
+    int txn_id;
+    Durability durability;   // Set for this transaction (DURABILITY_DEFAULT: from the tables)
+    uint64_t commit_lsn;     // Asynchronous commit: released once this LSN is durable
+    RetiredVersion *retired; // Freed once the transaction ends
+    unsigned int table_mask; // Bit i is set once table i has been written
+    WriteSetEntry *writes;   // Rows written (only touched by the transaction's own calls)
+    WriteSetEntry **write_buckets; // Hash of the writes by key
+    int write_count;
+    int write_bucket_count;
+    uintptr_t *dirty_lines;  // Cache lines of small rows, flushed once when the transaction ends
+    int dirty_count;
+    int dirty_capacity;
+    IndexEntry *index_spares; // Reserved for the secondary index entries the writes add at commit
+    struct TxnContext *next;
+} TxnContext;
+
+static TxnContext *txn_contexts = NULL;
+static pthread_mutex_t txn_context_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Contexts of asynchronously committed transactions. Until their commit is
+// durable, a crash brings back the versions they retired, so those are
+// freed only then.
+static TxnContext *undurable_contexts = NULL;
+static pthread_mutex_t undurable_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Transaction IDs are leased from the superblock in blocks of this size
+#define TXN_ID_LEASE_STEP 1024
+static int txn_id_lease = 0;
+static pthread_mutex_t txn_lease_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Background compactor thread
+static pthread_t compactor_thread;
+static volatile bool compactor_running = false;
+
+// Background checkpointer thread
+static pthread_t checkpointer_thread;
+static volatile bool checkpointer_running = false;
+
+// Background flusher of asynchronous commits
+static pthread_t flusher_thread;
+static volatile bool flusher_running = false;
 
 // Global lock manager
 LockManager g_lock_manager;
 
+// Leaf slots pack a row's NVRAM offset, in allocation granules, into the
+// high 32 bits and its size into the low 32 bits. Every allocation is
+// granule aligned, so no information is lost.
+_Static_assert(FILESIZE / ALLOC_ALIGN <= UINT32_MAX, "NVRAM offsets must fit in 32 bits");
+_Static_assert(FILESIZE <= UINT32_MAX, "Row sizes must fit in 32 bits");
+
+static inline uint64_t slot_encode(NVRAMPtr ptr, size_t size)
+{
+    uint64_t granule = (uint64_t)((char *)ptr - (char *)nvram_map) / ALLOC_ALIGN;
+    return (granule << 32) | (uint32_t)size;
+}
+
+static inline NVRAMPtr slot_ptr(uint64_t slot)
+{
+    return (char *)nvram_map + (slot >> 32) * ALLOC_ALIGN;
+}
+
+static inline size_t slot_size(uint64_t slot)
+{
+    return (size_t)(slot & 0xFFFFFFFFu);
+}
+
 // Helper function to allocate a new node in RAM
 static BPTreeNode *create_node(bool is_leaf)
 {
@@ -66,16 +204,17 @@ static BPTreeNode *create_node(bool is_leaf)
     // Initialize node
     node->is_leaf = is_leaf;
     node->num_keys = 0;
+    node->count = 0;
     node->next_leaf = NULL;
+    node->prev_leaf = NULL;
 
     // Clear memory
     memset(node->keys, 0, sizeof(node->keys));
 
     if (is_leaf)
     {
-        // Clear data pointers and sizes
-        memset(node->data_ptrs, 0, sizeof(node->data_ptrs));
-        memset(node->data_sizes, 0, sizeof(node->data_sizes));
+        // Clear row slots
+        memset(node->slots, 0, sizeof(node->slots));
     }
     else
     {
@@ -104,10 +243,39 @@ static BPTree *create_tree()
     tree->height = 1;
     tree->node_count = 1;
     tree->record_count = 0;
+    tree->mod_count = 0;
+    tree->pending_merges = 0;
+
+    // Default policy: split in the middle, rebalance eagerly on delete
+    tree->policy.leaf_split_keys = (BP_ORDER - 1) / 2;
+    tree->policy.leaf_min_keys = (BP_ORDER - 1) / 2;
+    tree->policy.lazy_delete = false;
+
+    pthread_rwlock_init(&tree->latch, NULL);
 
     return tree;
 }
 
+// Number of rows below a node
+static inline int subtree_count(const BPTreeNode *node)
+{
+    return node->is_leaf ? node->num_keys : node->count;
+}
+
+// Recompute an internal node's row count from its children
+static void recount_node(BPTreeNode *node)
+{
+    if (node->is_leaf)
+        return;
+
+    int count = 0;
+    for (int i = 0; i <= node->num_keys; i++)
+    {
+        count += subtree_count(node->children[i]);
+    }
+    node->count = count;
+}
+
 // Helper function to split a leaf node
 static BPTreeNode *split_leaf(BPTree *tree, BPTreeNode *leaf, int *up_key)
 {
@@ -116,8 +284,8 @@ static BPTreeNode *split_leaf(BPTree *tree, BPTreeNode *leaf, int *up_key)
     if (!new_leaf)
         return NULL;
 
-    // Find median position
-    int mid = (BP_ORDER - 1) / 2;
+    // Split position comes from the table policy
+    int mid = tree->policy.leaf_split_keys;
 
     // Set the up key (key that will go to parent)
     *up_key = leaf->keys[mid];
@@ -126,21 +294,22 @@ static BPTreeNode *split_leaf(BPTree *tree, BPTreeNode *leaf, int *up_key)
     for (int i = mid; i < leaf->num_keys; i++)
     {
         new_leaf->keys[i - mid] = leaf->keys[i];
-        new_leaf->data_ptrs[i - mid] = leaf->data_ptrs[i];
-        new_leaf->data_sizes[i - mid] = leaf->data_sizes[i];
+        new_leaf->slots[i - mid] = leaf->slots[i];
 
         // Clear original entries (optional)
         leaf->keys[i] = 0;
-        leaf->data_ptrs[i] = NULL;
-        leaf->data_sizes[i] = 0;
+        leaf->slots[i] = 0;
     }
 
     // Update key counts
     new_leaf->num_keys = leaf->num_keys - mid;
     leaf->num_keys = mid;
 
-    // Link leaves for sequential access
+    // Link leaves for sequential access in both directions
     new_leaf->next_leaf = leaf->next_leaf;
+    new_leaf->prev_leaf = leaf;
+    if (leaf->next_leaf)
+        leaf->next_leaf->prev_leaf = new_leaf;
     leaf->next_leaf = new_leaf;
 
     // Update tree stats
@@ -180,6 +349,8 @@ static BPTreeNode *split_internal(BPTree *tree, BPTreeNode *node, int *up_key)
     // Update key counts
     new_node->num_keys = node->num_keys - (mid + 1);
     node->num_keys = mid;
+    recount_node(node);
+    recount_node(new_node);
 
     // Update tree stats
     tree->node_count++;
@@ -254,11 +425,10 @@ static bool insert_recursive(BPTree *tree, BPTreeNode *node, int key, void *data
         {
             // Update existing row
             // Free old data
-            free_memory(node->data_ptrs[pos], node->data_sizes[pos]);
+            free_row(slot_ptr(node->slots[pos]), slot_size(node->slots[pos]));
 
             // Update with new data
-            node->data_ptrs[pos] = data;
-            node->data_sizes[pos] = size;
+            node->slots[pos] = slot_encode(data, size);
             return true;
         }
 
@@ -267,17 +437,22 @@ static bool insert_recursive(BPTree *tree, BPTreeNode *node, int key, void *data
         while (i >= 0 && node->keys[i] > key)
         {
             node->keys[i + 1] = node->keys[i];
-            node->data_ptrs[i + 1] = node->data_ptrs[i];
-            node->data_sizes[i + 1] = node->data_sizes[i];
+            node->slots[i + 1] = node->slots[i];
             i--;
         }
 
         // Insert key and data
         node->keys[i + 1] = key;
-        node->data_ptrs[i + 1] = data;
-        node->data_sizes[i + 1] = size;
+        node->slots[i + 1] = slot_encode(data, size);
         node->num_keys++;
 
+        // A lazily left underfull leaf refilled by the insert is no longer pending
+        if (tree->policy.lazy_delete && node->num_keys == tree->policy.leaf_min_keys &&
+            tree->pending_merges > 0)
+        {
+            tree->pending_merges--;
+        }
+
         // Check if node needs splitting
         if (node->num_keys >= BP_ORDER - 1)
         {
@@ -312,22 +487,24 @@ static bool insert_recursive(BPTree *tree, BPTreeNode *node, int key, void *data
         // If child did not split, we're done
         if (new_child == NULL)
         {
+            recount_node(node);
             return true;
         }
 
-        // If child split, we need to insert the new key and child
-        if (node->num_keys < BP_ORDER - 1)
-        {
-            // Node has space
-            return insert_in_internal(tree, node, child_up_key, new_child);
-        }
-        else
+        // If child split, we need to insert the new key and child.
+        // Like leaves, internal nodes are split as soon as they fill up,
+        // so there is always room for one more separator here.
+        insert_in_internal(tree, node, child_up_key, new_child);
+        recount_node(node);
+
+        // Check if node needs splitting
+        if (node->num_keys >= BP_ORDER - 1)
         {
-            // Node needs to split
-            insert_in_internal(tree, node, child_up_key, new_child);
             *new_node = split_internal(tree, node, up_key);
             return *new_node != NULL;
         }
+
+        return true;
     }
 }
 
@@ -360,12 +537,13 @@ static bool merge_nodes(BPTreeNode *left, BPTreeNode *right, int parent_key_idx,
         for (int i = 0; i < right->num_keys; i++)
         {
             left->keys[left->num_keys + i] = right->keys[i];
-            left->data_ptrs[left->num_keys + i] = right->data_ptrs[i];
-            left->data_sizes[left->num_keys + i] = right->data_sizes[i];
+            left->slots[left->num_keys + i] = right->slots[i];
         }
 
         left->num_keys += right->num_keys;
         left->next_leaf = right->next_leaf;
+        if (right->next_leaf)
+            right->next_leaf->prev_leaf = left;
     }
     else
     {
@@ -402,6 +580,97 @@ static bool merge_nodes(BPTreeNode *left, BPTreeNode *right, int parent_key_idx,
     return true;
 }
 
+// Helper function to fix an underfull leaf by borrowing a key from a
+// sibling under the same parent, or merging with one. Returns the leaf now
+// holding its rows, or NULL if it has no sibling.
+static BPTreeNode *rebalance_leaf(BPTree *tree, BPTreeNode *node, BPTreeNode *parent, int parent_idx)
+{
+    int min_keys = tree->policy.leaf_min_keys;
+
+    // Get siblings
+    BPTreeNode *left_sibling = NULL;
+    BPTreeNode *right_sibling = NULL;
+    int left_idx = -1, right_idx = -1;
+
+    if (parent_idx > 0)
+    {
+        left_sibling = parent->children[parent_idx - 1];
+        left_idx = parent_idx - 1;
+    }
+
+    if (parent_idx < parent->num_keys)
+    {
+        right_sibling = parent->children[parent_idx + 1];
+        right_idx = parent_idx;
+    }
+
+    // Try to borrow from siblings or merge
+    if (left_sibling && left_sibling->num_keys > min_keys)
+    {
+        // Borrow from left sibling
+
+        // Make space for the new key
+        for (int i = node->num_keys; i > 0; i--)
+        {
+            node->keys[i] = node->keys[i - 1];
+            node->slots[i] = node->slots[i - 1];
+        }
+
+        // Copy the rightmost key from left sibling
+        node->keys[0] = left_sibling->keys[left_sibling->num_keys - 1];
+        node->slots[0] = left_sibling->slots[left_sibling->num_keys - 1];
+        node->num_keys++;
+
+        // Update left sibling
+        left_sibling->num_keys--;
+
+        // Update parent key
+        parent->keys[left_idx] = node->keys[0];
+    }
+    else if (right_sibling && right_sibling->num_keys > min_keys)
+    {
+        // Borrow from right sibling
+
+        // Copy the leftmost key from right sibling
+        node->keys[node->num_keys] = right_sibling->keys[0];
+        node->slots[node->num_keys] = right_sibling->slots[0];
+        node->num_keys++;
+
+        // Update right sibling
+        for (int i = 0; i < right_sibling->num_keys - 1; i++)
+        {
+            right_sibling->keys[i] = right_sibling->keys[i + 1];
+            right_sibling->slots[i] = right_sibling->slots[i + 1];
+        }
+        right_sibling->num_keys--;
+
+        // Update parent key
+        parent->keys[right_idx] = right_sibling->keys[0];
+    }
+    else if (left_sibling)
+    {
+        // Merge with left sibling
+        merge_nodes(left_sibling, node, left_idx, parent);
+        tree->node_count--;
+
+        // node is now merged into left_sibling
+        return left_sibling;
+    }
+    else if (right_sibling)
+    {
+        // Merge with right sibling
+        merge_nodes(node, right_sibling, right_idx, parent);
+        tree->node_count--;
+    }
+    else
+    {
+        // Only child: nothing to borrow from or merge with
+        return NULL;
+    }
+
+    return node;
+}
+
 // Helper function to remove key recursively
 static bool remove_recursive(BPTree *tree, BPTreeNode *node, int key, BPTreeNode *parent, int parent_idx)
 {
@@ -417,98 +686,31 @@ static bool remove_recursive(BPTree *tree, BPTreeNode *node, int key, BPTreeNode
             return false;
         }
 
-        // Free NVRAM data
-        free_memory(node->data_ptrs[pos], node->data_sizes[pos]);
+        // The caller frees the row version
 
         // Remove key and shift others
         for (int i = pos; i < node->num_keys - 1; i++)
         {
             node->keys[i] = node->keys[i + 1];
-            node->data_ptrs[i] = node->data_ptrs[i + 1];
-            node->data_sizes[i] = node->data_sizes[i + 1];
+            node->slots[i] = node->slots[i + 1];
         }
         node->num_keys--;
 
-        // Handle underflow (if not root)
-        if (parent && node->num_keys < (BP_ORDER - 1) / 2)
-        {
-            // Get siblings
-            BPTreeNode *left_sibling = NULL;
-            BPTreeNode *right_sibling = NULL;
-            int left_idx = -1, right_idx = -1;
-
-            if (parent_idx > 0)
-            {
-                left_sibling = parent->children[parent_idx - 1];
-                left_idx = parent_idx - 1;
-            }
-
-            if (parent_idx < parent->num_keys)
-            {
-                right_sibling = parent->children[parent_idx + 1];
-                right_idx = parent_idx;
-            }
-
-            // Try to borrow from siblings or merge
-            if (left_sibling && left_sibling->num_keys > (BP_ORDER - 1) / 2)
-            {
-                // Borrow from left sibling
-
-                // Make space for the new key
-                for (int i = node->num_keys; i > 0; i--)
-                {
-                    node->keys[i] = node->keys[i - 1];
-                    node->data_ptrs[i] = node->data_ptrs[i - 1];
-                    node->data_sizes[i] = node->data_sizes[i - 1];
-                }
-
-                // Copy the rightmost key from left sibling
-                node->keys[0] = left_sibling->keys[left_sibling->num_keys - 1];
-                node->data_ptrs[0] = left_sibling->data_ptrs[left_sibling->num_keys - 1];
-                node->data_sizes[0] = left_sibling->data_sizes[left_sibling->num_keys - 1];
-                node->num_keys++;
-
-                // Update left sibling
-                left_sibling->num_keys--;
-
-                // Update parent key
-                parent->keys[left_idx] = node->keys[0];
-            }
-            else if (right_sibling && right_sibling->num_keys > (BP_ORDER - 1) / 2)
-            {
-                // Borrow from right sibling
-
-                // Copy the leftmost key from right sibling
-                node->keys[node->num_keys] = right_sibling->keys[0];
-                node->data_ptrs[node->num_keys] = right_sibling->data_ptrs[0];
-                node->data_sizes[node->num_keys] = right_sibling->data_sizes[0];
-                node->num_keys++;
-
-                // Update right sibling
-                for (int i = 0; i < right_sibling->num_keys - 1; i++)
-                {
-                    right_sibling->keys[i] = right_sibling->keys[i + 1];
-                    right_sibling->data_ptrs[i] = right_sibling->data_ptrs[i + 1];
-                    right_sibling->data_sizes[i] = right_sibling->data_sizes[i + 1];
-                }
-                right_sibling->num_keys--;
+        int min_keys = tree->policy.leaf_min_keys;
 
-                // Update parent key
-                parent->keys[right_idx] = right_sibling->keys[0];
-            }
-            else if (left_sibling)
-            {
-                // Merge with left sibling
-                merge_nodes(left_sibling, node, left_idx, parent);
+        // Lazy mode: leave the underfull leaf for the background compactor,
+        // counting it once, when it first drops below the minimum
+        if (parent && node->num_keys < min_keys && tree->policy.lazy_delete)
+        {
+            if (node->num_keys == min_keys - 1)
+                tree->pending_merges++;
+            return true;
+        }
 
-                // node is now merged into left_sibling
-                return true;
-            }
-            else if (right_sibling)
-            {
-                // Merge with right sibling
-                merge_nodes(node, right_sibling, right_idx, parent);
-            }
+        // Handle underflow (if not root)
+        if (parent && node->num_keys < min_keys)
+        {
+            rebalance_leaf(tree, node, parent, parent_idx);
         }
 
         return true;
@@ -530,8 +732,13 @@ static bool remove_recursive(BPTree *tree, BPTreeNode *node, int key, BPTreeNode
         // Recursive removal
         bool result = remove_recursive(tree, child, key, node, i);
 
+        // Rows may have moved between the children by borrowing or merging
+        recount_node(node);
+
         // Handle underflow in child (if not leaf and needs rebalancing)
-        if (result && node->children[i]->num_keys < (BP_ORDER - 1) / 2 && !node->children[i]->is_leaf)
+        // (a merge may have removed children[i], so check it is still in range)
+        if (result && i <= node->num_keys &&
+            node->children[i]->num_keys < (BP_ORDER - 1) / 2 && !node->children[i]->is_leaf)
         {
             // Similar to leaf node case, handle borrowing or merging
             // For internal nodes, this is more complex
@@ -575,271 +782,2668 @@ static void free_tree(BPTree *tree)
     if (tree)
     {
         free_node(tree->root);
+        pthread_rwlock_destroy(&tree->latch);
         free(tree);
     }
 }
 
-// Initialize database system
-void db_init()
+// Find the context of a transaction, creating it on first use
+static TxnContext *get_txn_context(int txn_id)
 {
-    if (is_initialized)
-        return;
+    pthread_mutex_lock(&txn_context_mutex);
 
-    // Initialize NVRAM free space manager
-    init_free_space();
+    TxnContext *ctx = txn_contexts;
+    while (ctx && ctx->txn_id != txn_id)
+    {
+        ctx = ctx->next;
+    }
 
-    // Initialize lock manager
-    lock_manager_init(&g_lock_manager);
+    if (!ctx)
+    {
+        ctx = (TxnContext *)malloc(sizeof(TxnContext));
+        if (ctx)
+        {
+            ctx->txn_id = txn_id;
+            ctx->durability = DURABILITY_DEFAULT;
+            ctx->commit_lsn = 0;
+            ctx->retired = NULL;
+            ctx->table_mask = 0;
+            ctx->writes = NULL;
+            ctx->write_buckets = NULL;
+            ctx->write_count = 0;
+            ctx->write_bucket_count = 0;
+            ctx->dirty_lines = NULL;
+            ctx->dirty_count = 0;
+            ctx->dirty_capacity = 0;
+            ctx->index_spares = NULL;
+            ctx->next = txn_contexts;
+            txn_contexts = ctx;
+        }
+    }
 
-    // Initialize tables array
-    for (int i = 0; i < MAX_TABLES; i++)
+    pthread_mutex_unlock(&txn_context_mutex);
+    return ctx;
+}
+
+// Find the context of a transaction (NULL if it has none yet)
+static TxnContext *find_txn_context(int txn_id)
+{
+    pthread_mutex_lock(&txn_context_mutex);
+
+    TxnContext *ctx = txn_contexts;
+    while (ctx && ctx->txn_id != txn_id)
     {
-        tables[i] = NULL;
+        ctx = ctx->next;
     }
 
-    is_initialized = true;
-    printf("Database system initialized\n");
+    pthread_mutex_unlock(&txn_context_mutex);
+    return ctx;
 }
 
-// Shutdown database system
-void db_shutdown()
+// Unlink the context of a finished transaction (NULL if it never wrote)
+static TxnContext *take_txn_context(int txn_id)
 {
-    if (!is_initialized)
-        return;
+    pthread_mutex_lock(&txn_context_mutex);
 
-    // Close and free all tables
-    for (int i = 0; i < MAX_TABLES; i++)
+    TxnContext *ctx = txn_contexts, *prev = NULL;
+    while (ctx && ctx->txn_id != txn_id)
     {
-        if (tables[i])
+        prev = ctx;
+        ctx = ctx->next;
+    }
+
+    if (ctx)
+    {
+        if (prev)
         {
-            // Free NVRAM data for all records
-            if (tables[i]->index)
-            {
-                // We would need to traverse all leaves and free NVRAM data
-                // For brevity, this code is omitted
-                free_tree(tables[i]->index);
-            }
-            free(tables[i]);
-            tables[i] = NULL;
+            prev->next = ctx->next;
+        }
+        else
+        {
+            txn_contexts = ctx->next;
         }
     }
 
-    // Clean up NVRAM
-    cleanup_free_space();
+    pthread_mutex_unlock(&txn_context_mutex);
+    return ctx;
+}
 
-    // Clean up lock manager
-    lock_manager_cleanup(&g_lock_manager);
+// Forget the field writes staged for a row
+static void txn_drop_fields(WriteSetEntry *w)
+{
+    while (w->fields)
+    {
+        FieldDelta *d = w->fields;
+        w->fields = d->next;
+        free(d);
+    }
+}
 
-    is_initialized = false;
-    printf("Database system shut down\n");
+// Release the NVRAM of row versions retired by a finished transaction
+static void release_txn_context(TxnContext *ctx)
+{
+    if (!ctx)
+        return;
+
+    while (ctx->retired)
+    {
+        RetiredVersion *old = ctx->retired;
+        ctx->retired = old->next;
+        free_row(old->data, old->size);
+        free(old);
+    }
+
+    while (ctx->writes)
+    {
+        WriteSetEntry *w = ctx->writes;
+        ctx->writes = w->next;
+        txn_drop_fields(w);
+        free(w->view);
+        free(w);
+    }
+
+    sec_index_free_spares(ctx->index_spares);
+    free(ctx->write_buckets);
+    free(ctx->dirty_lines);
+    free(ctx);
 }
 
-// Begin a transaction
-int db_begin_transaction()
+// Free a row version when the transaction ends. If no memory is left to
+// remember it, the version is leaked rather than freed early.
+static void txn_retire(TxnContext *ctx, NVRAMPtr data, size_t size)
 {
-    return transaction_begin(&g_lock_manager);
+    RetiredVersion *old = (RetiredVersion *)malloc(sizeof(RetiredVersion));
+    if (!old)
+        return;
+
+    old->data = data;
+    old->size = size;
+    pthread_mutex_lock(&txn_context_mutex);
+    old->next = ctx->retired;
+    ctx->retired = old;
+    pthread_mutex_unlock(&txn_context_mutex);
 }
 
-// Modified commit transaction to update WAL commit pointers
-bool db_commit_transaction(int txn_id)
+static inline unsigned int write_set_bucket(int key, int bucket_count)
 {
-    bool result = transaction_commit(&g_lock_manager, txn_id);
+    return ((unsigned int)key * 2654435761u) & (unsigned int)(bucket_count - 1);
+}
+
+// Find a transaction's write to a row (NULL if it has not written it)
+static WriteSetEntry *txn_find_write(TxnContext *ctx, Table *table, int key)
+{
+    if (!ctx || ctx->write_bucket_count == 0)
+        return NULL;
 
-    if (result)
+    WriteSetEntry *w = ctx->write_buckets[write_set_bucket(key, ctx->write_bucket_count)];
+    while (w && (w->table != table || w->key != key))
     {
-        // Update WAL commit pointers for all tables
-        // In a real implementation, you would track which tables were modified
-        // by the transaction and only update those
-        for (int i = 0; i < MAX_TABLES; i++)
-        {
-            if (tables[i] != NULL)
-            {
-                wal_advance_commit_ptr(tables[i]->table_id, txn_id);
-            }
-        }
+        w = w->hash_next;
     }
-
-    return result;
+    return w;
 }
-// Abort a transaction
-// In src/ram_bptree.c
-bool db_abort_transaction(int txn_id)
+
+// Has the transaction written key in any table? Row locks are per key, so
+// the lock on such a key must be kept until the transaction ends.
+static bool txn_wrote_key(TxnContext *ctx, int key)
 {
-    return transaction_abort(&g_lock_manager, txn_id);
+    if (!ctx || ctx->write_bucket_count == 0)
+        return false;
+
+    WriteSetEntry *w = ctx->write_buckets[write_set_bucket(key, ctx->write_bucket_count)];
+    while (w && w->key != key)
+    {
+        w = w->hash_next;
+    }
+    return w != NULL;
 }
 
-// Create a new table
-int db_create_table(const char *name)
+// Make room for one more write, doubling the buckets to keep chains short.
+// Returns false if the write set cannot grow.
+static bool txn_reserve_write(TxnContext *ctx)
 {
-    if (!is_initialized)
+    if (ctx->write_count < ctx->write_bucket_count)
+        return true;
+
+    int count = ctx->write_bucket_count ? ctx->write_bucket_count * 2 : WRITE_SET_MIN_BUCKETS;
+    WriteSetEntry **buckets = (WriteSetEntry **)calloc(count, sizeof(WriteSetEntry *));
+    if (!buckets)
+        return false;
+
+    for (WriteSetEntry *w = ctx->writes; w; w = w->next)
     {
-        printf("Error: Database not initialized\n");
-        return -1;
+        unsigned int b = write_set_bucket(w->key, count);
+        w->hash_next = buckets[b];
+        buckets[b] = w;
     }
 
-    // Find a free slot in tables array
-    int slot = -1;
-    for (int i = 0; i < MAX_TABLES; i++)
+    free(ctx->write_buckets);
+    ctx->write_buckets = buckets;
+    ctx->write_bucket_count = count;
+    return true;
+}
+
+// Add a new write to the write set (room reserved by txn_reserve_write)
+static void txn_link_write(TxnContext *ctx, WriteSetEntry *w)
+{
+    unsigned int b = write_set_bucket(w->key, ctx->write_bucket_count);
+    w->hash_next = ctx->write_buckets[b];
+    ctx->write_buckets[b] = w;
+    w->next = ctx->writes;
+    ctx->writes = w;
+    ctx->write_count++;
+}
+
+// Free the staged versions of an aborted transaction in one pass. None of
+// them was ever reachable from an index.
+static void txn_discard_writes(TxnContext *ctx)
+{
+    if (!ctx)
+        return;
+
+    for (WriteSetEntry *w = ctx->writes; w; w = w->next)
     {
-        if (tables[i] == NULL)
+        if (w->data)
         {
-            slot = i;
-            break;
+            free_row(w->data, w->size);
+            w->data = NULL;
         }
     }
+}
 
-    if (slot == -1)
+// Add a table to the transaction's write set
+static void txn_note_write(int txn_id, int table_id)
+{
+    TxnContext *ctx = get_txn_context(txn_id);
+    if (ctx)
     {
-        printf("Error: Maximum number of tables reached\n");
-        return -1;
+        pthread_mutex_lock(&txn_context_mutex);
+        ctx->table_mask |= 1u << table_id;
+        pthread_mutex_unlock(&txn_context_mutex);
     }
+}
 
-    // Check if table with same name already exists
-    for (int i = 0; i < MAX_TABLES; i++)
+// Record the cache lines covering [start, start + size) in the transaction's
+// dirty set. Returns false if the set cannot grow.
+static bool txn_add_dirty_lines(TxnContext *ctx, void *start, size_t size)
+{
+    uintptr_t first = (uintptr_t)start & ~(uintptr_t)(CACHE_LINE_SIZE - 1);
+    uintptr_t last = ((uintptr_t)start + size - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1);
+
+    pthread_mutex_lock(&txn_context_mutex);
+    for (uintptr_t line = first; line <= last; line += CACHE_LINE_SIZE)
     {
-        if (tables[i] && strcmp(tables[i]->name, name) == 0)
+        // Rows of one page usually arrive back to back
+        if (ctx->dirty_count > 0 && ctx->dirty_lines[ctx->dirty_count - 1] == line)
+            continue;
+
+        if (ctx->dirty_count == ctx->dirty_capacity)
         {
-            printf("Error: Table '%s' already exists\n", name);
-            return -1;
+            int capacity = ctx->dirty_capacity ? ctx->dirty_capacity * 2 : 64;
+            uintptr_t *lines = (uintptr_t *)realloc(ctx->dirty_lines, capacity * sizeof(uintptr_t));
+            if (!lines)
+            {
+                pthread_mutex_unlock(&txn_context_mutex);
+                return false;
+            }
+            ctx->dirty_lines = lines;
+            ctx->dirty_capacity = capacity;
         }
+        ctx->dirty_lines[ctx->dirty_count++] = line;
     }
+    pthread_mutex_unlock(&txn_context_mutex);
+    return true;
+}
 
-    // Create table structure
-    Table *table = (Table *)malloc(sizeof(Table));
-    if (!table)
+// Copy a new row into NVRAM and make it durable. Small rows share cache
+// lines with their neighbours, so their lines (and the page's slot bitmap)
+// are only recorded and written back once by txn_flush_dirty before the
+// transaction ends. Large rows are streamed past the cache.
+static void persist_row(int txn_id, void *nvram_data, const void *data, size_t size)
+{
+    if (!row_is_small(size))
     {
-        printf("Error: Failed to allocate memory for table\n");
-        return -1;
+        persist_copy(nvram_data, data, size);
+        return;
+    }
+
+    memcpy(nvram_data, data, size);
+    TxnContext *ctx = get_txn_context(txn_id);
+    if (ctx && txn_add_dirty_lines(ctx, nvram_data, size) &&
+        txn_add_dirty_lines(ctx, small_page_of(nvram_data), sizeof(SmallPage)))
+    {
+        return;
+    }
+    flush_range_nofence(small_page_of(nvram_data), sizeof(SmallPage));
+    flush_range(nvram_data, size);
+}
+
+// Sort helper for cache line addresses
+static int compare_lines(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Write back every distinct dirty line of a transaction with a single fence
+static void txn_flush_dirty(TxnContext *ctx)
+{
+    if (!ctx || ctx->dirty_count == 0)
+        return;
+
+    qsort(ctx->dirty_lines, ctx->dirty_count, sizeof(uintptr_t), compare_lines);
+    int unique = 0;
+    for (int i = 0; i < ctx->dirty_count; i++)
+    {
+        if (unique == 0 || ctx->dirty_lines[unique - 1] != ctx->dirty_lines[i])
+        {
+            ctx->dirty_lines[unique++] = ctx->dirty_lines[i];
+        }
+    }
+
+    flush_lines(ctx->dirty_lines, unique);
+    ctx->dirty_count = 0;
+}
+
+// Helper to add every row of a tree to a secondary index by walking the leaf chain.
+// Returns false if an entry could not be allocated.
+static bool index_all_rows(BPTree *tree, SecondaryIndex *index)
+{
+    BPTreeNode *leaf = tree->root;
+    while (!leaf->is_leaf)
+    {
+        leaf = leaf->children[0];
+    }
+
+    for (; leaf; leaf = leaf->next_leaf)
+    {
+        for (int i = 0; i < leaf->num_keys; i++)
+        {
+            int value;
+            if (sec_index_extract(&index->spec, slot_ptr(leaf->slots[i]), slot_size(leaf->slots[i]), &value) &&
+                !sec_index_insert(index, value, leaf->keys[i], NULL))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Helper function to add or remove a row's entries in all secondary indexes.
+// Called with the tree latch held for writing. Added entries come from
+// spares; should they run out (an index created since the write was staged)
+// and allocation fail, the index is marked for a rebuild.
+static void update_secondary_indexes(Table *table, int key, const void *data, size_t size, bool add,
+                                     IndexEntry **spares)
+{
+    for (int i = 0; i < table->index_count; i++)
+    {
+        SecondaryIndex *index = table->indexes[i];
+        int value;
+
+        // Rows without the indexed field are simply not indexed
+        if (!sec_index_extract(&index->spec, data, size, &value))
+            continue;
+
+        if (add)
+        {
+            if (!sec_index_insert(index, value, key, spares) && !index->incomplete)
+            {
+                printf("Error: Index '%s' lost row %d; it is rebuilt before its next lookup\n", index->name, key);
+                index->incomplete = true;
+            }
+        }
+        else
+        {
+            sec_index_remove(index, value, key);
+        }
+    }
+}
+
+// Helper function to build a tree bottom-up from sorted rows.
+// Leaves get per_leaf rows each; the old nodes must already be freed.
+static bool bulk_build(BPTree *tree, const int *keys, const uint64_t *slots, int n, int per_leaf)
+{
+    int leaf_count = n > 0 ? (n + per_leaf - 1) / per_leaf : 1;
+    BPTreeNode **level = (BPTreeNode **)malloc(leaf_count * sizeof(BPTreeNode *));
+    int *level_min = (int *)malloc(leaf_count * sizeof(int));
+    if (!level || !level_min)
+    {
+        free(level);
+        free(level_min);
+        return false;
+    }
+
+    // Build and link the leaves
+    BPTreeNode *prev = NULL;
+    for (int l = 0; l < leaf_count; l++)
+    {
+        BPTreeNode *leaf = create_node(true);
+        if (!leaf)
+        {
+            // Free what has been built so far
+            for (int j = 0; j < l; j++)
+                free(level[j]);
+            free(level);
+            free(level_min);
+            return false;
+        }
+
+        for (int i = l * per_leaf; i < n && i < (l + 1) * per_leaf; i++)
+        {
+            leaf->keys[leaf->num_keys] = keys[i];
+            leaf->slots[leaf->num_keys] = slots[i];
+            leaf->num_keys++;
+        }
+
+        leaf->prev_leaf = prev;
+        if (prev)
+            prev->next_leaf = leaf;
+        prev = leaf;
+
+        level[l] = leaf;
+        level_min[l] = leaf->num_keys > 0 ? leaf->keys[0] : 0;
+    }
+
+    tree->node_count = leaf_count;
+    tree->height = 1;
+
+    // Build internal levels until a single root remains. Internal nodes get
+    // at most BP_ORDER - 1 children so they are not split on the next insert.
+    int count = leaf_count;
+    while (count > 1)
+    {
+        int fanout = BP_ORDER - 1;
+        int parent_count = 0;
+
+        for (int start = 0; start < count; parent_count++)
+        {
+            int take = count - start < fanout ? count - start : fanout;
+
+            // Avoid leaving a single child for the last parent
+            if (count - start - take == 1 && take > 2)
+                take--;
+
+            BPTreeNode *node = create_node(false);
+            if (!node)
+            {
+                // Free the parents built so far and the children not yet consumed
+                for (int j = 0; j < parent_count; j++)
+                    free_node(level[j]);
+                for (int j = start; j < count; j++)
+                    free_node(level[j]);
+                free(level);
+                free(level_min);
+                return false;
+            }
+
+            node->children[0] = level[start];
+            for (int c = 1; c < take; c++)
+            {
+                node->keys[c - 1] = level_min[start + c];
+                node->children[c] = level[start + c];
+            }
+            node->num_keys = take - 1;
+            recount_node(node);
+
+            int node_min = level_min[start];
+            start += take;
+
+            // Parents are written in place over the consumed children
+            level[parent_count] = node;
+            level_min[parent_count] = node_min;
+            tree->node_count++;
+        }
+
+        count = parent_count;
+        tree->height++;
+    }
+
+    tree->root = level[0];
+    free(level);
+    free(level_min);
+    return true;
+}
+
+// Helper function to rebuild a tree with leaves packed to the policy split
+// point. Called with the tree latch held for writing.
+static bool rebuild_tree(BPTree *tree)
+{
+    int capacity = tree->record_count > 0 ? tree->record_count : 1;
+    int *keys = (int *)malloc(capacity * sizeof(int));
+    uint64_t *slots = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    if (!keys || !slots)
+    {
+        free(keys);
+        free(slots);
+        return false;
+    }
+
+    // Collect all rows in key order from the leaf chain
+    BPTreeNode *leaf = tree->root;
+    while (!leaf->is_leaf)
+    {
+        leaf = leaf->children[0];
+    }
+
+    int n = 0;
+    for (; leaf; leaf = leaf->next_leaf)
+    {
+        for (int i = 0; i < leaf->num_keys && n < capacity; i++, n++)
+        {
+            keys[n] = leaf->keys[i];
+            slots[n] = leaf->slots[i];
+        }
+    }
+
+    BPTreeNode *old_root = tree->root;
+    int old_height = tree->height;
+    int old_node_count = tree->node_count;
+
+    if (!bulk_build(tree, keys, slots, n, tree->policy.leaf_split_keys))
+    {
+        // Keep the old tree
+        tree->root = old_root;
+        tree->height = old_height;
+        tree->node_count = old_node_count;
+        free(keys);
+        free(slots);
+        return false;
+    }
+
+    free_node(old_root);
+    tree->pending_merges = 0;
+    tree->mod_count++;
+
+    free(keys);
+    free(slots);
+    return true;
+}
+
+// Helper function to fix an internal node left with a single child by
+// borrowing a child from a sibling under the same parent, or merging with
+// one. Returns false if it has no sibling.
+static bool rebalance_internal(BPTree *tree, BPTreeNode *node, BPTreeNode *parent, int parent_idx)
+{
+    BPTreeNode *left_sibling = parent_idx > 0 ? parent->children[parent_idx - 1] : NULL;
+    BPTreeNode *right_sibling = parent_idx < parent->num_keys ? parent->children[parent_idx + 1] : NULL;
+
+    if (left_sibling && left_sibling->num_keys > 1)
+    {
+        // Rotate the last child of the left sibling through the parent
+        for (int i = node->num_keys; i > 0; i--)
+        {
+            node->keys[i] = node->keys[i - 1];
+        }
+        for (int i = node->num_keys + 1; i > 0; i--)
+        {
+            node->children[i] = node->children[i - 1];
+        }
+
+        node->keys[0] = parent->keys[parent_idx - 1];
+        node->children[0] = left_sibling->children[left_sibling->num_keys];
+        node->num_keys++;
+
+        parent->keys[parent_idx - 1] = left_sibling->keys[left_sibling->num_keys - 1];
+        left_sibling->num_keys--;
+
+        recount_node(left_sibling);
+        recount_node(node);
+    }
+    else if (right_sibling && right_sibling->num_keys > 1)
+    {
+        // Rotate the first child of the right sibling through the parent
+        node->keys[node->num_keys] = parent->keys[parent_idx];
+        node->children[node->num_keys + 1] = right_sibling->children[0];
+        node->num_keys++;
+
+        parent->keys[parent_idx] = right_sibling->keys[0];
+        for (int i = 0; i < right_sibling->num_keys - 1; i++)
+        {
+            right_sibling->keys[i] = right_sibling->keys[i + 1];
+        }
+        for (int i = 0; i < right_sibling->num_keys; i++)
+        {
+            right_sibling->children[i] = right_sibling->children[i + 1];
+        }
+        right_sibling->num_keys--;
+
+        recount_node(right_sibling);
+        recount_node(node);
+    }
+    else if (left_sibling)
+    {
+        merge_nodes(left_sibling, node, parent_idx - 1, parent);
+        recount_node(left_sibling);
+        tree->node_count--;
+    }
+    else if (right_sibling)
+    {
+        merge_nodes(node, right_sibling, parent_idx, parent);
+        recount_node(node);
+        tree->node_count--;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+// Path from the root to the parent of the leaves covering a key
+typedef struct
+{
+    BPTreeNode *nodes[64]; // nodes[0] is the root (heights stay far below this)
+    int child_idx[64];     // Child of nodes[d] followed to nodes[d + 1]
+    int depth;             // Index of the parent of the leaves
+} LeafPath;
+
+// Helper function to find the parent of the leaves covering key. Sets
+// *upper to the first key past that parent's range, if it has one.
+static bool find_leaf_parent(BPTree *tree, int key, LeafPath *path, int *upper, bool *has_upper)
+{
+    BPTreeNode *node = tree->root;
+    *has_upper = false;
+    if (node->is_leaf)
+        return false;
+
+    path->depth = 0;
+    while (!node->children[0]->is_leaf)
+    {
+        int i;
+        for (i = 0; i < node->num_keys; i++)
+        {
+            if (key < node->keys[i])
+                break;
+        }
+
+        // Deeper separators bound the range more tightly
+        if (i < node->num_keys)
+        {
+            *upper = node->keys[i];
+            *has_upper = true;
+        }
+        path->nodes[path->depth] = node;
+        path->child_idx[path->depth] = i;
+        path->depth++;
+        node = node->children[i];
+    }
+
+    path->nodes[path->depth] = node;
+    return true;
+}
+
+// Helper function to count the underfull leaves among children first..last
+static int count_short_leaves(BPTreeNode *parent, int first, int last, int min_keys)
+{
+    int count = 0;
+    for (int i = first; i <= last; i++)
+    {
+        if (parent->children[i]->num_keys < min_keys)
+            count++;
+    }
+    return count;
+}
+
+// Helper function to fix the underfull leaves under one parent. Returns
+// false if the budget ran out before all of them were visited.
+static bool merge_underfull_children(BPTree *tree, BPTreeNode *parent, int *budget)
+{
+    int min_keys = tree->policy.leaf_min_keys;
+    int i = 0;
+
+    while (i <= parent->num_keys)
+    {
+        if ((*budget)-- <= 0)
+            return false;
+
+        BPTreeNode *leaf = parent->children[i];
+        if (leaf->num_keys >= min_keys)
+        {
+            i++;
+            continue;
+        }
+
+        // Borrowing or merging touches the leaf and its two neighbours
+        int first = i > 0 ? i - 1 : 0;
+        int last = i < parent->num_keys ? i + 1 : i;
+        int short_before = count_short_leaves(parent, first, last, min_keys);
+        int children_before = parent->num_keys;
+
+        BPTreeNode *survivor = rebalance_leaf(tree, leaf, parent, i);
+        if (!survivor)
+            return true;
+
+        tree->mod_count++;
+        last -= children_before - parent->num_keys;
+        tree->pending_merges -= short_before - count_short_leaves(parent, first, last, min_keys);
+        if (tree->pending_merges < 0)
+            tree->pending_merges = 0;
+
+        // Merged into the left sibling: look at that one again, as it may
+        // still be short. Otherwise the leaf at i may still be short too.
+        if (survivor != leaf)
+            i--;
+    }
+
+    return true;
+}
+
+// Helper function to fix the underfull leaves from *resume_key on, visiting
+// at most COMPACT_BATCH_LEAVES of them, then the internal nodes above them
+// that were left with a single child. Called with the tree latch held for
+// writing. Returns true if there are more leaves to visit from *resume_key.
+static bool compact_leaves(BPTree *tree, int *resume_key)
+{
+    int budget = COMPACT_BATCH_LEAVES;
+
+    while (true)
+    {
+        LeafPath path;
+        int upper = 0;
+        bool has_upper;
+        if (!find_leaf_parent(tree, *resume_key, &path, &upper, &has_upper))
+            return false;
+
+        bool finished = merge_underfull_children(tree, path.nodes[path.depth], &budget);
+
+        // Walk back up; a merge only changes the key count of the parent
+        bool regrouped = false;
+        for (int d = path.depth; d > 0; d--)
+        {
+            BPTreeNode *node = path.nodes[d];
+            if (node->num_keys == 0 &&
+                rebalance_internal(tree, node, path.nodes[d - 1], path.child_idx[d - 1]))
+            {
+                tree->mod_count++;
+                regrouped |= d == path.depth;
+            }
+        }
+
+        while (!tree->root->is_leaf && tree->root->num_keys == 0)
+        {
+            // The root is left with a single child
+            BPTreeNode *old_root = tree->root;
+            tree->root = old_root->children[0];
+            free(old_root);
+            tree->height--;
+            tree->node_count--;
+            tree->mod_count++;
+            if (tree->root->is_leaf)
+                tree->pending_merges = 0;
+        }
+
+        if (!finished)
+            return true;
+
+        // The leaves gained new siblings: visit them again before moving on
+        if (!regrouped)
+        {
+            if (!has_upper)
+                return false;
+            *resume_key = upper;
+        }
+        if (budget <= 0)
+            return true;
+    }
+}
+
+// Background pass that merges the underfull leaves of lazy-delete tables.
+// The table latch is dropped between batches, so readers and commits wait
+// for at most one batch.
+static void *compactor_main(void *arg)
+{
+    (void)arg;
+
+    while (compactor_running)
+    {
+        usleep(COMPACT_INTERVAL_MS * 1000);
+
+        for (int i = 0; i < MAX_TABLES && compactor_running; i++)
+        {
+            Table *table = tables[i];
+            if (!table || !table->index)
+                continue;
+
+            BPTree *tree = table->index;
+            pthread_rwlock_rdlock(&tree->latch);
+            bool due = tree->policy.lazy_delete &&
+                       tree->pending_merges * COMPACT_UNDERFULL_RATIO > tree->node_count;
+            pthread_rwlock_unlock(&tree->latch);
+
+            int resume_key = INT_MIN;
+            bool more = due;
+            while (more && compactor_running)
+            {
+                pthread_rwlock_wrlock(&tree->latch);
+                more = tree->policy.lazy_delete && compact_leaves(tree, &resume_key);
+                pthread_rwlock_unlock(&tree->latch);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Checkpoint the logs that are due (or all of them), then drop the commit
+// records that no longer cover any entry
+static int checkpoint_logs(bool force)
+{
+    if (allocators_stale)
+        return 0;
+
+    // Every transaction below oldest_active has finished, and an asynchronous
+    // commit queues its record before it finishes. Flushing after reading
+    // oldest_active thus writes the record of every commit the checkpoint
+    // treats as decided; flushing first would miss one that finishes in
+    // between, and fold its entries away as uncommitted.
+    int oldest_active = transaction_oldest_active(&g_lock_manager);
+    wal_flush_commits();
+
+    int truncated = 0;
+    for (int i = 0; i < MAX_TABLES; i++)
+    {
+        if (wal_tables[i] == NULL || (!force && !wal_checkpoint_due(i)))
+            continue;
+
+        int count = wal_checkpoint_table(i, oldest_active);
+        if (count > 0)
+            truncated += count;
+    }
+
+    if (truncated > 0)
+        wal_trim_commit_log();
+    return truncated;
+}
+
+// Background checkpointer: keeps replay time and log space bounded
+static void *checkpointer_main(void *arg)
+{
+    (void)arg;
+
+    while (checkpointer_running)
+    {
+        usleep(CHECKPOINT_INTERVAL_MS * 1000);
+        if (checkpointer_running)
+            checkpoint_logs(false);
+    }
+
+    return NULL;
+}
+
+// Release the contexts of asynchronous commits that are durable now
+static void release_durable_contexts(uint64_t durable_lsn)
+{
+    pthread_mutex_lock(&undurable_mutex);
+    TxnContext *durable = NULL;
+    TxnContext **link = &undurable_contexts;
+    while (*link)
+    {
+        TxnContext *ctx = *link;
+        if (ctx->commit_lsn <= durable_lsn)
+        {
+            *link = ctx->next;
+            ctx->next = durable;
+            durable = ctx;
+        }
+        else
+        {
+            link = &ctx->next;
+        }
+    }
+    pthread_mutex_unlock(&undurable_mutex);
+
+    while (durable)
+    {
+        TxnContext *ctx = durable;
+        durable = ctx->next;
+        release_txn_context(ctx);
+    }
+}
+
+// Background flusher: persists the commit records of asynchronous commits
+// that no synchronous commit has carried along
+static void *flusher_main(void *arg)
+{
+    (void)arg;
+
+    while (flusher_running)
+    {
+        usleep(ASYNC_COMMIT_INTERVAL_US);
+        release_durable_contexts(wal_flush_commits());
+    }
+
+    return NULL;
+}
+
+// Attach the WAL tables and commit log of an existing database and create
+// empty DRAM tables for its catalog. db_recover() fills in the indexes.
+static void open_catalog(const Superblock *sb)
+{
+    if (sb->commit_log)
+    {
+        wal_attach_commit_log((char *)nvram_map + sb->commit_log);
+    }
+
+    for (unsigned int i = 0; i < sb->table_count && i < MAX_TABLES; i++)
+    {
+        const CatalogEntry *entry = &sb->tables[i];
+        Table *table = (Table *)calloc(1, sizeof(Table));
+        BPTree *tree = create_tree();
+        if (!table || !tree || !wal_attach_table(entry->table_id, (char *)nvram_map + entry->wal_root))
+        {
+            printf("Error: Failed to open table '%s'\n", entry->name);
+            free(table);
+            if (tree)
+                free_tree(tree);
+            continue;
+        }
+
+        strncpy(table->name, entry->name, MAX_TABLE_NAME - 1);
+        table->name[MAX_TABLE_NAME - 1] = '\0';
+        table->table_id = entry->table_id;
+        table->index = tree;
+        table->is_open = true;
+        table->durability = DURABILITY_SYNC;
+
+        // Secondary indexes start empty and are filled with the recovered rows
+        for (uint32_t j = 0; j < entry->index_count && j < MAX_INDEXES; j++)
+        {
+            IndexSpec spec;
+            spec.type = (IndexFieldType)entry->indexes[j].type;
+            spec.field = entry->indexes[j].field;
+            SecondaryIndex *index = sec_index_create(entry->indexes[j].name, &spec);
+            if (!index)
+            {
+                printf("Error: Failed to open index '%s'\n", entry->indexes[j].name);
+                continue;
+            }
+            table->indexes[table->index_count++] = index;
+        }
+        tables[i] = table;
+    }
+
+    next_table_id = sb->next_table_id;
+
+    // IDs up to the old lease may appear in the log
+    g_lock_manager.next_txn_id = sb->txn_id_lease > 0 ? sb->txn_id_lease : 1;
+}
+
+// Initialize database system
+void db_init()
+{
+    if (is_initialized)
+        return;
+
+    // Choose how stores are made durable, then map NVRAM
+    persist_init(get_nvram_path());
+
+    // Initialize NVRAM free space manager
+    init_free_space();
+
+    // Initialize lock manager
+    lock_manager_init(&g_lock_manager);
+
+    // Initialize tables array
+    for (int i = 0; i < MAX_TABLES; i++)
+    {
+        tables[i] = NULL;
+    }
+    next_table_id = 0;
+    txn_id_lease = 0;
+
+    // Find the catalog of an existing database, or start a new one
+    allocators_stale = superblock_open();
+    if (allocators_stale)
+    {
+        open_catalog(superblock_get());
+    }
+    else
+    {
+        // Create the commit log shared by all tables
+        void *commit_log_ptr = allocate_aligned(sizeof(WALTable), 64);
+        if (!commit_log_ptr || !wal_create_commit_log(commit_log_ptr) ||
+            !superblock_set_commit_log(commit_log_ptr))
+        {
+            printf("Error: Failed to create commit log\n");
+        }
+    }
+
+    // Start the background compactor for lazy-delete tables
+    compactor_running = true;
+    if (pthread_create(&compactor_thread, NULL, compactor_main, NULL) != 0)
+    {
+        printf("Warning: Failed to start background compactor\n");
+        compactor_running = false;
+    }
+
+    checkpointer_running = true;
+    if (pthread_create(&checkpointer_thread, NULL, checkpointer_main, NULL) != 0)
+    {
+        printf("Warning: Failed to start background checkpointer\n");
+        checkpointer_running = false;
+    }
+
+    flusher_running = true;
+    if (pthread_create(&flusher_thread, NULL, flusher_main, NULL) != 0)
+    {
+        printf("Warning: Failed to start asynchronous commit flusher\n");
+        flusher_running = false;
+    }
+
+    is_initialized = true;
+    printf("Database system initialized\n");
+}
+
+// Shutdown database system
+void db_shutdown()
+{
+    if (!is_initialized)
+        return;
+
+    // Stop the background compactor before tearing down tables
+    if (compactor_running)
+    {
+        compactor_running = false;
+        pthread_join(compactor_thread, NULL);
+    }
+    if (checkpointer_running)
+    {
+        checkpointer_running = false;
+        pthread_join(checkpointer_thread, NULL);
+    }
+    if (flusher_running)
+    {
+        flusher_running = false;
+        pthread_join(flusher_thread, NULL);
+    }
+
+    // Asynchronous commits become durable before the logs are detached
+    release_durable_contexts(wal_flush_commits());
+
+    // Close and free all tables
+    for (int i = 0; i < MAX_TABLES; i++)
+    {
+        if (tables[i])
+        {
+            // Free NVRAM data for all records
+            if (tables[i]->index)
+            {
+                // We would need to traverse all leaves and free NVRAM data
+                // For brevity, this code is omitted
+                free_tree(tables[i]->index);
+            }
+            for (int j = 0; j < tables[i]->index_count; j++)
+            {
+                sec_index_destroy(tables[i]->indexes[j]);
+            }
+            free(tables[i]);
+            tables[i] = NULL;
+        }
+    }
+
+    // Clean up NVRAM
+    wal_detach_all();
+    cleanup_small_alloc();
+    cleanup_free_space();
+
+    // Clean up lock manager
+    lock_manager_cleanup(&g_lock_manager);
+
+    is_initialized = false;
+    printf("Database system shut down\n");
+}
+
+// Add a row whose key is not in the tree yet (tree latch held for writing)
+static bool tree_insert(BPTree *tree, int key, NVRAMPtr data, size_t size)
+{
+    // Handle empty tree case
+    if (tree->root == NULL)
+    {
+        tree->root = create_node(true);
+        if (!tree->root)
+        {
+            printf("Error: Failed to create root node\n");
+            return false;
+        }
+
+        tree->root->keys[0] = key;
+        tree->root->slots[0] = slot_encode(data, size);
+        tree->root->num_keys = 1;
+        tree->record_count++;
+        tree->mod_count++;
+        return true;
+    }
+
+    // Recursive insertion
+    int up_key;
+    BPTreeNode *new_node = NULL;
+
+    if (!insert_recursive(tree, tree->root, key, data, size, &up_key, &new_node))
+    {
+        printf("Error: Failed to insert key\n");
+        return false;
+    }
+
+    // Root split case
+    if (new_node != NULL)
+    {
+        // Create new root
+        BPTreeNode *new_root = create_node(false);
+        if (!new_root)
+        {
+            printf("Error: Failed to create new root\n");
+            free_node(new_node);
+            return false;
+        }
+
+        // Set up new root
+        new_root->keys[0] = up_key;
+        new_root->children[0] = tree->root;
+        new_root->children[1] = new_node;
+        new_root->num_keys = 1;
+        recount_node(new_root);
+
+        // Update tree
+        tree->root = new_root;
+        tree->height++;
+        tree->node_count++;
+    }
+
+    // Update record count
+    tree->record_count++;
+    tree->mod_count++;
+    return true;
+}
+
+// Apply one committed write to its table (tree latch held for writing)
+static void apply_write(TxnContext *ctx, WriteSetEntry *w)
+{
+    Table *table = w->table;
+    BPTree *tree = table->index;
+    BPTreeNode *leaf = find_leaf(tree, w->key);
+    int pos = leaf ? find_key_in_leaf(leaf, w->key) : -1;
+
+    // Index entries are derived from the row, so the row's WAL entry covers them
+    if (pos != -1)
+    {
+        update_secondary_indexes(table, w->key, slot_ptr(leaf->slots[pos]), slot_size(leaf->slots[pos]), false, NULL);
+    }
+
+    if (w->fields)
+    {
+        // The row lock kept the row from being replaced since the words were
+        // logged. Each word is a single atomic store; a crash part way is
+        // repaired by redoing the field records.
+        if (pos == -1)
+        {
+            printf("Error: Row %d of committed field writes not found\n", w->key);
+            return;
+        }
+
+        NVRAMPtr row = slot_ptr(leaf->slots[pos]);
+        size_t size = slot_size(leaf->slots[pos]);
+        for (FieldDelta *d = w->fields; d; d = d->next)
+        {
+            atomic_write_64((char *)row + d->offset, d->value);
+        }
+
+        // From here on the entry stands for the committed row, which is what
+        // the followers are sent
+        txn_drop_fields(w);
+        w->data = row;
+        w->size = size;
+        update_secondary_indexes(table, w->key, row, size, true, &ctx->index_spares);
+        return;
+    }
+
+    if (w->data == NULL)
+    {
+        // Deleted: the committed version is freed when the transaction ends
+        if (pos != -1)
+            txn_retire(ctx, slot_ptr(leaf->slots[pos]), slot_size(leaf->slots[pos]));
+        if (pos != -1 && remove_recursive(tree, tree->root, w->key, NULL, 0))
+        {
+            tree->record_count--;
+            tree->mod_count++;
+        }
+        return;
+    }
+
+    if (pos != -1)
+    {
+        // Swap the version in the leaf; no keys move, so cursors stay valid.
+        // The old version is freed when the transaction ends.
+        txn_retire(ctx, slot_ptr(leaf->slots[pos]), slot_size(leaf->slots[pos]));
+        leaf->slots[pos] = slot_encode(w->data, w->size);
+    }
+    else if (!tree_insert(tree, w->key, w->data, w->size))
+    {
+        // The row is durable and comes back at the next recovery
+        printf("Error: Failed to apply committed row %d\n", w->key);
+        return;
+    }
+
+    update_secondary_indexes(table, w->key, w->data, w->size, true, &ctx->index_spares);
+}
+
+// Make a committed transaction's writes visible, latching each written
+// table once. The row locks are still held, so no other transaction has
+// changed these rows since they were written.
+static void txn_apply_writes(TxnContext *ctx)
+{
+    unsigned int applied = 0;
+    for (WriteSetEntry *first = ctx->writes; first; first = first->next)
+    {
+        Table *table = first->table;
+        if (applied & (1u << table->table_id))
+            continue;
+        applied |= 1u << table->table_id;
+
+        pthread_rwlock_wrlock(&table->index->latch);
+        for (WriteSetEntry *w = first; w; w = w->next)
+        {
+            if (w->table == table)
+                apply_write(ctx, w);
+        }
+        pthread_rwlock_unlock(&table->index->latch);
+    }
+
+    // Spares left over (rows without the indexed field, deletes) are not needed
+    sec_index_free_spares(ctx->index_spares);
+    ctx->index_spares = NULL;
+}
+
+// Ship a committed transaction's writes to the replication followers. The
+// row locks are still held, so transactions that wrote the same rows are
+// published in the order they were applied.
+static void txn_ship_writes(TxnContext *ctx)
+{
+    if (!ctx->writes)
+        return;
+
+    ReplBatch *batch = repl_batch_begin();
+    if (!batch)
+        return;
+
+    for (WriteSetEntry *w = ctx->writes; w; w = w->next)
+    {
+        repl_batch_add(batch, w->data ? REPL_OP_PUT : REPL_OP_DELETE, w->table->table_id, w->key,
+                       w->data, w->data ? w->size : 0);
+    }
+    repl_batch_publish(batch);
+}
+
+// Does a transaction commit asynchronously? Unless set for the transaction,
+// only if every table it wrote is asynchronous.
+static bool txn_commits_async(TxnContext *ctx)
+{
+    if (ctx->durability != DURABILITY_DEFAULT)
+        return ctx->durability == DURABILITY_ASYNC;
+
+    for (WriteSetEntry *w = ctx->writes; w; w = w->next)
+    {
+        if (w->table->durability != DURABILITY_ASYNC)
+            return false;
+    }
+    return ctx->writes != NULL;
+}
+
+// Begin a transaction
+int db_begin_transaction()
+{
+    int txn_id = transaction_begin(&g_lock_manager);
+
+    // Persist a new block of IDs before handing out the first one of it
+    pthread_mutex_lock(&txn_lease_mutex);
+    if (txn_id >= txn_id_lease)
+    {
+        txn_id_lease = txn_id + TXN_ID_LEASE_STEP;
+        superblock_set_txn_lease(txn_id_lease);
+    }
+    pthread_mutex_unlock(&txn_lease_mutex);
+
+    return txn_id;
+}
+
+// Commit a transaction through its commit record
+bool db_commit_transaction(int txn_id)
+{
+    // A deadlock victim can only abort. Past this point the transaction can
+    // no longer be made one, so its locks are held until it has committed.
+    if (!transaction_prepare(&g_lock_manager, txn_id))
+    {
+        if (transaction_is_victim(&g_lock_manager, txn_id))
+            printf("Error: Transaction %d aborted to break a deadlock\n", txn_id);
+        db_abort_transaction(txn_id);
+        return false;
+    }
+
+    // Coalesced small-row writes must be durable before the commit
+    TxnContext *ctx = take_txn_context(txn_id);
+    txn_flush_dirty(ctx);
+
+    // A writing transaction is durable once its commit record is. The record
+    // names the tables in its write set; concurrent commits are batched into
+    // groups that share one append and one fence. This happens before the
+    // locks are released, so no transaction can see a write whose commit is
+    // still undecided.
+    bool async = ctx && txn_commits_async(ctx);
+    if (ctx && ctx->table_mask && !wal_group_commit(txn_id, ctx->table_mask, async))
+    {
+        printf("Error: Failed to write commit record\n");
+        txn_discard_writes(ctx);
+        transaction_abort(&g_lock_manager, txn_id);
+        release_txn_context(ctx);
+        return false;
+    }
+
+    // The writes reach the indexes only now, and then the followers
+    if (ctx)
+    {
+        txn_apply_writes(ctx);
+        txn_ship_writes(ctx);
+    }
+
+    bool result = transaction_commit(&g_lock_manager, txn_id);
+
+    // Old versions are unreachable once the updates are committed, but an
+    // asynchronous commit still needs them until it is durable
+    if (async && ctx->table_mask)
+    {
+        ctx->commit_lsn = wal_last_commit_lsn();
+        pthread_mutex_lock(&undurable_mutex);
+        ctx->next = undurable_contexts;
+        undurable_contexts = ctx;
+        pthread_mutex_unlock(&undurable_mutex);
+    }
+    else
+    {
+        release_txn_context(ctx);
+    }
+
+    return result;
+}
+
+// Abort a transaction
+bool db_abort_transaction(int txn_id)
+{
+    // Nothing reached the indexes, so rolling back only frees the staged
+    // versions. Their WAL entries never get a commit record.
+    TxnContext *ctx = take_txn_context(txn_id);
+    txn_discard_writes(ctx);
+
+    bool result = transaction_abort(&g_lock_manager, txn_id);
+
+    release_txn_context(ctx);
+
+    return result;
+}
+
+// Create a new table
+int db_create_table(const char *name)
+{
+    if (!is_initialized)
+    {
+        printf("Error: Database not initialized\n");
+        return -1;
+    }
+
+    // Find a free slot in tables array
+    int slot = -1;
+    for (int i = 0; i < MAX_TABLES; i++)
+    {
+        if (tables[i] == NULL)
+        {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot == -1)
+    {
+        printf("Error: Maximum number of tables reached\n");
+        return -1;
+    }
+
+    // Check if table with same name already exists
+    for (int i = 0; i < MAX_TABLES; i++)
+    {
+        if (tables[i] && strcmp(tables[i]->name, name) == 0)
+        {
+            printf("Error: Table '%s' already exists\n", name);
+            return -1;
+        }
+    }
+
+    // Create table structure
+    Table *table = (Table *)malloc(sizeof(Table));
+    if (!table)
+    {
+        printf("Error: Failed to allocate memory for table\n");
+        return -1;
     }
 
     // Create B+ Tree index
     BPTree *tree = create_tree();
     if (!tree)
     {
-        printf("Error: Failed to create index for table\n");
-        free(table);
-        return -1;
+        printf("Error: Failed to create index for table\n");
+        free(table);
+        return -1;
+    }
+
+    // Initialize table
+    strncpy(table->name, name, MAX_TABLE_NAME - 1);
+    table->name[MAX_TABLE_NAME - 1] = '\0';
+    table->table_id = next_table_id++;
+    table->index = tree;
+    table->is_open = true;
+    table->index_count = 0;
+    table->durability = DURABILITY_SYNC;
+
+    // Create WAL table in NVRAM
+    void *wal_table_ptr = allocate_aligned(sizeof(WALTable), 64);
+    if (!wal_table_ptr)
+    {
+        printf("Error: Failed to allocate NVRAM for WAL table\n");
+        free_tree(tree);
+        free(table);
+        return -1;
+    }
+
+    // Initialize WAL table
+    if (!wal_create_table(table->table_id, wal_table_ptr))
+    {
+        printf("Error: Failed to create WAL table\n");
+        free_memory(wal_table_ptr, sizeof(WALTable));
+        free_tree(tree);
+        free(table);
+        return -1;
+    }
+
+    // Record the table in the persistent catalog
+    if (!superblock_add_table(table->name, table->table_id, wal_table_ptr))
+    {
+        printf("Error: Failed to add table to catalog\n");
+        wal_detach_table(table->table_id);
+        free_memory(wal_table_ptr, sizeof(WALTable));
+        free_tree(tree);
+        free(table);
+        return -1;
+    }
+
+    // Add to tables array
+    tables[slot] = table;
+
+    // Followers create the table too; its rows follow in later commits
+    ReplBatch *batch = repl_batch_begin();
+    repl_batch_add(batch, REPL_OP_TABLE, table->table_id, 0, table->name, strlen(table->name) + 1);
+    repl_batch_publish(batch);
+
+    printf("Table '%s' created with ID %d\n", name, table->table_id);
+    return table->table_id;
+}
+
+// Open an existing table
+Table *db_open_table(const char *name)
+{
+    if (!is_initialized)
+    {
+        printf("Error: Database not initialized\n");
+        return NULL;
+    }
+
+    for (int i = 0; i < MAX_TABLES; i++)
+    {
+        if (tables[i] && strcmp(tables[i]->name, name) == 0)
+        {
+            tables[i]->is_open = true;
+            return tables[i];
+        }
+    }
+
+    printf("Error: Table '%s' not found\n", name);
+    return NULL;
+}
+
+// Close a table
+void db_close_table(Table *table)
+{
+    if (table)
+    {
+        table->is_open = false;
+        printf("Table '%s' closed\n", table->name);
+    }
+}
+
+// Set how commits of transactions writing a table are made durable
+bool db_set_table_durability(Table *table, Durability durability)
+{
+    if (!table || (durability != DURABILITY_SYNC && durability != DURABILITY_ASYNC))
+    {
+        printf("Error: Invalid table durability\n");
+        return false;
+    }
+
+    table->durability = durability;
+    return true;
+}
+
+Durability db_get_table_durability(Table *table)
+{
+    return table ? table->durability : DURABILITY_SYNC;
+}
+
+// Override the durability of one transaction's commit
+bool db_set_txn_durability(int txn_id, Durability durability)
+{
+    TxnContext *ctx = get_txn_context(txn_id);
+    if (!ctx)
+    {
+        printf("Error: Failed to set durability of transaction %d\n", txn_id);
+        return false;
+    }
+
+    ctx->durability = durability;
+    return true;
+}
+
+// Get the B+ Tree maintenance policy of a table
+void db_get_table_policy(Table *table, TablePolicy *policy)
+{
+    if (!table)
+        return;
+
+    pthread_rwlock_rdlock(&table->index->latch);
+    *policy = table->index->policy;
+    pthread_rwlock_unlock(&table->index->latch);
+}
+
+// Set the B+ Tree maintenance policy of a table
+bool db_set_table_policy(Table *table, const TablePolicy *policy)
+{
+    if (!table)
+    {
+        printf("Error: Invalid table\n");
+        return false;
+    }
+
+    // Both halves of a split leaf must keep at least one key
+    if (policy->leaf_split_keys < 1 || policy->leaf_split_keys > BP_ORDER - 2)
+    {
+        printf("Error: Leaf split point must be between 1 and %d\n", BP_ORDER - 2);
+        return false;
+    }
+
+    // A merged pair of underfull leaves must still fit in one leaf
+    if (policy->leaf_min_keys < 0 || policy->leaf_min_keys > (BP_ORDER - 1) / 2)
+    {
+        printf("Error: Leaf minimum occupancy must be between 0 and %d\n", (BP_ORDER - 1) / 2);
+        return false;
+    }
+
+    pthread_rwlock_wrlock(&table->index->latch);
+    table->index->policy = *policy;
+    pthread_rwlock_unlock(&table->index->latch);
+    return true;
+}
+
+// Reorganize a table's index now instead of waiting for the compactor
+bool db_compact_table(Table *table)
+{
+    if (!table)
+    {
+        printf("Error: Invalid table\n");
+        return false;
+    }
+
+    pthread_rwlock_wrlock(&table->index->latch);
+    bool result = rebuild_tree(table->index);
+    pthread_rwlock_unlock(&table->index->latch);
+    return result;
+}
+
+// Row operation collected from a table's WAL during recovery
+typedef struct ReplayOp
+{
+    int key;
+    int seq; // Position in the log; later operations win
+    int op;  // WAL_OP_INSERT, WAL_OP_UPDATE, WAL_OP_DELETE or WAL_OP_FIELD
+    NVRAMPtr data;
+    size_t size;           // Bytes of the field words for WAL_OP_FIELD
+    uint32_t field_offset; // WAL_OP_FIELD only
+    uint64_t field_words[WAL_FIELD_MAX_WORDS];
+} ReplayOp;
+
+// Recovery work for one table, run on its own thread
+typedef struct ReplayJob
+{
+    int table_id;
+    TablePolicy policy;
+    ReplayOp *ops;
+    int op_count, op_capacity;
+    int seq;
+    bool failed;
+    BPTree *tree; // Recovered index
+} ReplayJob;
+
+// Helper to grow a replay array
+static bool replay_reserve(void **array, int *capacity, int count, size_t elem_size)
+{
+    if (count < *capacity)
+        return true;
+
+    int new_capacity = *capacity ? *capacity * 2 : 1024;
+    void *grown = realloc(*array, new_capacity * elem_size);
+    if (!grown)
+        return false;
+    *array = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+// WAL replay callback: collect committed row operations. Uncommitted field
+// writes never reached their row, so they need no undo.
+static void collect_replay_op(const WALEntry *entry, int committed, void *arg)
+{
+    ReplayJob *job = (ReplayJob *)arg;
+    int seq = job->seq++;
+    if (job->failed || !committed)
+        return;
+
+    if (entry->op_flag != WAL_OP_INSERT && entry->op_flag != WAL_OP_UPDATE &&
+        entry->op_flag != WAL_OP_DELETE && entry->op_flag != WAL_OP_FIELD)
+        return;
+
+    if (!replay_reserve((void **)&job->ops, &job->op_capacity, job->op_count, sizeof(ReplayOp)))
+    {
+        job->failed = true;
+        return;
+    }
+    ReplayOp *op = &job->ops[job->op_count++];
+    op->key = entry->key;
+    op->seq = seq;
+    op->op = entry->op_flag;
+    op->data = entry->data_ptr;
+    op->size = entry->data_size;
+    op->field_offset = entry->field_offset;
+    memcpy(op->field_words, entry->field_words, sizeof(op->field_words));
+}
+
+// Sort helper: by key, then by log position
+static int compare_replay_ops(const void *a, const void *b)
+{
+    const ReplayOp *x = (const ReplayOp *)a, *y = (const ReplayOp *)b;
+    if (x->key != y->key)
+        return (x->key > y->key) - (x->key < y->key);
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+// Rebuild one table's index from its committed WAL entries
+static void *replay_table_main(void *arg)
+{
+    ReplayJob *job = (ReplayJob *)arg;
+
+    if (wal_replay_table(job->table_id, collect_replay_op, job) < 0 || job->failed)
+    {
+        job->failed = true;
+        return NULL;
+    }
+
+    // The last operation on each key decides whether and where the row lives
+    qsort(job->ops, job->op_count, sizeof(ReplayOp), compare_replay_ops);
+
+    int capacity = job->op_count > 0 ? job->op_count : 1;
+    int *keys = (int *)malloc(capacity * sizeof(int));
+    uint64_t *slots = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    job->tree = create_tree();
+    if (!keys || !slots || !job->tree)
+    {
+        free(keys);
+        free(slots);
+        job->failed = true;
+        return NULL;
+    }
+
+    int n = 0;
+    for (int i = 0; i < job->op_count;)
+    {
+        // The last version written decides whether and where the row lives
+        int end = i, version = -1;
+        for (; end < job->op_count && job->ops[end].key == job->ops[i].key; end++)
+        {
+            if (job->ops[end].op != WAL_OP_FIELD)
+                version = end;
+        }
+
+        if (version != -1 && job->ops[version].op != WAL_OP_DELETE)
+        {
+            const ReplayOp *row = &job->ops[version];
+            keys[n] = row->key;
+            slots[n] = slot_encode(row->data, row->size);
+            n++;
+
+            // Field writes committed after it are redone; a crash may have
+            // come before or part way through their stores into the row
+            for (int j = version + 1; j < end; j++)
+            {
+                const ReplayOp *field = &job->ops[j];
+                if (field->field_offset + field->size > ALIGN_ROW(row->size))
+                    continue;
+                for (size_t w = 0; w < field->size / sizeof(uint64_t); w++)
+                {
+                    atomic_write_64((char *)row->data + field->field_offset + w * sizeof(uint64_t),
+                                    field->field_words[w]);
+                }
+            }
+        }
+        i = end;
+    }
+
+    // Leaves are packed to the table's split point, as after compaction
+    job->tree->policy = job->policy;
+    free_node(job->tree->root);
+    if (bulk_build(job->tree, keys, slots, n, job->policy.leaf_split_keys))
+    {
+        job->tree->record_count = n;
+    }
+    else
+    {
+        job->tree->root = NULL;
+        job->failed = true;
+    }
+
+    free(keys);
+    free(slots);
+    return NULL;
+}
+
+// Find the table that owns a WAL table ID
+static Table *find_table_by_id(int table_id)
+{
+    for (int i = 0; i < MAX_TABLES; i++)
+    {
+        if (tables[i] && tables[i]->table_id == table_id)
+            return tables[i];
+    }
+    return NULL;
+}
+
+// Install a recovered tree in an existing table and rebuild its secondary indexes
+static void install_recovered_tree(Table *table, BPTree *recovered)
+{
+    pthread_rwlock_wrlock(&table->index->latch);
+
+    BPTreeNode *old_root = table->index->root;
+    table->index->root = recovered->root;
+    table->index->height = recovered->height;
+    table->index->node_count = recovered->node_count;
+    table->index->record_count = recovered->record_count;
+    table->index->pending_merges = 0;
+    table->index->mod_count++;
+
+    for (int j = 0; j < table->index_count; j++)
+    {
+        SecondaryIndex *old_index = table->indexes[j];
+        SecondaryIndex *index = sec_index_create(old_index->name, &old_index->spec);
+        if (index)
+        {
+            index->incomplete = !index_all_rows(table->index, index);
+            table->indexes[j] = index;
+            sec_index_destroy(old_index);
+        }
+        else
+        {
+            old_index->incomplete = true;
+        }
+    }
+
+    pthread_rwlock_unlock(&table->index->latch);
+
+    recovered->root = old_root;
+    free_tree(recovered);
+}
+
+// NVRAM found in use while rebuilding the allocators
+typedef struct ReachableSet
+{
+    UsedBlock *blocks;
+    int block_count;
+    int block_capacity;
+    void **small_rows; // Rows in shared pages
+    int small_count;
+    int small_capacity;
+    bool failed;
+} ReachableSet;
+
+// Helper to record a block in use
+static void add_used_block(ReachableSet *set, void *ptr, size_t size)
+{
+    if (!replay_reserve((void **)&set->blocks, &set->block_capacity, set->block_count, sizeof(UsedBlock)))
+    {
+        set->failed = true;
+        return;
+    }
+    set->blocks[set->block_count].offset = (char *)ptr - (char *)nvram_map;
+    set->blocks[set->block_count].size = size;
+    set->block_count++;
+}
+
+// WAL block callback
+static void note_log_block(void *ptr, size_t size, void *arg)
+{
+    add_used_block((ReachableSet *)arg, ptr, size);
+}
+
+// Helper to record a row and, for a small row, its page
+static void add_used_row(ReachableSet *set, NVRAMPtr data, size_t size)
+{
+    if (!row_is_small(size))
+    {
+        add_used_block(set, data, size);
+        return;
+    }
+
+    // Rows of a page are mostly found together, so the page is recorded once
+    // for each run of them
+    if (set->small_count == 0 || small_page_of(set->small_rows[set->small_count - 1]) != small_page_of(data))
+        add_used_block(set, small_page_of(data), SMALL_PAGE_SIZE);
+    if (!replay_reserve((void **)&set->small_rows, &set->small_capacity, set->small_count, sizeof(void *)))
+    {
+        set->failed = true;
+        return;
+    }
+    set->small_rows[set->small_count++] = data;
+}
+
+// Rebuild the NVRAM allocators after a restart from what the recovered
+// database reaches: the logs and the rows of every table. Everything else
+// was freed, or allocated by a transaction the crash cut short.
+static bool rebuild_allocators()
+{
+    ReachableSet set;
+    memset(&set, 0, sizeof(set));
+    wal_list_blocks(note_log_block, &set);
+
+    for (int i = 0; i < MAX_TABLES && !set.failed; i++)
+    {
+        if (!tables[i] || !tables[i]->index->root)
+            continue;
+
+        BPTreeNode *leaf = tables[i]->index->root;
+        while (!leaf->is_leaf)
+        {
+            leaf = leaf->children[0];
+        }
+        for (; leaf && !set.failed; leaf = leaf->next_leaf)
+        {
+            for (int j = 0; j < leaf->num_keys; j++)
+            {
+                add_used_row(&set, slot_ptr(leaf->slots[j]), slot_size(leaf->slots[j]));
+            }
+        }
+    }
+
+    // The pages' bitmaps are rebuilt first: if the free list cannot be, the
+    // old one still counts every page as allocated
+    bool ok = !set.failed && small_alloc_rebuild(set.small_rows, set.small_count) &&
+              free_space_rebuild(set.blocks, set.block_count);
+    if (ok)
+    {
+        printf("Rebuilt NVRAM allocator: %d blocks in use\n", set.block_count);
+    }
+    else
+    {
+        printf("Error: Failed to rebuild the NVRAM allocator\n");
+    }
+    free(set.blocks);
+    free(set.small_rows);
+    return ok;
+}
+
+// Rebuild every table's index from the committed entries of its WAL, one
+// thread per table. Tables with a WAL but no DRAM state are recreated.
+// The first call after opening an existing database also rebuilds the
+// allocators from the recovered rows, so it must come before any transaction.
+bool db_recover()
+{
+    if (!is_initialized)
+    {
+        printf("Error: Database not initialized\n");
+        return false;
+    }
+
+    ReplayJob jobs[MAX_TABLES];
+    pthread_t threads[MAX_TABLES];
+    bool started[MAX_TABLES] = {false};
+    bool ok = true;
+
+    for (int id = 0; id < MAX_TABLES; id++)
+    {
+        if (wal_tables[id] == NULL)
+            continue;
+
+        Table *table = find_table_by_id(id);
+        memset(&jobs[id], 0, sizeof(ReplayJob));
+        jobs[id].table_id = id;
+        if (table)
+        {
+            jobs[id].policy = table->index->policy;
+        }
+        else
+        {
+            jobs[id].policy.leaf_split_keys = (BP_ORDER - 1) / 2;
+            jobs[id].policy.leaf_min_keys = (BP_ORDER - 1) / 2;
+            jobs[id].policy.lazy_delete = false;
+        }
+
+        if (pthread_create(&threads[id], NULL, replay_table_main, &jobs[id]) == 0)
+        {
+            started[id] = true;
+        }
+        else
+        {
+            // Replay this table on the calling thread instead
+            replay_table_main(&jobs[id]);
+        }
+    }
+
+    for (int id = 0; id < MAX_TABLES; id++)
+    {
+        if (wal_tables[id] == NULL)
+            continue;
+        if (started[id])
+            pthread_join(threads[id], NULL);
+
+        ReplayJob *job = &jobs[id];
+        free(job->ops);
+        if (job->failed)
+        {
+            printf("Error: Failed to recover table ID %d\n", id);
+            if (job->tree)
+                free_tree(job->tree);
+            ok = false;
+            continue;
+        }
+
+        Table *table = find_table_by_id(id);
+        if (table)
+        {
+            install_recovered_tree(table, job->tree);
+        }
+        else
+        {
+            int slot = 0;
+            while (slot < MAX_TABLES && tables[slot] != NULL)
+                slot++;
+            table = (Table *)calloc(1, sizeof(Table));
+            if (slot == MAX_TABLES || !table)
+            {
+                printf("Error: No room for recovered table ID %d\n", id);
+                free(table);
+                free_tree(job->tree);
+                ok = false;
+                continue;
+            }
+
+            // A WAL without a catalog entry gets a placeholder name
+            snprintf(table->name, MAX_TABLE_NAME, "table_%d", id);
+            table->table_id = id;
+            table->index = job->tree;
+            table->is_open = true;
+            tables[slot] = table;
+            if (next_table_id <= id)
+                next_table_id = id + 1;
+        }
+
+        printf("Recovered table '%s': %d rows\n", table->name, table->index->record_count);
+    }
+
+    // Until now the allocators count everything from before the restart as
+    // in use. If a table failed to recover, they keep doing so, rather than
+    // hand out its rows again.
+    if (allocators_stale)
+    {
+        if (ok)
+            ok = rebuild_allocators();
+        allocators_stale = false;
+    }
+
+    return ok;
+}
+
+// Checkpoint every table's WAL now
+int db_checkpoint()
+{
+    if (!is_initialized)
+    {
+        printf("Error: Database not initialized\n");
+        return -1;
+    }
+
+    return checkpoint_logs(true);
+}
+
+// Helper function to find a secondary index by name
+static SecondaryIndex *find_index(Table *table, const char *name)
+{
+    for (int i = 0; i < table->index_count; i++)
+    {
+        if (strcmp(table->indexes[i]->name, name) == 0)
+        {
+            return table->indexes[i];
+        }
+    }
+    return NULL;
+}
+
+// Replace an index that lost rows with one built from the table's rows
+// (tree latch held for writing)
+static bool rebuild_index(Table *table, SecondaryIndex **index)
+{
+    SecondaryIndex *fresh = sec_index_create((*index)->name, &(*index)->spec);
+    if (!fresh || !index_all_rows(table->index, fresh))
+    {
+        sec_index_destroy(fresh);
+        return false;
+    }
+
+    for (int i = 0; i < table->index_count; i++)
+    {
+        if (table->indexes[i] == *index)
+            table->indexes[i] = fresh;
+    }
+    sec_index_destroy(*index);
+    *index = fresh;
+    return true;
+}
+
+// Create a secondary index on a row field and fill it from existing rows
+bool db_create_index(Table *table, const char *name, const IndexSpec *spec)
+{
+    if (!table || !table->is_open)
+    {
+        printf("Error: Invalid or closed table\n");
+        return false;
+    }
+
+    if (spec->field < 0)
+    {
+        printf("Error: Invalid index field %d\n", spec->field);
+        return false;
+    }
+
+    pthread_rwlock_wrlock(&table->index->latch);
+
+    if (find_index(table, name))
+    {
+        printf("Error: Index '%s' already exists\n", name);
+        pthread_rwlock_unlock(&table->index->latch);
+        return false;
+    }
+
+    if (table->index_count >= MAX_INDEXES)
+    {
+        printf("Error: Maximum number of indexes reached for table '%s'\n", table->name);
+        pthread_rwlock_unlock(&table->index->latch);
+        return false;
+    }
+
+    SecondaryIndex *index = sec_index_create(name, spec);
+    if (!index)
+    {
+        printf("Error: Failed to allocate memory for index\n");
+        pthread_rwlock_unlock(&table->index->latch);
+        return false;
+    }
+
+    if (!index_all_rows(table->index, index))
+    {
+        printf("Error: Failed to allocate memory for index\n");
+        sec_index_destroy(index);
+        pthread_rwlock_unlock(&table->index->latch);
+        return false;
+    }
+
+    // Recovery recreates the index from its catalog entry
+    if (!superblock_add_index(table->table_id, index->name, spec))
+    {
+        sec_index_destroy(index);
+        pthread_rwlock_unlock(&table->index->latch);
+        return false;
+    }
+
+    table->indexes[table->index_count++] = index;
+    pthread_rwlock_unlock(&table->index->latch);
+
+    printf("Index '%s' created on table '%s' (%zu entries)\n", name, table->name, index->entry_count);
+    return true;
+}
+
+// Drop a secondary index
+bool db_drop_index(Table *table, const char *name)
+{
+    if (!table)
+    {
+        printf("Error: Invalid table\n");
+        return false;
     }
 
-    // Initialize table
-    strncpy(table->name, name, MAX_TABLE_NAME - 1);
-    table->name[MAX_TABLE_NAME - 1] = '\0';
-    table->table_id = next_table_id++;
-    table->index = tree;
-    table->is_open = true;
+    pthread_rwlock_wrlock(&table->index->latch);
+    for (int i = 0; i < table->index_count; i++)
+    {
+        if (strcmp(table->indexes[i]->name, name) == 0)
+        {
+            superblock_drop_index(table->table_id, name);
+            sec_index_destroy(table->indexes[i]);
+            table->indexes[i] = table->indexes[--table->index_count];
+            pthread_rwlock_unlock(&table->index->latch);
+            return true;
+        }
+    }
+    pthread_rwlock_unlock(&table->index->latch);
 
-    // Create WAL table in NVRAM
-    void *wal_table_ptr = allocate_memory(sizeof(WALTable));
-    if (!wal_table_ptr)
+    printf("Error: Index '%s' not found\n", name);
+    return false;
+}
+
+// Find primary keys of rows whose indexed field equals value (no row locks
+// are taken). An index that lost rows is rebuilt first. Returns the number
+// of matches, or -1 if the index does not exist or could not be rebuilt.
+int db_index_lookup(Table *table, const char *name, int value, int *keys, int max_keys)
+{
+    if (!table || !table->is_open)
     {
-        printf("Error: Failed to allocate NVRAM for WAL table\n");
-        free_tree(tree);
-        free(table);
+        printf("Error: Invalid or closed table\n");
         return -1;
     }
 
-    // Initialize WAL table
-    if (!wal_create_table(table->table_id, wal_table_ptr))
+    pthread_rwlock_rdlock(&table->index->latch);
+    SecondaryIndex *index = find_index(table, name);
+    if (index && index->incomplete)
     {
-        printf("Error: Failed to create WAL table\n");
-        free_memory(wal_table_ptr, sizeof(WALTable));
-        free_tree(tree);
-        free(table);
-        return -1;
+        pthread_rwlock_unlock(&table->index->latch);
+        pthread_rwlock_wrlock(&table->index->latch);
+        index = find_index(table, name);
+        if (index && index->incomplete && !rebuild_index(table, &index))
+        {
+            printf("Error: Index '%s' is incomplete and could not be rebuilt\n", name);
+            pthread_rwlock_unlock(&table->index->latch);
+            return -1;
+        }
     }
+    int count = index ? sec_index_lookup(index, value, keys, max_keys) : -1;
+    pthread_rwlock_unlock(&table->index->latch);
 
-    // Add to tables array
-    tables[slot] = table;
+    return count;
+}
 
-    printf("Table '%s' created with ID %d\n", name, table->table_id);
-    return table->table_id;
+// Find the version of a row a transaction sees: its own staged write if it
+// has one, the committed row otherwise (which its staged field writes, if
+// any, still have to be laid over). Returns false if there is no row.
+static bool txn_current_row(Table *table, TxnContext *ctx, int key, NVRAMPtr *data, size_t *size)
+{
+    // Field writes leave the committed row in place until commit
+    WriteSetEntry *w = txn_find_write(ctx, table, key);
+    if (w && !w->fields)
+    {
+        *data = w->data;
+        *size = w->size;
+        return w->data != NULL;
+    }
+
+    pthread_rwlock_rdlock(&table->index->latch);
+    BPTreeNode *leaf = find_leaf(table->index, key);
+    int pos = leaf ? find_key_in_leaf(leaf, key) : -1;
+    if (pos != -1)
+    {
+        *data = slot_ptr(leaf->slots[pos]);
+        *size = slot_size(leaf->slots[pos]);
+    }
+    pthread_rwlock_unlock(&table->index->latch);
+
+    return pos != -1;
 }
 
-// Open an existing table
-Table *db_open_table(const char *name)
+// Helper to read len bytes of the row a transaction sees at offset: the
+// committed row with the transaction's staged field writes laid over it
+static void txn_read_field(WriteSetEntry *w, NVRAMPtr row, size_t offset, size_t len, void *dest)
 {
-    if (!is_initialized)
+    memcpy(dest, (char *)row + offset, len);
+    for (FieldDelta *d = w ? w->fields : NULL; d; d = d->next)
     {
-        printf("Error: Database not initialized\n");
+        size_t from = d->offset > offset ? d->offset : offset;
+        size_t to = d->offset + sizeof(uint64_t) < offset + len ? d->offset + sizeof(uint64_t) : offset + len;
+        if (from < to)
+            memcpy((char *)dest + (from - offset), (char *)&d->value + (from - d->offset), to - from);
+    }
+}
+
+// Helper to find the staged contents of a word of a committed row, adding
+// an entry holding its current contents if there is none
+static FieldDelta *txn_field_word(WriteSetEntry *w, NVRAMPtr row, uint32_t offset)
+{
+    for (FieldDelta *d = w->fields; d; d = d->next)
+    {
+        if (d->offset == offset)
+            return d;
+    }
+
+    FieldDelta *d = (FieldDelta *)malloc(sizeof(FieldDelta));
+    if (!d)
+        return NULL;
+    d->offset = offset;
+    memcpy(&d->value, (char *)row + offset, sizeof(d->value));
+    d->next = w->fields;
+    w->fields = d;
+    return d;
+}
+
+// Report a lock that could not be acquired. A deadlock victim can only be
+// aborted, so that is done here.
+static void lock_failed(int txn_id, const char *what)
+{
+    if (transaction_is_victim(&g_lock_manager, txn_id))
+    {
+        printf("Error: Transaction %d aborted to break a deadlock\n", txn_id);
+        db_abort_transaction(txn_id);
+    }
+    else
+    {
+        printf("Error: Could not acquire %s lock\n", what);
+    }
+}
+
+// Give back the locks taken for an operation that failed, unless they
+// protect rows the transaction has already written
+static void release_row_locks(Table *table, int txn_id, TxnContext *ctx, int key)
+{
+    if (!txn_wrote_key(ctx, key))
+        lock_release(&g_lock_manager, txn_id, key, false);
+    lock_release(&g_lock_manager, txn_id, table->table_id, true);
+}
+
+// Get a row by its key
+NVRAMPtr db_get_row(Table *table, int txn_id, int key, size_t *size)
+{
+    if (!table || !table->is_open)
+    {
+        printf("Error: Invalid or closed table\n");
         return NULL;
     }
 
-    for (int i = 0; i < MAX_TABLES; i++)
+    // Acquire locks
+    if (!lock_acquire(&g_lock_manager, txn_id, table->table_id, true, LOCK_SHARED))
     {
-        if (tables[i] && strcmp(tables[i]->name, name) == 0)
+        lock_failed(txn_id, "table");
+        return NULL;
+    }
+
+    if (!lock_acquire(&g_lock_manager, txn_id, key, false, LOCK_SHARED))
+    {
+        lock_failed(txn_id, "row");
+        lock_release(&g_lock_manager, txn_id, table->table_id, true);
+        return NULL;
+    }
+
+    // A transaction reads its own writes
+    TxnContext *ctx = find_txn_context(txn_id);
+    NVRAMPtr data;
+    size_t data_size;
+    if (!txn_current_row(table, ctx, key, &data, &data_size))
+    {
+        // Key not found
+        release_row_locks(table, txn_id, ctx, key);
+        return NULL;
+    }
+
+    // Its field writes reach the row only at commit, so it reads a copy
+    WriteSetEntry *w = txn_find_write(ctx, table, key);
+    if (w && w->fields)
+    {
+        if (!w->view)
+            w->view = malloc(ALIGN_ROW(data_size));
+        if (!w->view)
         {
-            tables[i]->is_open = true;
-            return tables[i];
+            printf("Error: Failed to allocate row copy\n");
+            release_row_locks(table, txn_id, ctx, key);
+            return NULL;
+        }
+        txn_read_field(w, data, 0, data_size, w->view);
+        data = w->view;
+    }
+
+    // Return data pointer and size
+    if (size)
+        *size = data_size;
+
+    // No need to release locks yet since the transaction is still ongoing
+    // They will be released when the transaction commits or aborts
+    return data;
+}
+
+// Stage a write to a row (locks held). Inserts and updates copy data to a
+// new NVRAM version; a delete logs old_data, the version it removes. The
+// write is logged now and applied to the index at commit.
+static bool stage_write(Table *table, int txn_id, TxnContext *ctx, int key, int op,
+                        const void *data, size_t size, NVRAMPtr old_data, size_t old_size)
+{
+    WriteSetEntry *w = txn_find_write(ctx, table, key);
+    WriteSetEntry *fresh = NULL;
+    if (!w && (!txn_reserve_write(ctx) || !(fresh = (WriteSetEntry *)calloc(1, sizeof(WriteSetEntry)))))
+    {
+        printf("Error: Failed to allocate memory for write set\n");
+        return false;
+    }
+
+    NVRAMPtr nvram_data = NULL;
+    if (op != WAL_OP_DELETE)
+    {
+        // Allocate space in NVRAM for data
+        nvram_data = allocate_row(size);
+        if (!nvram_data)
+        {
+            printf("Error: Failed to allocate NVRAM space for data\n");
+            free(fresh);
+            return false;
+        }
+
+        // Copy data to NVRAM (flushed at the end of the transaction for small rows)
+        persist_row(txn_id, nvram_data, data, size);
+
+        // Applying the write at commit must not fail after the commit record
+        // is durable, so the entries it adds to secondary indexes are
+        // reserved now
+        if ((!w || (!w->data && !w->fields)) && !sec_index_reserve(&ctx->index_spares, table->index_count))
+        {
+            printf("Error: Failed to reserve secondary index entries\n");
+            free_row(nvram_data, size);
+            free(fresh);
+            return false;
+        }
+    }
+
+    // Add entry to WAL
+    if (!wal_add_entry(table->table_id, txn_id, key, op == WAL_OP_DELETE ? old_data : nvram_data, op,
+                       op == WAL_OP_DELETE ? old_size : size))
+    {
+        printf("Error: Failed to add WAL entry\n");
+        if (nvram_data)
+            free_row(nvram_data, size);
+        free(fresh);
+        return false;
+    }
+    txn_note_write(txn_id, table->table_id);
+
+    if (fresh)
+    {
+        fresh->table = table;
+        fresh->key = key;
+        txn_link_write(ctx, fresh);
+        w = fresh;
+    }
+    else if (w->data)
+    {
+        // An earlier version staged by this transaction is superseded
+        txn_retire(ctx, w->data, w->size);
+    }
+    else
+    {
+        // So are field writes; their records precede this one in the log
+        txn_drop_fields(w);
+    }
+
+    w->data = nvram_data;
+    w->size = nvram_data ? size : 0;
+    return true;
+}
+
+// Insert a row whose key is not in use yet
+PutStatus db_put_row(Table *table, int txn_id, int key, void *data, size_t size)
+{
+    if (!table || !table->is_open)
+    {
+        printf("Error: Invalid or closed table\n");
+        return PUT_FAILED;
+    }
+
+    // Acquire locks
+    if (!lock_acquire(&g_lock_manager, txn_id, table->table_id, true, LOCK_SHARED))
+    {
+        lock_failed(txn_id, "table");
+        return PUT_FAILED;
+    }
+
+    if (!lock_acquire(&g_lock_manager, txn_id, key, false, LOCK_EXCLUSIVE))
+    {
+        lock_failed(txn_id, "row");
+        lock_release(&g_lock_manager, txn_id, table->table_id, true);
+        return PUT_FAILED;
+    }
+
+    // The exclusive row lock keeps the key's existence stable until commit
+    TxnContext *ctx = get_txn_context(txn_id);
+    NVRAMPtr old_data;
+    size_t old_size;
+    if (ctx && txn_current_row(table, ctx, key, &old_data, &old_size))
+    {
+        // Key already exists, do not insert
+        release_row_locks(table, txn_id, ctx, key);
+        return PUT_EXISTS;
+    }
+
+    if (!ctx || !stage_write(table, txn_id, ctx, key, WAL_OP_INSERT, data, size, NULL, 0))
+    {
+        release_row_locks(table, txn_id, ctx, key);
+        return PUT_FAILED;
+    }
+
+    // No need to release locks yet since the transaction is still ongoing
+    // They will be released when the transaction commits or aborts
+    return PUT_INSERTED;
+}
+
+// Helper to acquire the locks needed to write a row
+static bool lock_row_for_write(Table *table, int txn_id, int key)
+{
+    if (!lock_acquire(&g_lock_manager, txn_id, table->table_id, true, LOCK_SHARED))
+    {
+        lock_failed(txn_id, "table");
+        return false;
+    }
+
+    if (!lock_acquire(&g_lock_manager, txn_id, key, false, LOCK_EXCLUSIVE))
+    {
+        lock_failed(txn_id, "row");
+        lock_release(&g_lock_manager, txn_id, table->table_id, true);
+        return false;
+    }
+
+    return true;
+}
+
+// Update an existing row with a copy-on-write version
+bool db_update_row(Table *table, int txn_id, int key, void *data, size_t size)
+{
+    if (!table || !table->is_open)
+    {
+        printf("Error: Invalid or closed table\n");
+        return false;
+    }
+
+    if (!lock_row_for_write(table, txn_id, key))
+        return false;
+
+    TxnContext *ctx = get_txn_context(txn_id);
+    NVRAMPtr old_data;
+    size_t old_size;
+    if (!ctx || !txn_current_row(table, ctx, key, &old_data, &old_size))
+    {
+        printf("Error: Row to update not found\n");
+        release_row_locks(table, txn_id, ctx, key);
+        return false;
+    }
+
+    // The old version stays intact until the transaction commits
+    if (!stage_write(table, txn_id, ctx, key, WAL_OP_UPDATE, data, size, NULL, 0))
+    {
+        release_row_locks(table, txn_id, ctx, key);
+        return false;
+    }
+    return true;
+}
+
+// Update a row if it exists, insert it otherwise
+bool db_upsert_row(Table *table, int txn_id, int key, void *data, size_t size)
+{
+    if (!table || !table->is_open)
+    {
+        printf("Error: Invalid or closed table\n");
+        return false;
+    }
+
+    if (!lock_row_for_write(table, txn_id, key))
+        return false;
+
+    TxnContext *ctx = get_txn_context(txn_id);
+    NVRAMPtr old_data;
+    size_t old_size;
+    bool found = ctx && txn_current_row(table, ctx, key, &old_data, &old_size);
+    if (!ctx || !stage_write(table, txn_id, ctx, key, found ? WAL_OP_UPDATE : WAL_OP_INSERT, data, size, NULL, 0))
+    {
+        release_row_locks(table, txn_id, ctx, key);
+        return false;
+    }
+    return true;
+}
+
+// Helper to change bytes of a row (locks held). Changes to the committed row
+// are logged as field records holding the new contents of the words they
+// touch, and stored into the row in place at commit. A transaction that has
+// staged a full version of the row patches that instead, which needs no
+// further logging since the version's WAL entry points at it and it is
+// durable before the commit record.
+static bool update_field_locked(Table *table, int txn_id, TxnContext *ctx, int key,
+                                size_t offset, size_t len, const void *bytes)
+{
+    NVRAMPtr row;
+    size_t row_size;
+    if (!txn_current_row(table, ctx, key, &row, &row_size))
+    {
+        printf("Error: Row to update not found\n");
+        return false;
+    }
+
+    if (len == 0 || offset > row_size || len > row_size - offset)
+    {
+        printf("Error: Field [%zu, %zu) outside row of %zu bytes\n", offset, offset + len, row_size);
+        return false;
+    }
+
+    WriteSetEntry *w = txn_find_write(ctx, table, key);
+    if (w && w->data)
+    {
+        persist_copy((char *)w->data + offset, bytes, len);
+        return true;
+    }
+
+    WriteSetEntry *fresh = NULL;
+    if (!w)
+    {
+        // Applying the write at commit must not fail after the commit record
+        // is durable, so its secondary index entries are reserved now
+        if (!sec_index_reserve(&ctx->index_spares, table->index_count))
+        {
+            printf("Error: Failed to reserve secondary index entries\n");
+            return false;
+        }
+
+        if (!txn_reserve_write(ctx) || !(fresh = w = (WriteSetEntry *)calloc(1, sizeof(WriteSetEntry))))
+        {
+            printf("Error: Failed to allocate memory for write set\n");
+            return false;
+        }
+        w->table = table;
+        w->key = key;
+    }
+
+    // Log the new contents of the touched words, a few words per record.
+    // Their staged entries exist before a record is logged, so the write set
+    // never falls behind the log.
+    size_t first = offset & ~(sizeof(uint64_t) - 1);
+    size_t end = ALIGN_ROW(offset + len);
+    while (first < end)
+    {
+        FieldDelta *deltas[WAL_FIELD_MAX_WORDS];
+        uint64_t words[WAL_FIELD_MAX_WORDS];
+        int count = 0;
+        for (; count < WAL_FIELD_MAX_WORDS && first + count * sizeof(uint64_t) < end; count++)
+        {
+            size_t at = first + count * sizeof(uint64_t);
+            deltas[count] = txn_field_word(w, row, at);
+            if (!deltas[count])
+                break;
+
+            // Lay the bytes that fall in this word over its current contents
+            size_t from = at > offset ? at : offset;
+            size_t to = at + sizeof(uint64_t) < offset + len ? at + sizeof(uint64_t) : offset + len;
+            words[count] = deltas[count]->value;
+            memcpy((char *)&words[count] + (from - at), (const char *)bytes + (from - offset), to - from);
+        }
+
+        if (count == 0 || !wal_add_field_entry(table->table_id, txn_id, key, first, words, count))
+        {
+            printf("Error: Failed to log field update\n");
+            if (fresh)
+            {
+                txn_drop_fields(fresh);
+                free(fresh);
+            }
+            return false;
+        }
+        txn_note_write(txn_id, table->table_id);
+
+        if (fresh)
+        {
+            txn_link_write(ctx, fresh);
+            fresh = NULL;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            deltas[i]->value = words[i];
         }
+        first += count * sizeof(uint64_t);
     }
-
-    printf("Error: Table '%s' not found\n", name);
-    return NULL;
+    return true;
 }
 
-// Close a table
-void db_close_table(Table *table)
+// Overwrite len bytes of a row at offset
+bool db_update_field(Table *table, int txn_id, int key, size_t offset, size_t len, const void *bytes)
 {
-    if (table)
+    if (!table || !table->is_open)
     {
-        table->is_open = false;
-        printf("Table '%s' closed\n", table->name);
+        printf("Error: Invalid or closed table\n");
+        return false;
+    }
+
+    if (!lock_row_for_write(table, txn_id, key))
+        return false;
+
+    TxnContext *ctx = get_txn_context(txn_id);
+    if (!ctx || !update_field_locked(table, txn_id, ctx, key, offset, len, bytes))
+    {
+        release_row_locks(table, txn_id, ctx, key);
+        return false;
     }
+
+    // Locks stay held until the transaction ends, as for other writes
+    return true;
 }
 
-// Get a row by its key
-NVRAMPtr db_get_row(Table *table, int txn_id, int key, size_t *size)
+// Add delta to the 64-bit integer at offset of a row
+bool db_incr(Table *table, int txn_id, int key, size_t offset, int64_t delta, int64_t *new_value)
 {
     if (!table || !table->is_open)
     {
         printf("Error: Invalid or closed table\n");
-        return NULL;
+        return false;
     }
 
-    // Acquire locks
-    if (!lock_acquire(&g_lock_manager, txn_id, table->table_id, true, LOCK_SHARED))
-    {
-        printf("Error: Could not acquire table lock\n");
-        return NULL;
-    }
+    if (!lock_row_for_write(table, txn_id, key))
+        return false;
 
-    if (!lock_acquire(&g_lock_manager, txn_id, key, false, LOCK_SHARED))
+    // The exclusive row lock keeps the value stable between read and write
+    TxnContext *ctx = get_txn_context(txn_id);
+    NVRAMPtr row = NULL;
+    size_t size = 0;
+    if (!ctx || !txn_current_row(table, ctx, key, &row, &size) ||
+        offset > size || sizeof(int64_t) > size - offset)
     {
-        printf("Error: Could not acquire row lock\n");
-        lock_release(&g_lock_manager, txn_id, table->table_id, true);
-        return NULL;
+        printf("Error: Counter at offset %zu not found in row %d\n", offset, key);
+        release_row_locks(table, txn_id, ctx, key);
+        return false;
     }
 
-    // Find leaf node containing key
-    BPTreeNode *leaf = find_leaf(table->index, key);
-    if (!leaf)
-    {
-        lock_release(&g_lock_manager, txn_id, key, false);
-        lock_release(&g_lock_manager, txn_id, table->table_id, true);
-        return NULL;
-    }
+    int64_t value;
+    txn_read_field(txn_find_write(ctx, table, key), row, offset, sizeof(value), &value);
+    value += delta;
 
-    // Find key in leaf
-    int pos = find_key_in_leaf(leaf, key);
-    if (pos == -1)
+    if (!update_field_locked(table, txn_id, ctx, key, offset, sizeof(value), &value))
     {
-        // Key not found
-        lock_release(&g_lock_manager, txn_id, key, false);
-        lock_release(&g_lock_manager, txn_id, table->table_id, true);
-        return NULL;
+        release_row_locks(table, txn_id, ctx, key);
+        return false;
     }
 
-    // Return data pointer and size
-    if (size)
-        *size = leaf->data_sizes[pos];
-
-    // No need to release locks yet since the transaction is still ongoing
-    // They will be released when the transaction commits or aborts
-    return leaf->data_ptrs[pos];
+    if (new_value)
+        *new_value = value;
+    return true;
 }
 
-// Insert or update a row
-bool db_put_row(Table *table, int txn_id, int key, void *data, size_t size)
+// Delete a row
+bool db_delete_row(Table *table, int txn_id, int key)
 {
     if (!table || !table->is_open)
     {
@@ -850,285 +3454,420 @@ bool db_put_row(Table *table, int txn_id, int key, void *data, size_t size)
     // Acquire locks
     if (!lock_acquire(&g_lock_manager, txn_id, table->table_id, true, LOCK_SHARED))
     {
-        printf("Error: Could not acquire table lock\n");
+        lock_failed(txn_id, "table");
         return false;
     }
 
     if (!lock_acquire(&g_lock_manager, txn_id, key, false, LOCK_EXCLUSIVE))
     {
-        printf("Error: Could not acquire row lock\n");
+        lock_failed(txn_id, "row");
         lock_release(&g_lock_manager, txn_id, table->table_id, true);
         return false;
     }
 
-    BPTreeNode *leaf = find_leaf(table->index, key);
-    if (leaf)
+    // Find the data and its size before deleting
+    TxnContext *ctx = get_txn_context(txn_id);
+    NVRAMPtr data_ptr;
+    size_t data_size;
+    if (!ctx || !txn_current_row(table, ctx, key, &data_ptr, &data_size))
     {
-        // Check if key already exists
-        int pos = find_key_in_leaf(leaf, key);
-        if (pos != -1)
-        {
-            // Key already exists, do not insert
-            lock_release(&g_lock_manager, txn_id, key, false);
-            lock_release(&g_lock_manager, txn_id, table->table_id, true);
-            return 1; // Row already exists
-        }
+        printf("Error: Row to delete not found\n");
+        release_row_locks(table, txn_id, ctx, key);
+        return false;
     }
 
-    // CHANGED: Create WAL entry BEFORE allocating NVRAM memory
-    // Add WAL entry for the insertion
-    void *wal_entry_ptr = allocate_memory(sizeof(WALEntry));
-    if (!wal_entry_ptr)
+    // The row leaves the index when the transaction commits
+    if (!stage_write(table, txn_id, ctx, key, WAL_OP_DELETE, NULL, 0, data_ptr, data_size))
     {
-        printf("Error: Failed to allocate NVRAM for WAL entry\n");
-        lock_release(&g_lock_manager, txn_id, key, false);
-        lock_release(&g_lock_manager, txn_id, table->table_id, true);
+        release_row_locks(table, txn_id, ctx, key);
         return false;
     }
 
-    // Allocate space in NVRAM for data
-    NVRAMPtr nvram_data = allocate_memory(size);
-    if (!nvram_data)
+    // No need to release locks yet since the transaction is still ongoing
+    // They will be released when the transaction commits or aborts
+    return true;
+}
+
+// Helper to move a leaf position forward, skipping past the end of a leaf
+static bool normalize_forward(BPTreeNode **leaf, int *pos)
+{
+    while (*leaf && *pos >= (*leaf)->num_keys)
     {
-        printf("Error: Failed to allocate NVRAM space for data\n");
-        free_memory(wal_entry_ptr, sizeof(WALEntry));
-        lock_release(&g_lock_manager, txn_id, key, false);
-        lock_release(&g_lock_manager, txn_id, table->table_id, true);
-        return false;
+        *leaf = (*leaf)->next_leaf;
+        *pos = 0;
     }
+    return *leaf != NULL;
+}
 
-    // Copy data to NVRAM
-    memcpy(nvram_data, data, size);
+// Helper to move a leaf position backward, skipping past the start of a leaf
+static bool normalize_backward(BPTreeNode **leaf, int *pos)
+{
+    while (*leaf && *pos < 0)
+    {
+        *leaf = (*leaf)->prev_leaf;
+        if (*leaf)
+            *pos = (*leaf)->num_keys - 1;
+    }
+    return *leaf != NULL;
+}
 
-    // Flush the data to NVRAM
-    flush_range(nvram_data, size);
+// Find the leaf position nearest to key according to mode.
+// The key itself does not need to be present in the tree.
+static bool seek_position(BPTree *tree, int key, SeekMode mode, BPTreeNode **leaf, int *pos)
+{
+    *leaf = find_leaf(tree, key);
+    if (!*leaf)
+        return false;
 
-    // Add entry to WAL (1 for insertion)
-    if (!wal_add_entry(table->table_id, key, nvram_data, 1, wal_entry_ptr, size))
+    // GT and LE both start from the first key strictly greater than key
+    bool strict = (mode == SEEK_KEY_GT || mode == SEEK_KEY_LE);
+    int i = 0;
+    while (i < (*leaf)->num_keys &&
+           (strict ? (*leaf)->keys[i] <= key : (*leaf)->keys[i] < key))
     {
-        printf("Error: Failed to add WAL entry\n");
-        free_memory(wal_entry_ptr, sizeof(WALEntry));
-        free_memory(nvram_data, size);
-        lock_release(&g_lock_manager, txn_id, key, false);
-        lock_release(&g_lock_manager, txn_id, table->table_id, true);
-        return false;
+        i++;
     }
+    *pos = i;
 
-    // Handle empty tree case
-    if (table->index->root == NULL)
+    if (mode == SEEK_KEY_GE || mode == SEEK_KEY_GT)
     {
-        table->index->root = create_node(true);
-        if (!table->index->root)
-        {
-            printf("Error: Failed to create root node\n");
-            free_memory(nvram_data, size);
-            lock_release(&g_lock_manager, txn_id, key, false);
-            lock_release(&g_lock_manager, txn_id, table->table_id, true);
-            return false;
-        }
+        return normalize_forward(leaf, pos);
+    }
 
-        table->index->root->keys[0] = key;
-        table->index->root->data_ptrs[0] = nvram_data;
-        table->index->root->data_sizes[0] = size;
-        table->index->root->num_keys = 1;
-        table->index->record_count++;
+    // LE and LT step back one slot from there
+    (*pos)--;
+    return normalize_backward(leaf, pos);
+}
 
-        // No need to release locks yet since the transaction is still ongoing
-        // They will be released when the transaction commits or aborts
-        return true;
+// Helper to store a position in a cursor
+static bool cursor_set(RowCursor *cursor, BPTreeNode *leaf, int pos, bool found)
+{
+    if (!found)
+    {
+        cursor->leaf = NULL;
+        cursor->pos = -1;
+        cursor->key = -1;
+        return false;
     }
 
-    // Recursive insertion
-    int up_key;
-    BPTreeNode *new_node = NULL;
+    cursor->leaf = leaf;
+    cursor->pos = pos;
+    cursor->key = leaf->keys[pos];
+    cursor->mod_count = cursor->table->index->mod_count;
+    return true;
+}
+
+// Position a cursor at the key nearest to key according to mode
+bool db_cursor_seek(RowCursor *cursor, Table *table, int key, SeekMode mode)
+{
+    cursor->table = table;
+    cursor->leaf = NULL;
 
-    if (!insert_recursive(table->index, table->index->root, key, nvram_data, size, &up_key, &new_node))
+    if (!table || !table->is_open)
     {
-        printf("Error: Failed to insert key\n");
-        free_memory(nvram_data, size);
-        lock_release(&g_lock_manager, txn_id, key, false);
-        lock_release(&g_lock_manager, txn_id, table->table_id, true);
+        printf("Error: Invalid or closed table\n");
         return false;
     }
 
-    // Root split case
-    if (new_node != NULL)
-    {
-        // Create new root
-        BPTreeNode *new_root = create_node(false);
-        if (!new_root)
-        {
-            printf("Error: Failed to create new root\n");
-            free_node(new_node);
-            lock_release(&g_lock_manager, txn_id, key, false);
-            lock_release(&g_lock_manager, txn_id, table->table_id, true);
-            return false;
-        }
+    BPTreeNode *leaf = NULL;
+    int pos = -1;
+    pthread_rwlock_rdlock(&table->index->latch);
+    bool found = seek_position(table->index, key, mode, &leaf, &pos);
+    found = cursor_set(cursor, leaf, pos, found);
+    pthread_rwlock_unlock(&table->index->latch);
+    return found;
+}
 
-        // Set up new root
-        new_root->keys[0] = up_key;
-        new_root->children[0] = table->index->root;
-        new_root->children[1] = new_node;
-        new_root->num_keys = 1;
+// Position a cursor at the smallest key of a table
+bool db_cursor_first(RowCursor *cursor, Table *table)
+{
+    cursor->table = table;
+    cursor->leaf = NULL;
 
-        // Update tree
-        table->index->root = new_root;
-        table->index->height++;
-        table->index->node_count++;
+    if (!table || !table->is_open)
+    {
+        printf("Error: Invalid or closed table\n");
+        return false;
     }
 
-    // Update record count
-    table->index->record_count++;
+    pthread_rwlock_rdlock(&table->index->latch);
+    BPTreeNode *node = table->index->root;
 
-    // No need to release locks yet since the transaction is still ongoing
-    // They will be released when the transaction commits or aborts
-    return true;
+    // Navigate to leftmost leaf
+    while (!node->is_leaf)
+    {
+        node = node->children[0];
+    }
+
+    int pos = 0;
+    bool found = normalize_forward(&node, &pos);
+    found = cursor_set(cursor, node, pos, found);
+    pthread_rwlock_unlock(&table->index->latch);
+    return found;
 }
 
-// Delete a row
-bool db_delete_row(Table *table, int txn_id, int key)
+// Position a cursor at the largest key of a table
+bool db_cursor_last(RowCursor *cursor, Table *table)
 {
+    cursor->table = table;
+    cursor->leaf = NULL;
+
     if (!table || !table->is_open)
     {
         printf("Error: Invalid or closed table\n");
         return false;
     }
 
-    // Acquire locks
-    if (!lock_acquire(&g_lock_manager, txn_id, table->table_id, true, LOCK_SHARED))
+    pthread_rwlock_rdlock(&table->index->latch);
+    BPTreeNode *node = table->index->root;
+
+    // Navigate to rightmost leaf
+    while (!node->is_leaf)
     {
-        printf("Error: Could not acquire table lock\n");
-        return false;
+        node = node->children[node->num_keys];
     }
 
-    if (!lock_acquire(&g_lock_manager, txn_id, key, false, LOCK_EXCLUSIVE))
+    int pos = node->num_keys - 1;
+    bool found = normalize_backward(&node, &pos);
+    found = cursor_set(cursor, node, pos, found);
+    pthread_rwlock_unlock(&table->index->latch);
+    return found;
+}
+
+// Position a cursor at the row with the given 0-based rank in key order.
+// Subtree counts let this skip whole subtrees in one root-to-leaf descent.
+bool db_seek_rank(RowCursor *cursor, Table *table, int rank)
+{
+    cursor->table = table;
+    cursor->leaf = NULL;
+
+    if (!table || !table->is_open)
     {
-        printf("Error: Could not acquire row lock\n");
-        lock_release(&g_lock_manager, txn_id, table->table_id, true);
+        printf("Error: Invalid or closed table\n");
         return false;
     }
 
-    // Find the data and its size before deleting
-    size_t data_size = 0;
-    void *data_ptr = NULL;
+    pthread_rwlock_rdlock(&table->index->latch);
+    BPTreeNode *node = table->index->root;
+    bool found = rank >= 0 && rank < subtree_count(node);
 
-    // Find leaf node containing key
-    BPTreeNode *leaf = find_leaf(table->index, key);
-    if (leaf)
+    while (found && !node->is_leaf)
     {
-        // Find key in leaf
-        int pos = find_key_in_leaf(leaf, key);
-        if (pos != -1)
+        int i;
+        for (i = 0; i < node->num_keys; i++)
         {
-            data_ptr = leaf->data_ptrs[pos];
-            data_size = leaf->data_sizes[pos];
+            int count = subtree_count(node->children[i]);
+            if (rank < count)
+                break;
+            rank -= count;
         }
+        node = node->children[i];
     }
 
-    if (!data_ptr)
+    found = cursor_set(cursor, node, rank, found);
+    pthread_rwlock_unlock(&table->index->latch);
+    return found;
+}
+
+// Helper to count the rows with a key below bound (or equal to it if
+// inclusive), adding up whole subtrees to the left of the search path
+static int count_below(BPTree *tree, int bound, bool inclusive)
+{
+    int count = 0;
+    BPTreeNode *node = tree->root;
+    while (!node->is_leaf)
     {
-        printf("Error: Row to delete not found\n");
-        lock_release(&g_lock_manager, txn_id, key, false);
-        lock_release(&g_lock_manager, txn_id, table->table_id, true);
-        return false;
+        int i;
+        for (i = 0; i < node->num_keys; i++)
+        {
+            if (bound < node->keys[i])
+                break;
+            count += subtree_count(node->children[i]);
+        }
+        node = node->children[i];
     }
 
-    // CHANGED: Add WAL entry for deletion before actually deleting data
-    void *wal_entry_ptr = allocate_memory(sizeof(WALEntry));
-    if (!wal_entry_ptr)
+    for (int i = 0; i < node->num_keys; i++)
     {
-        printf("Error: Failed to allocate NVRAM for WAL entry\n");
-        lock_release(&g_lock_manager, txn_id, key, false);
-        lock_release(&g_lock_manager, txn_id, table->table_id, true);
-        return false;
+        if (node->keys[i] > bound || (node->keys[i] == bound && !inclusive))
+            break;
+        count++;
     }
+    return count;
+}
 
-    // Add entry to WAL (0 for deletion)
-    if (!wal_add_entry(table->table_id, key, data_ptr, 0, wal_entry_ptr, data_size))
+// Count the rows with lo <= key <= hi (-1 on error)
+int db_count_range(Table *table, int lo, int hi)
+{
+    if (!table || !table->is_open)
     {
-        printf("Error: Failed to add WAL entry\n");
-        free_memory(wal_entry_ptr, sizeof(WALEntry));
-        lock_release(&g_lock_manager, txn_id, key, false);
-        lock_release(&g_lock_manager, txn_id, table->table_id, true);
-        return false;
+        printf("Error: Invalid or closed table\n");
+        return -1;
     }
 
-    // Handle empty tree case
-    if (table->index->root == NULL)
-    {
-        lock_release(&g_lock_manager, txn_id, key, false);
-        lock_release(&g_lock_manager, txn_id, table->table_id, true);
+    if (lo > hi)
+        return 0;
+
+    pthread_rwlock_rdlock(&table->index->latch);
+    int count = count_below(table->index, hi, true) - count_below(table->index, lo, false);
+    pthread_rwlock_unlock(&table->index->latch);
+    return count;
+}
+
+// Advance a cursor to the next key in ascending order
+bool db_cursor_next(RowCursor *cursor)
+{
+    if (!cursor->leaf)
         return false;
-    }
 
-    // Recursive deletion
-    bool result = remove_recursive(table->index, table->index->root, key, NULL, 0);
+    BPTree *tree = cursor->table->index;
+    pthread_rwlock_rdlock(&tree->latch);
 
-    if (result)
+    // The tree changed under us: re-seek from the last key we returned
+    if (cursor->mod_count != tree->mod_count)
     {
-        // Update record count
-        table->index->record_count--;
+        pthread_rwlock_unlock(&tree->latch);
+        return db_cursor_seek(cursor, cursor->table, cursor->key, SEEK_KEY_GT);
     }
 
-    // No need to release locks yet since the transaction is still ongoing
-    // They will be released when the transaction commits or aborts
-    return result;
+    BPTreeNode *leaf = cursor->leaf;
+    int pos = cursor->pos + 1;
+    bool found = normalize_forward(&leaf, &pos);
+    found = cursor_set(cursor, leaf, pos, found);
+    pthread_rwlock_unlock(&tree->latch);
+    return found;
 }
-// Get the next row for iteration
-int db_get_next_row(Table *table, int current_key)
+
+// Move a cursor to the previous key in descending order
+bool db_cursor_prev(RowCursor *cursor)
 {
-    if (!table || !table->is_open)
+    if (!cursor->leaf)
+        return false;
+
+    BPTree *tree = cursor->table->index;
+    pthread_rwlock_rdlock(&tree->latch);
+
+    // The tree changed under us: re-seek from the last key we returned
+    if (cursor->mod_count != tree->mod_count)
     {
-        printf("Error: Invalid or closed table\n");
-        return -1;
+        pthread_rwlock_unlock(&tree->latch);
+        return db_cursor_seek(cursor, cursor->table, cursor->key, SEEK_KEY_LT);
     }
 
-    // Special case: if current_key is -1, return the first key
-    if (current_key == -1)
-    {
-        BPTreeNode *node = table->index->root;
+    BPTreeNode *leaf = cursor->leaf;
+    int pos = cursor->pos - 1;
+    bool found = normalize_backward(&leaf, &pos);
+    found = cursor_set(cursor, leaf, pos, found);
+    pthread_rwlock_unlock(&tree->latch);
+    return found;
+}
 
-        // Navigate to leftmost leaf
-        while (!node->is_leaf)
-        {
-            node = node->children[0];
-        }
+// Get the data of the row under a cursor (no row lock is taken)
+NVRAMPtr db_cursor_data(const RowCursor *cursor, size_t *size)
+{
+    if (!cursor->leaf)
+        return NULL;
 
-        if (node->num_keys > 0)
-        {
-            return node->keys[0];
-        }
-        else
-        {
-            return -1; // Empty tree
-        }
+    BPTree *tree = cursor->table->index;
+    NVRAMPtr data = NULL;
+    pthread_rwlock_rdlock(&tree->latch);
+    if (cursor->mod_count == tree->mod_count)
+    {
+        if (size)
+            *size = slot_size(cursor->leaf->slots[cursor->pos]);
+        data = slot_ptr(cursor->leaf->slots[cursor->pos]);
     }
+    pthread_rwlock_unlock(&tree->latch);
+    return data;
+}
 
-    // Find leaf containing current key
-    BPTreeNode *leaf = find_leaf(table->index, current_key);
-    if (!leaf)
-        return -1;
-
-    // Find position of current key
-    int pos = find_key_in_leaf(leaf, current_key);
-    if (pos == -1)
+// Get the next row for iteration.
+// current_key does not need to exist; -1 returns the first key.
+int db_get_next_row(Table *table, int current_key)
+{
+    RowCursor cursor;
+    if (current_key == -1)
     {
-        // Current key not found
-        return -1;
+        db_cursor_first(&cursor, table);
     }
+    else
+    {
+        db_cursor_seek(&cursor, table, current_key, SEEK_KEY_GT);
+    }
+    return cursor.leaf ? cursor.key : -1;
+}
 
-    // Check if there's a next key in the same leaf
-    if (pos + 1 < leaf->num_keys)
+// Get the previous row for reverse iteration.
+// current_key does not need to exist; -1 returns the last key.
+int db_get_prev_row(Table *table, int current_key)
+{
+    RowCursor cursor;
+    if (current_key == -1)
+    {
+        db_cursor_last(&cursor, table);
+    }
+    else
     {
-        return leaf->keys[pos + 1];
+        db_cursor_seek(&cursor, table, current_key, SEEK_KEY_LT);
     }
+    return cursor.leaf ? cursor.key : -1;
+}
+
+// Add every table and committed row to a replication snapshot. Rows are
+// copied one at a time under the tree latch, so a version cannot be retired
+// and freed while it is copied, and commits are not held up for long.
+void db_replication_snapshot(ReplBatch *batch)
+{
+    char *copy = NULL;
+    size_t capacity = 0;
+    bool ok = true;
 
-    // Otherwise, move to next leaf
-    if (leaf->next_leaf && leaf->next_leaf->num_keys > 0)
+    for (int i = 0; i < MAX_TABLES && ok; i++)
     {
-        return leaf->next_leaf->keys[0];
+        Table *table = tables[i];
+        if (!table)
+            continue;
+
+        ok = repl_batch_add(batch, REPL_OP_TABLE, table->table_id, 0, table->name, strlen(table->name) + 1);
+
+        BPTree *tree = table->index;
+        int key = INT_MIN;
+        SeekMode mode = SEEK_KEY_GE;
+        while (ok)
+        {
+            BPTreeNode *leaf;
+            int pos;
+            size_t size = 0;
+            pthread_rwlock_rdlock(&tree->latch);
+            bool found = seek_position(tree, key, mode, &leaf, &pos);
+            if (found)
+            {
+                key = leaf->keys[pos];
+                size = slot_size(leaf->slots[pos]);
+                if (size > capacity)
+                {
+                    char *grown = (char *)realloc(copy, size);
+                    if (grown)
+                    {
+                        copy = grown;
+                        capacity = size;
+                    }
+                }
+                if (size <= capacity)
+                    memcpy(copy, slot_ptr(leaf->slots[pos]), size);
+                else
+                    ok = false;
+            }
+            pthread_rwlock_unlock(&tree->latch);
+
+            if (!found || !ok)
+                break;
+            ok = repl_batch_add(batch, REPL_OP_PUT, table->table_id, key, copy, size);
+            mode = SEEK_KEY_GT;
+        }
     }
 
-    // No more keys
-    return -1;
-}
\ No newline at end of file
+    if (!ok)
+        printf("Error: Failed to send replication snapshot\n");
+    free(copy);
+}
@@ -0,0 +1,651 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "../include/replication.h"
+#include "../include/ram_bptree.h"
+#include "../include/wal.h"
+
+#define APPLY_RETRY_US 1000 // Wait before retrying a commit that could not get its locks
+
+// Published commit, kept until every follower has sent it
+typedef struct ReplMessage
+{
+    uint64_t seq;
+    size_t size; // Bytes of header and records
+    struct ReplMessage *next;
+    char bytes[]; // ReplHeader, then records
+} ReplMessage;
+
+struct ReplBatch
+{
+    int socket;       // Snapshot batches are sent whenever they fill (-1 for commits)
+    bool failed;
+    ReplMessage *msg; // Message being filled
+    size_t capacity;  // Bytes allocated for msg->bytes
+};
+
+// Connection to a follower
+typedef struct Follower
+{
+    bool in_use;
+    bool active;           // Published commits are queued for it
+    bool dropped;          // Fell too far behind; its connection is being closed
+    int socket;
+    uint64_t next_seq;     // Next commit to send
+    ReplMessage *next_msg; // Message with next_seq (NULL until published)
+} Follower;
+
+// Leader state
+static pthread_mutex_t repl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t repl_cond = PTHREAD_COND_INITIALIZER;
+static Follower followers[REPL_MAX_FOLLOWERS];
+static int follower_count = 0; // Active followers
+static ReplMessage *queue_head = NULL, *queue_tail = NULL;
+static uint64_t next_seq = 1;  // Position of the next published commit
+static ReplSnapshotFn snapshot_fn = NULL;
+static int listen_socket = -1;
+
+// Follower state
+static bool following = false;
+static char leader_host[256];
+static int leader_port;
+static uint64_t applied_seq = 0;    // Next commit to apply
+static uint64_t known_seq = 0;      // Next commit of the leader, as last heard
+static uint64_t apply_delay_us = 0; // Age of the last applied commit when it was applied
+static Table *leader_tables[MAX_TABLES]; // Local table of each leader table ID
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool send_all(int socket, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = send(socket, p, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool recv_all(int socket, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = recv(socket, p, len, 0);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Start a batch whose message has the given type
+static ReplBatch *batch_create(int type, int socket)
+{
+    ReplBatch *batch = (ReplBatch *)malloc(sizeof(ReplBatch));
+    size_t capacity = 4096;
+    ReplMessage *msg = (ReplMessage *)malloc(sizeof(ReplMessage) + capacity);
+    if (!batch || !msg)
+    {
+        free(batch);
+        free(msg);
+        return NULL;
+    }
+
+    msg->size = sizeof(ReplHeader);
+    msg->next = NULL;
+    ReplHeader *header = (ReplHeader *)msg->bytes;
+    memset(header, 0, sizeof(ReplHeader));
+    header->type = type;
+
+    batch->socket = socket;
+    batch->failed = false;
+    batch->msg = msg;
+    batch->capacity = capacity;
+    return batch;
+}
+
+static void batch_free(ReplBatch *batch)
+{
+    free(batch->msg);
+    free(batch);
+}
+
+// Send a snapshot batch's records and start over with an empty message
+static bool batch_send(ReplBatch *batch)
+{
+    ReplHeader *header = (ReplHeader *)batch->msg->bytes;
+    header->length = (uint32_t)(batch->msg->size - sizeof(ReplHeader));
+    header->time_us = now_us();
+    if (!send_all(batch->socket, batch->msg->bytes, batch->msg->size))
+        batch->failed = true;
+    batch->msg->size = sizeof(ReplHeader);
+    return !batch->failed;
+}
+
+ReplBatch *repl_batch_begin()
+{
+    // Nothing is collected while no follower listens
+    if (__atomic_load_n(&follower_count, __ATOMIC_ACQUIRE) == 0)
+        return NULL;
+    return batch_create(REPL_MSG_COMMIT, -1);
+}
+
+bool repl_batch_add(ReplBatch *batch, int op, int table_id, int key, const void *data, size_t size)
+{
+    if (!batch || batch->failed)
+        return false;
+
+    size_t needed = batch->msg->size + sizeof(ReplRecord) + size;
+    if (needed > UINT32_MAX)
+    {
+        batch->failed = true;
+        return false;
+    }
+    if (needed > batch->capacity)
+    {
+        size_t capacity = batch->capacity * 2;
+        while (capacity < needed)
+            capacity *= 2;
+        ReplMessage *grown = (ReplMessage *)realloc(batch->msg, sizeof(ReplMessage) + capacity);
+        if (!grown)
+        {
+            batch->failed = true;
+            return false;
+        }
+        batch->msg = grown;
+        batch->capacity = capacity;
+    }
+
+    ReplRecord record = {(uint32_t)op, table_id, key, (uint32_t)size};
+    memcpy(batch->msg->bytes + batch->msg->size, &record, sizeof(record));
+    if (size > 0)
+        memcpy(batch->msg->bytes + batch->msg->size + sizeof(record), data, size);
+    batch->msg->size = needed;
+
+    if (batch->socket >= 0 && batch->msg->size >= REPL_BATCH_BYTES)
+        return batch_send(batch);
+    return true;
+}
+
+// Free the messages every follower has sent (mutex held)
+static void trim_queue()
+{
+    uint64_t oldest = next_seq;
+    for (int i = 0; i < REPL_MAX_FOLLOWERS; i++)
+    {
+        if (followers[i].active && followers[i].next_seq < oldest)
+            oldest = followers[i].next_seq;
+    }
+
+    while (queue_head && queue_head->seq < oldest)
+    {
+        ReplMessage *msg = queue_head;
+        queue_head = msg->next;
+        free(msg);
+    }
+    if (!queue_head)
+        queue_tail = NULL;
+}
+
+void repl_batch_publish(ReplBatch *batch)
+{
+    if (!batch)
+        return;
+
+    // A follower missing a commit would diverge, so it must start over
+    bool failed = batch->failed;
+    if (failed)
+        printf("Error: Failed to collect a commit for replication; dropping followers\n");
+
+    ReplMessage *msg = batch->msg;
+    free(batch);
+    ReplHeader *header = (ReplHeader *)msg->bytes;
+    header->length = (uint32_t)(msg->size - sizeof(ReplHeader));
+    header->time_us = now_us();
+
+    pthread_mutex_lock(&repl_mutex);
+    msg->seq = next_seq++;
+    header->seq = msg->seq;
+    for (int i = 0; i < REPL_MAX_FOLLOWERS; i++)
+    {
+        Follower *f = &followers[i];
+        if (!f->active || f->dropped)
+            continue;
+
+        // A follower that cannot keep up reconnects and takes a new snapshot
+        if (failed || msg->seq - f->next_seq >= REPL_MAX_BACKLOG)
+        {
+            f->dropped = true;
+            shutdown(f->socket, SHUT_RDWR);
+        }
+        else if (!f->next_msg && f->next_seq == msg->seq)
+        {
+            f->next_msg = msg;
+        }
+    }
+
+    if (follower_count > 0 && !failed)
+    {
+        if (queue_tail)
+            queue_tail->next = msg;
+        else
+            queue_head = msg;
+        queue_tail = msg;
+    }
+    else
+    {
+        free(msg);
+    }
+    pthread_cond_broadcast(&repl_cond);
+    pthread_mutex_unlock(&repl_mutex);
+}
+
+int repl_follower_count()
+{
+    pthread_mutex_lock(&repl_mutex);
+    int count = follower_count;
+    pthread_mutex_unlock(&repl_mutex);
+    return count;
+}
+
+// Send a message with no records
+static bool send_marker(int socket, int type, uint64_t seq)
+{
+    ReplHeader header = {(uint32_t)type, 0, seq, now_us()};
+    return send_all(socket, &header, sizeof(header));
+}
+
+// Ship a snapshot and then the commit stream to one follower
+static void *follower_main(void *arg)
+{
+    Follower *f = (Follower *)arg;
+
+    // Commits published from here on are queued for this follower, so
+    // anything the snapshot misses arrives afterwards
+    pthread_mutex_lock(&repl_mutex);
+    f->next_seq = next_seq;
+    f->next_msg = NULL;
+    f->active = true;
+    follower_count++;
+    uint64_t start_seq = f->next_seq;
+    pthread_mutex_unlock(&repl_mutex);
+
+    bool ok = false;
+    ReplBatch *snapshot = batch_create(REPL_MSG_SNAPSHOT, f->socket);
+    if (snapshot)
+    {
+        snapshot_fn(snapshot);
+        ok = !snapshot->failed && (snapshot->msg->size == sizeof(ReplHeader) || batch_send(snapshot)) &&
+             send_marker(f->socket, REPL_MSG_SNAPSHOT_END, start_seq);
+        batch_free(snapshot);
+    }
+
+    while (ok)
+    {
+        pthread_mutex_lock(&repl_mutex);
+        if (!f->next_msg && !f->dropped)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += REPL_HEARTBEAT_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&repl_cond, &repl_mutex, &deadline);
+        }
+        ReplMessage *msg = f->dropped ? NULL : f->next_msg;
+        uint64_t heartbeat_seq = next_seq;
+        bool dropped = f->dropped;
+        pthread_mutex_unlock(&repl_mutex);
+
+        if (dropped)
+            break;
+        if (!msg)
+        {
+            ok = send_marker(f->socket, REPL_MSG_HEARTBEAT, heartbeat_seq);
+            continue;
+        }
+
+        // The message stays queued until this follower moves past it
+        ok = send_all(f->socket, msg->bytes, msg->size);
+
+        pthread_mutex_lock(&repl_mutex);
+        f->next_seq = msg->seq + 1;
+        f->next_msg = msg->next;
+        trim_queue();
+        pthread_mutex_unlock(&repl_mutex);
+    }
+
+    pthread_mutex_lock(&repl_mutex);
+    f->active = false;
+    f->in_use = false;
+    follower_count--;
+    trim_queue();
+    pthread_mutex_unlock(&repl_mutex);
+
+    close(f->socket);
+    printf("Replication follower disconnected\n");
+    return NULL;
+}
+
+// Accept followers until the listening socket is closed
+static void *listener_main(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        int socket = accept(listen_socket, NULL, NULL);
+        if (socket < 0)
+            break;
+
+        pthread_mutex_lock(&repl_mutex);
+        Follower *f = NULL;
+        for (int i = 0; i < REPL_MAX_FOLLOWERS && !f; i++)
+        {
+            if (!followers[i].in_use)
+                f = &followers[i];
+        }
+        if (f)
+        {
+            memset(f, 0, sizeof(Follower));
+            f->in_use = true;
+            f->socket = socket;
+        }
+        pthread_mutex_unlock(&repl_mutex);
+
+        pthread_t thread;
+        if (!f)
+        {
+            printf("Warning: Too many replication followers\n");
+            close(socket);
+        }
+        else if (pthread_create(&thread, NULL, follower_main, f) != 0)
+        {
+            printf("Error: Failed to start replication sender\n");
+            pthread_mutex_lock(&repl_mutex);
+            f->in_use = false;
+            pthread_mutex_unlock(&repl_mutex);
+            close(socket);
+        }
+        else
+        {
+            printf("Replication follower connected\n");
+            pthread_detach(thread);
+        }
+    }
+    return NULL;
+}
+
+bool repl_start_leader(int port, ReplSnapshotFn snapshot)
+{
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket < 0)
+    {
+        perror("socket");
+        return false;
+    }
+
+    int reuse = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(listen_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_socket, REPL_MAX_FOLLOWERS) < 0)
+    {
+        perror("replication listen");
+        close(listen_socket);
+        listen_socket = -1;
+        return false;
+    }
+
+    snapshot_fn = snapshot;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, listener_main, NULL) != 0)
+    {
+        printf("Error: Failed to start replication listener\n");
+        close(listen_socket);
+        listen_socket = -1;
+        return false;
+    }
+    pthread_detach(thread);
+
+    printf("Shipping WAL to followers on port %d\n", port);
+    return true;
+}
+
+// Map a leader table to a local one, creating it if needed
+static Table *map_table(int table_id, const char *name)
+{
+    if (table_id < 0 || table_id >= MAX_TABLES)
+        return NULL;
+
+    Table *table = db_open_table(name);
+    if (!table && db_create_table(name) >= 0)
+        table = db_open_table(name);
+    leader_tables[table_id] = table;
+    return table;
+}
+
+// Delete every row of a table in a transaction (before a snapshot refills it)
+static bool clear_table(Table *table, int txn_id)
+{
+    RowCursor cursor;
+    for (bool found = db_cursor_first(&cursor, table); found; found = db_cursor_next(&cursor))
+    {
+        if (!db_delete_row(table, txn_id, cursor.key))
+            return false;
+    }
+    return true;
+}
+
+// Is key a committed row of table? Checked without locks, as the follower
+// is the only writer.
+static bool row_exists(Table *table, int key)
+{
+    RowCursor cursor;
+    return db_cursor_seek(&cursor, table, key, SEEK_KEY_GE) && cursor.key == key;
+}
+
+// Apply the records of one message in one transaction
+static bool apply_records(const char *records, size_t length, bool snapshot)
+{
+    int txn_id = db_begin_transaction();
+    if (txn_id < 0)
+        return false;
+
+    bool ok = true;
+    size_t pos = 0;
+    while (ok && pos + sizeof(ReplRecord) <= length)
+    {
+        ReplRecord record;
+        memcpy(&record, records + pos, sizeof(record));
+        const char *data = records + pos + sizeof(record);
+        pos += sizeof(record) + record.size;
+        if (pos > length || record.table_id < 0 || record.table_id >= MAX_TABLES)
+        {
+            ok = false;
+            break;
+        }
+
+        Table *table = leader_tables[record.table_id];
+        switch (record.op)
+        {
+        case REPL_OP_TABLE:
+            table = map_table(record.table_id, data);
+            ok = table && (!snapshot || clear_table(table, txn_id));
+            break;
+        case REPL_OP_PUT:
+            ok = table && db_upsert_row(table, txn_id, record.key, (void *)data, record.size);
+            break;
+        case REPL_OP_DELETE:
+            ok = !table || !row_exists(table, record.key) || db_delete_row(table, txn_id, record.key);
+            break;
+        default:
+            ok = false;
+        }
+    }
+
+    if (ok)
+        return db_commit_transaction(txn_id);
+    db_abort_transaction(txn_id);
+    return false;
+}
+
+// Receive and apply one connection's stream until it breaks
+static void follow_stream(int socket)
+{
+    char *payload = NULL;
+    size_t capacity = 0;
+    bool snapshot_done = false;
+
+    while (1)
+    {
+        ReplHeader header;
+        if (!recv_all(socket, &header, sizeof(header)))
+            break;
+        if (header.length > capacity)
+        {
+            char *grown = (char *)realloc(payload, header.length);
+            if (!grown)
+                break;
+            payload = grown;
+            capacity = header.length;
+        }
+        if (!recv_all(socket, payload, header.length))
+            break;
+
+        if (header.type == REPL_MSG_SNAPSHOT_END)
+        {
+            __atomic_store_n(&applied_seq, header.seq, __ATOMIC_RELEASE);
+            __atomic_store_n(&known_seq, header.seq, __ATOMIC_RELEASE);
+            snapshot_done = true;
+            printf("Replica synchronized with leader at commit %llu\n", (unsigned long long)header.seq);
+            continue;
+        }
+        if (header.type == REPL_MSG_HEARTBEAT)
+        {
+            __atomic_store_n(&known_seq, header.seq, __ATOMIC_RELEASE);
+            if (header.seq <= __atomic_load_n(&applied_seq, __ATOMIC_ACQUIRE))
+                __atomic_store_n(&apply_delay_us, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        bool is_commit = (header.type == REPL_MSG_COMMIT);
+        if ((is_commit && (!snapshot_done || header.seq != applied_seq)) ||
+            (!is_commit && (header.type != REPL_MSG_SNAPSHOT || snapshot_done)))
+        {
+            printf("Error: Unexpected replication message %u (seq %llu)\n", header.type,
+                   (unsigned long long)header.seq);
+            break;
+        }
+        if (is_commit && header.seq >= known_seq)
+            __atomic_store_n(&known_seq, header.seq + 1, __ATOMIC_RELEASE);
+
+        // Conflicts with local readers are transient, so retry until applied
+        while (!apply_records(payload, header.length, !is_commit))
+        {
+            usleep(APPLY_RETRY_US);
+        }
+
+        if (is_commit)
+        {
+            uint64_t now = now_us();
+            __atomic_store_n(&apply_delay_us, now > header.time_us ? now - header.time_us : 0, __ATOMIC_RELEASE);
+            __atomic_store_n(&applied_seq, header.seq + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    free(payload);
+}
+
+static int connect_to_leader()
+{
+    char port[16];
+    snprintf(port, sizeof(port), "%d", leader_port);
+
+    struct addrinfo hints, *addrs;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(leader_host, port, &hints, &addrs) != 0)
+        return -1;
+
+    int sock = -1;
+    for (struct addrinfo *a = addrs; a && sock < 0; a = a->ai_next)
+    {
+        sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (sock >= 0 && connect(sock, a->ai_addr, a->ai_addrlen) != 0)
+        {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    return sock;
+}
+
+static void *replica_main(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        int socket = connect_to_leader();
+        if (socket >= 0)
+        {
+            printf("Replicating from %s:%d\n", leader_host, leader_port);
+            follow_stream(socket);
+            close(socket);
+            printf("Lost connection to leader; reconnecting\n");
+        }
+        usleep(REPL_RETRY_MS * 1000);
+    }
+    return NULL;
+}
+
+bool repl_start_follower(const char *host, int port)
+{
+    snprintf(leader_host, sizeof(leader_host), "%s", host);
+    leader_port = port;
+    following = true;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, replica_main, NULL) != 0)
+    {
+        printf("Error: Failed to start replication\n");
+        following = false;
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+bool repl_get_lag(uint64_t *commits, uint64_t *lag_ms)
+{
+    if (!following)
+        return false;
+
+    uint64_t applied = __atomic_load_n(&applied_seq, __ATOMIC_ACQUIRE);
+    uint64_t known = __atomic_load_n(&known_seq, __ATOMIC_ACQUIRE);
+    *commits = known > applied ? known - applied : 0;
+    *lag_ms = *commits ? __atomic_load_n(&apply_delay_us, __ATOMIC_ACQUIRE) / 1000 : 0;
+    return true;
+}
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "../include/sec_index.h"
+
+#define INITIAL_BUCKETS 64
+#define MAX_LOAD_FACTOR 2  // Grow when entries exceed buckets * factor
+
+// Hash a field value to a bucket
+static size_t hash_value(int value, size_t bucket_count)
+{
+    uint32_t h = (uint32_t)value;
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h & (bucket_count - 1);
+}
+
+// Create an empty secondary index
+SecondaryIndex *sec_index_create(const char *name, const IndexSpec *spec)
+{
+    SecondaryIndex *index = (SecondaryIndex *)malloc(sizeof(SecondaryIndex));
+    if (!index)
+        return NULL;
+
+    index->buckets = (IndexEntry **)calloc(INITIAL_BUCKETS, sizeof(IndexEntry *));
+    if (!index->buckets)
+    {
+        free(index);
+        return NULL;
+    }
+
+    strncpy(index->name, name, MAX_INDEX_NAME - 1);
+    index->name[MAX_INDEX_NAME - 1] = '\0';
+    index->spec = *spec;
+    index->bucket_count = INITIAL_BUCKETS;
+    index->entry_count = 0;
+    index->incomplete = false;
+
+    return index;
+}
+
+// Free a secondary index and all its entries
+void sec_index_destroy(SecondaryIndex *index)
+{
+    if (!index)
+        return;
+
+    for (size_t i = 0; i < index->bucket_count; i++)
+    {
+        IndexEntry *entry = index->buckets[i];
+        while (entry)
+        {
+            IndexEntry *temp = entry;
+            entry = entry->next;
+            free(temp);
+        }
+    }
+
+    free(index->buckets);
+    free(index);
+}
+
+// Extract the indexed value from a row
+bool sec_index_extract(const IndexSpec *spec, const void *data, size_t size, int *value)
+{
+    if (!data)
+        return false;
+
+    if (spec->type == INDEX_FIELD_INT32)
+    {
+        if (spec->field < 0 || (size_t)spec->field + sizeof(int32_t) > size)
+            return false;
+
+        int32_t v;
+        memcpy(&v, (const char *)data + spec->field, sizeof(v));
+        *value = v;
+        return true;
+    }
+
+    // Text row: skip to the requested field
+    const char *p = (const char *)data;
+    const char *end = p + size;
+    for (int f = 0; f < spec->field; f++)
+    {
+        while (p < end && *p != INDEX_FIELD_DELIMITER && *p != '\0')
+            p++;
+        if (p >= end || *p != INDEX_FIELD_DELIMITER)
+            return false; // Row has fewer fields
+        p++;
+    }
+
+    // Parse a signed decimal integer
+    bool negative = false;
+    if (p < end && *p == '-')
+    {
+        negative = true;
+        p++;
+    }
+
+    if (p >= end || *p < '0' || *p > '9')
+        return false;
+
+    long v = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        v = v * 10 + (*p - '0');
+        p++;
+    }
+
+    *value = (int)(negative ? -v : v);
+    return true;
+}
+
+// Double the bucket array and rehash all entries
+static void grow_buckets(SecondaryIndex *index)
+{
+    size_t new_count = index->bucket_count * 2;
+    IndexEntry **new_buckets = (IndexEntry **)calloc(new_count, sizeof(IndexEntry *));
+    if (!new_buckets)
+        return; // Keep the current (longer) chains
+
+    for (size_t i = 0; i < index->bucket_count; i++)
+    {
+        IndexEntry *entry = index->buckets[i];
+        while (entry)
+        {
+            IndexEntry *next = entry->next;
+            size_t b = hash_value(entry->value, new_count);
+            entry->next = new_buckets[b];
+            new_buckets[b] = entry;
+            entry = next;
+        }
+    }
+
+    free(index->buckets);
+    index->buckets = new_buckets;
+    index->bucket_count = new_count;
+}
+
+// Allocate entries onto a list of spares
+bool sec_index_reserve(IndexEntry **spares, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        IndexEntry *entry = (IndexEntry *)malloc(sizeof(IndexEntry));
+        if (!entry)
+            return false;
+        entry->next = *spares;
+        *spares = entry;
+    }
+    return true;
+}
+
+// Free a list of spare entries
+void sec_index_free_spares(IndexEntry *spares)
+{
+    while (spares)
+    {
+        IndexEntry *temp = spares;
+        spares = spares->next;
+        free(temp);
+    }
+}
+
+// Add a (value, primary key) pair
+bool sec_index_insert(SecondaryIndex *index, int value, int row_key, IndexEntry **spares)
+{
+    IndexEntry *entry;
+    if (spares && *spares)
+    {
+        entry = *spares;
+        *spares = entry->next;
+    }
+    else
+    {
+        entry = (IndexEntry *)malloc(sizeof(IndexEntry));
+        if (!entry)
+            return false;
+    }
+
+    if (index->entry_count + 1 > index->bucket_count * MAX_LOAD_FACTOR)
+    {
+        grow_buckets(index);
+    }
+
+    size_t b = hash_value(value, index->bucket_count);
+    entry->value = value;
+    entry->row_key = row_key;
+    entry->next = index->buckets[b];
+    index->buckets[b] = entry;
+    index->entry_count++;
+
+    return true;
+}
+
+// Remove a (value, primary key) pair
+bool sec_index_remove(SecondaryIndex *index, int value, int row_key)
+{
+    size_t b = hash_value(value, index->bucket_count);
+    IndexEntry *entry = index->buckets[b], *prev = NULL;
+
+    while (entry)
+    {
+        if (entry->value == value && entry->row_key == row_key)
+        {
+            if (prev)
+            {
+                prev->next = entry->next;
+            }
+            else
+            {
+                index->buckets[b] = entry->next;
+            }
+            free(entry);
+            index->entry_count--;
+            return true;
+        }
+        prev = entry;
+        entry = entry->next;
+    }
+
+    return false;
+}
+
+// Find the primary keys of rows with the given value
+int sec_index_lookup(SecondaryIndex *index, int value, int *keys, int max_keys)
+{
+    int count = 0;
+    size_t b = hash_value(value, index->bucket_count);
+
+    for (IndexEntry *entry = index->buckets[b]; entry; entry = entry->next)
+    {
+        if (entry->value == value)
+        {
+            if (count < max_keys)
+                keys[count] = entry->row_key;
+            count++;
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../include/free_space.h"
+#include "../include/small_alloc.h"
+#include "../include/wal.h"
+
+#define SMALL_CLASSES 3 // Slot sizes 32, 64 and 128 bytes
+#define SMALL_MIN_SLOT 32
+
+_Static_assert(sizeof(SmallPage) == CACHE_LINE_SIZE, "Small page header must fill one cache line");
+_Static_assert((SMALL_PAGE_SIZE - CACHE_LINE_SIZE) / SMALL_MIN_SLOT <= 2 * 64, "Slot bitmap too small");
+_Static_assert(SMALL_MIN_SLOT << (SMALL_CLASSES - 1) == SMALL_ROW_MAX, "Size classes must cover SMALL_ROW_MAX");
+
+// Pages of one slot size that still have free slots
+typedef struct SizeClass {
+    SmallPage *partial;
+    pthread_mutex_t mutex;
+} SizeClass;
+
+static SizeClass size_classes[SMALL_CLASSES] = {
+    {NULL, PTHREAD_MUTEX_INITIALIZER},
+    {NULL, PTHREAD_MUTEX_INITIALIZER},
+    {NULL, PTHREAD_MUTEX_INITIALIZER},
+};
+
+// Put a page at the head of its size class's partial list
+static void link_partial(SizeClass *sc, SmallPage *page)
+{
+    page->on_partial = 1;
+    page->prev_partial = NULL;
+    page->next_partial = sc->partial;
+    if (sc->partial)
+        sc->partial->prev_partial = page;
+    sc->partial = page;
+}
+
+// Take a page off its size class's partial list
+static void unlink_partial(SizeClass *sc, SmallPage *page)
+{
+    if (page->prev_partial)
+        page->prev_partial->next_partial = page->next_partial;
+    else
+        sc->partial = page->next_partial;
+    if (page->next_partial)
+        page->next_partial->prev_partial = page->prev_partial;
+    page->next_partial = NULL;
+    page->prev_partial = NULL;
+    page->on_partial = 0;
+}
+
+// Map a row size to its size class
+static int size_class_of(size_t size)
+{
+    int c = 0;
+    while ((size_t)(SMALL_MIN_SLOT << c) < size)
+    {
+        c++;
+    }
+    return c;
+}
+
+// Get a fresh page for a size class and persist its empty header
+static SmallPage *format_page(int c)
+{
+    SmallPage *page = (SmallPage *)allocate_aligned(SMALL_PAGE_SIZE, SMALL_PAGE_SIZE);
+    if (!page)
+        return NULL;
+
+    memset(page, 0, sizeof(SmallPage));
+    page->slot_size = SMALL_MIN_SLOT << c;
+    page->slot_count = (SMALL_PAGE_SIZE - CACHE_LINE_SIZE) / page->slot_size;
+    page->free_count = page->slot_count;
+    page->magic = SMALL_PAGE_MAGIC;
+    flush_range(page, sizeof(SmallPage));
+    return page;
+}
+
+// Take a free slot from a size class (bitmap is updated but not flushed)
+static void *small_alloc(int c)
+{
+    SizeClass *sc = &size_classes[c];
+    pthread_mutex_lock(&sc->mutex);
+
+    SmallPage *page = sc->partial;
+    if (!page)
+    {
+        page = format_page(c);
+        if (!page)
+        {
+            pthread_mutex_unlock(&sc->mutex);
+            return NULL;
+        }
+        link_partial(sc, page);
+    }
+
+    // First clear bit of the bitmap
+    uint32_t slot = 0;
+    for (int w = 0; w < 2; w++)
+    {
+        uint64_t free_bits = ~page->bitmap[w];
+        if (free_bits)
+        {
+            slot = w * 64 + __builtin_ctzll(free_bits);
+            break;
+        }
+    }
+
+    page->bitmap[slot / 64] |= 1ULL << (slot % 64);
+    page->free_count--;
+
+    // Full pages leave the partial list until a slot is freed
+    if (page->free_count == 0)
+    {
+        unlink_partial(sc, page);
+    }
+
+    pthread_mutex_unlock(&sc->mutex);
+    return (char *)page + CACHE_LINE_SIZE + (size_t)slot * page->slot_size;
+}
+
+// Return a slot to its page and persist the cleared bit
+static void small_free(void *ptr, int c)
+{
+    SizeClass *sc = &size_classes[c];
+    SmallPage *page = small_page_of(ptr);
+    uint32_t slot = ((char *)ptr - (char *)page - CACHE_LINE_SIZE) / page->slot_size;
+
+    pthread_mutex_lock(&sc->mutex);
+
+    page->bitmap[slot / 64] &= ~(1ULL << (slot % 64));
+    page->free_count++;
+    flush_range(page->bitmap, sizeof(page->bitmap));
+
+    if (!page->on_partial)
+    {
+        link_partial(sc, page);
+    }
+
+    // An empty page goes back to the free space while another page keeps
+    // slots of this size at hand. Its magic is cleared first, so the block
+    // is never taken for a small-row page after a restart.
+    if (page->free_count == page->slot_count && (sc->partial != page || page->next_partial))
+    {
+        unlink_partial(sc, page);
+        memset(page, 0, sizeof(SmallPage));
+        flush_range(page, sizeof(SmallPage));
+        pthread_mutex_unlock(&sc->mutex);
+        free_memory(page, SMALL_PAGE_SIZE);
+        return;
+    }
+
+    pthread_mutex_unlock(&sc->mutex);
+}
+
+// Does a row of this size live in a shared page?
+bool row_is_small(size_t size)
+{
+    return size > 0 && size <= SMALL_ROW_MAX;
+}
+
+// Header of the shared page holding a small row
+SmallPage *small_page_of(void *ptr)
+{
+    size_t offset = (char *)ptr - (char *)nvram_map;
+    return (SmallPage *)((char *)nvram_map + (offset & ~(size_t)(SMALL_PAGE_SIZE - 1)));
+}
+
+// Allocate NVRAM for a row
+void *allocate_row(size_t size)
+{
+    if (row_is_small(size))
+    {
+        return small_alloc(size_class_of(size));
+    }
+    return allocate_memory(size);
+}
+
+// Free a row allocated with allocate_row
+void free_row(void *ptr, size_t size)
+{
+    if (row_is_small(size))
+    {
+        small_free(ptr, size_class_of(size));
+    }
+    else
+    {
+        free_memory(ptr, size);
+    }
+}
+
+// Sort helper for row addresses
+static int compare_rows(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(void *const *)a, y = (uintptr_t)*(void *const *)b;
+    return (x > y) - (x < y);
+}
+
+// Rebuild the slot bitmaps and partial lists from the rows that survived.
+// The list links and free counts in page headers are stale after a restart,
+// and slots of rows lost in the crash are still marked in the bitmaps.
+bool small_alloc_rebuild(void **rows, int count)
+{
+    qsort(rows, count, sizeof(void *), compare_rows);
+    for (int i = 0; i < count; i++)
+    {
+        if (small_page_of(rows[i])->magic != SMALL_PAGE_MAGIC)
+        {
+            printf("Error: Row at %p is not in a small-row page\n", rows[i]);
+            return false;
+        }
+    }
+
+    int i = 0;
+    while (i < count)
+    {
+        SmallPage *page = small_page_of(rows[i]);
+        page->bitmap[0] = 0;
+        page->bitmap[1] = 0;
+        page->free_count = page->slot_count;
+        for (; i < count && small_page_of(rows[i]) == page; i++)
+        {
+            uint32_t slot = ((char *)rows[i] - (char *)page - CACHE_LINE_SIZE) / page->slot_size;
+            if (!(page->bitmap[slot / 64] & (1ULL << (slot % 64))))
+            {
+                page->bitmap[slot / 64] |= 1ULL << (slot % 64);
+                page->free_count--;
+            }
+        }
+        flush_range(page->bitmap, sizeof(page->bitmap));
+
+        page->on_partial = 0;
+        page->next_partial = NULL;
+        page->prev_partial = NULL;
+        if (page->free_count > 0)
+        {
+            SizeClass *sc = &size_classes[size_class_of(page->slot_size)];
+            pthread_mutex_lock(&sc->mutex);
+            link_partial(sc, page);
+            pthread_mutex_unlock(&sc->mutex);
+        }
+    }
+    return true;
+}
+
+// Forget the partial page lists (the pages themselves live in NVRAM). Their
+// headers are unlinked too, so a later run can put them back on a list.
+void cleanup_small_alloc()
+{
+    for (int c = 0; c < SMALL_CLASSES; c++)
+    {
+        pthread_mutex_lock(&size_classes[c].mutex);
+        while (size_classes[c].partial)
+        {
+            unlink_partial(&size_classes[c], size_classes[c].partial);
+        }
+        pthread_mutex_unlock(&size_classes[c].mutex);
+    }
+}
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "../include/free_space.h"
+#include "../include/superblock.h"
+#include "../include/wal.h"
+
+_Static_assert(sizeof(Superblock) <= SUPERBLOCK_COPY_SIZE, "Superblock must fit in one copy");
+_Static_assert(SUPERBLOCK_ALLOC_ROOT_OFFSET + 64 <= NVRAM_RESERVED, "Superblock region too small");
+
+static Superblock current;   // DRAM copy of the newest superblock
+static int current_copy = 0; // Which NVRAM copy holds it
+static pthread_mutex_t superblock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// FNV-1a over the superblock up to its checksum
+static uint64_t superblock_checksum(const Superblock *sb)
+{
+    const unsigned char *bytes = (const unsigned char *)sb;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < offsetof(Superblock, checksum); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// NVRAM address of a superblock copy
+static Superblock *superblock_copy(int copy)
+{
+    return (Superblock *)((char *)nvram_map + copy * SUPERBLOCK_COPY_SIZE);
+}
+
+// Is a copy intact and of our layout?
+static bool superblock_valid(const Superblock *sb)
+{
+    return sb->magic == SUPERBLOCK_MAGIC && sb->version == SUPERBLOCK_VERSION &&
+           sb->checksum == superblock_checksum(sb);
+}
+
+// Write the DRAM superblock with the next generation over the older copy.
+// A torn write leaves a bad checksum, so the previous copy stays in effect.
+static void superblock_write()
+{
+    current.generation++;
+    current.checksum = superblock_checksum(&current);
+
+    int target = 1 - current_copy;
+    Superblock *sb = superblock_copy(target);
+    memcpy(sb, &current, sizeof(Superblock));
+    flush_range(sb, sizeof(Superblock));
+    current_copy = target;
+}
+
+bool superblock_open()
+{
+    pthread_mutex_lock(&superblock_mutex);
+
+    Superblock *copies[2] = {superblock_copy(0), superblock_copy(1)};
+    int newest = -1;
+    for (int i = 0; i < 2; i++)
+    {
+        if (superblock_valid(copies[i]) &&
+            (newest < 0 || copies[i]->generation > copies[newest]->generation))
+        {
+            newest = i;
+        }
+    }
+
+    uint64_t *alloc_root = (uint64_t *)((char *)nvram_map + SUPERBLOCK_ALLOC_ROOT_OFFSET);
+
+    if (newest >= 0)
+    {
+        if (copies[newest]->map_base != (uint64_t)(uintptr_t)nvram_map)
+        {
+            printf("Error: NVRAM mapped at %p, database expects 0x%llx\n",
+                   nvram_map, (unsigned long long)copies[newest]->map_base);
+            exit(1);
+        }
+
+        memcpy(&current, copies[newest], sizeof(Superblock));
+        current_copy = newest;
+        free_space_attach_root(alloc_root, true);
+        pthread_mutex_unlock(&superblock_mutex);
+        printf("Found database (generation %llu, %u tables)\n",
+               (unsigned long long)current.generation, current.table_count);
+        return true;
+    }
+
+    // Only a region without a superblock is formatted. A copy of another
+    // layout, or two damaged copies, still hold a database: refuse to run
+    // rather than discard it.
+    int damaged = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        if (copies[i]->magic != SUPERBLOCK_MAGIC)
+            continue;
+        if (copies[i]->version != SUPERBLOCK_VERSION)
+        {
+            printf("Error: NVRAM holds a database of layout version %u, this build reads version %u\n",
+                   copies[i]->version, SUPERBLOCK_VERSION);
+            exit(1);
+        }
+        damaged++;
+    }
+
+    // The format writes a single copy, so one torn copy beside an empty one
+    // is an interrupted format
+    if (damaged == 2)
+    {
+        printf("Error: Both superblock copies are damaged\n");
+        exit(1);
+    }
+
+    // Format a new database: invalidate both copies, then write a fresh one
+    memset(copies[0], 0, sizeof(Superblock));
+    memset(copies[1], 0, sizeof(Superblock));
+    flush_range_nofence(copies[0], sizeof(Superblock));
+    flush_range(copies[1], sizeof(Superblock));
+    free_space_attach_root(alloc_root, false);
+
+    memset(&current, 0, sizeof(Superblock));
+    current.magic = SUPERBLOCK_MAGIC;
+    current.version = SUPERBLOCK_VERSION;
+    current.map_base = (uint64_t)(uintptr_t)nvram_map;
+    current.alloc_root = SUPERBLOCK_ALLOC_ROOT_OFFSET;
+    for (int i = 0; i < MAX_TABLES; i++)
+    {
+        current.tables[i].table_id = -1;
+    }
+    current_copy = 1;
+    superblock_write();
+
+    pthread_mutex_unlock(&superblock_mutex);
+    return false;
+}
+
+const Superblock *superblock_get()
+{
+    return &current;
+}
+
+bool superblock_add_table(const char *name, int table_id, void *wal_root)
+{
+    pthread_mutex_lock(&superblock_mutex);
+
+    if (current.table_count >= MAX_TABLES)
+    {
+        printf("Error: Catalog is full\n");
+        pthread_mutex_unlock(&superblock_mutex);
+        return false;
+    }
+
+    CatalogEntry *entry = &current.tables[current.table_count++];
+    strncpy(entry->name, name, CATALOG_NAME_SIZE - 1);
+    entry->name[CATALOG_NAME_SIZE - 1] = '\0';
+    entry->table_id = table_id;
+    entry->index_count = 0;
+    entry->wal_root = (uint64_t)((char *)wal_root - (char *)nvram_map);
+    if (current.next_table_id <= table_id)
+        current.next_table_id = table_id + 1;
+
+    superblock_write();
+    pthread_mutex_unlock(&superblock_mutex);
+    return true;
+}
+
+// Catalog entry of a table (superblock mutex held)
+static CatalogEntry *find_entry(int table_id)
+{
+    for (unsigned int i = 0; i < current.table_count; i++)
+    {
+        if (current.tables[i].table_id == table_id)
+            return &current.tables[i];
+    }
+    return NULL;
+}
+
+bool superblock_add_index(int table_id, const char *name, const IndexSpec *spec)
+{
+    pthread_mutex_lock(&superblock_mutex);
+
+    CatalogEntry *entry = find_entry(table_id);
+    if (!entry || entry->index_count >= CATALOG_MAX_INDEXES)
+    {
+        printf("Error: No catalog room for index '%s'\n", name);
+        pthread_mutex_unlock(&superblock_mutex);
+        return false;
+    }
+
+    CatalogIndex *index = &entry->indexes[entry->index_count++];
+    memset(index, 0, sizeof(CatalogIndex));
+    strncpy(index->name, name, MAX_INDEX_NAME - 1);
+    index->type = spec->type;
+    index->field = spec->field;
+
+    superblock_write();
+    pthread_mutex_unlock(&superblock_mutex);
+    return true;
+}
+
+bool superblock_drop_index(int table_id, const char *name)
+{
+    pthread_mutex_lock(&superblock_mutex);
+
+    CatalogEntry *entry = find_entry(table_id);
+    for (uint32_t i = 0; entry && i < entry->index_count; i++)
+    {
+        if (strncmp(entry->indexes[i].name, name, MAX_INDEX_NAME) == 0)
+        {
+            entry->indexes[i] = entry->indexes[--entry->index_count];
+            memset(&entry->indexes[entry->index_count], 0, sizeof(CatalogIndex));
+            superblock_write();
+            pthread_mutex_unlock(&superblock_mutex);
+            return true;
+        }
+    }
+
+    pthread_mutex_unlock(&superblock_mutex);
+    return false;
+}
+
+bool superblock_set_txn_lease(int lease)
+{
+    pthread_mutex_lock(&superblock_mutex);
+    if (lease > current.txn_id_lease)
+    {
+        current.txn_id_lease = lease;
+        superblock_write();
+    }
+    pthread_mutex_unlock(&superblock_mutex);
+    return true;
+}
+
+bool superblock_set_commit_log(void *commit_log)
+{
+    pthread_mutex_lock(&superblock_mutex);
+    current.commit_log = (uint64_t)((char *)commit_log - (char *)nvram_map);
+    superblock_write();
+    pthread_mutex_unlock(&superblock_mutex);
+    return true;
+}
@@ -2,25 +2,187 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
-#include <immintrin.h>  // For Intel intrinsics (_mm_clwb, _mm_stream_si64, etc.)
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
 #include "../include/wal.h"
+#include "../include/free_space.h"
 
-// NVRAM persistence functions
-void flush_range(void *start, size_t size) {
-    // Flush cache lines (64 bytes each)
-    for (size_t i = 0; i < size; i += 64) {
-        _mm_clwb((char *)start + i);
+_Static_assert(sizeof(WALEntry) == 64, "WAL records must fill one cache line");
+_Static_assert(sizeof(WALRing) == 64, "WAL ring header must fill one cache line");
+
+// A committer in a group. Synchronous members live on their committers'
+// stacks until the group is durable; asynchronous ones are allocated and
+// freed by the leader that persists them.
+typedef struct GroupMember {
+    int txn_id;
+    unsigned int table_mask;
+    int ok;
+    int async;
+    struct GroupMember *next;
+} GroupMember;
+
+// Group commit: committers that arrive while a leader is waiting or
+// persisting share one append to the commit log and one fence.
+// Groups are numbered; a committer is done once its group is durable.
+// Group numbers are the commit LSNs reported to clients.
+static pthread_mutex_t group_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t group_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long group_open = 1;    // Group new committers join
+static unsigned long group_durable = 0; // Last group whose commit records are persistent
+static int group_leader_active = 0;
+static unsigned int group_window_us = GROUP_COMMIT_WINDOW_US;
+static GroupMember *group_first = NULL; // Members of the open group
+static GroupMember *group_last = NULL;
+
+// Commit LSN of the calling thread's last commit
+static __thread uint64_t thread_commit_lsn = 0;
+
+// One checkpoint at a time
+static pthread_mutex_t checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Rings replaced by larger ones. A checkpoint may still be reading one
+// without the table mutex, so they are freed when the next one starts.
+typedef struct RetiredRing {
+    WALRing *ring;
+    struct RetiredRing *next;
+} RetiredRing;
+static RetiredRing *retired_rings = NULL;
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Next global sequence number. Writes to one row are ordered by its lock,
+// so a later write always draws a higher number than an earlier one.
+static uint64_t wal_seq = 1;
+
+// Partition index of the calling thread, assigned round robin
+static __thread int thread_partition_index = -1;
+static unsigned int next_partition_index = 0;
+
+// Printable name of a WAL operation
+const char *wal_op_name(int op) {
+    switch (op) {
+    case WAL_OP_DELETE: return "Delete";
+    case WAL_OP_INSERT: return "Add";
+    case WAL_OP_UPDATE: return "Update";
+    case WAL_OP_FIELD:  return "Field";
+    case WAL_OP_COMMIT: return "Commit";
+    default:            return "Unknown";
+    }
+}
+
+WALTable *wal_tables[MAX_TABLES] = {NULL};
+WALTable *wal_commit_log = NULL;
+
+// FNV-1a over the record's words, folded to 32 bits
+static uint32_t record_checksum(const WALEntry *entry) {
+    WALEntry copy = *entry;
+    copy.checksum = 0;
+
+    const uint64_t *words = (const uint64_t *)&copy;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < sizeof(WALEntry) / sizeof(uint64_t); i++) {
+        hash ^= words[i];
+        hash *= 0x100000001b3ULL;
     }
-    _mm_sfence(); // Ensure all previous stores are visible
+    return (uint32_t)(hash ^ (hash >> 32));
 }
 
-// Atomic 64-bit write using non-temporal store (movnti)
-void atomic_write_64(void *dest, uint64_t val) {
-    _mm_stream_si64((long long*)dest, (long long)val);
-    _mm_sfence(); // Ensure the write is committed
+// Slot of a log position
+static inline WALEntry *ring_slot(WALRing *ring, uint64_t lsn) {
+    return &ring->entries[lsn & (ring->capacity - 1)];
 }
 
-WALTable *wal_tables[MAX_TABLES] = {NULL};
+// Does the slot of a log position hold a complete record for it?
+static bool record_valid(WALRing *ring, uint64_t lsn) {
+    WALEntry *entry = ring_slot(ring, lsn);
+    return entry->lsn == lsn && entry->checksum == record_checksum(entry);
+}
+
+// Allocate a ring with no valid records. Freed memory may hold old records
+// with matching positions, so every slot is cleared.
+static WALRing *create_ring(uint64_t capacity) {
+    size_t size = sizeof(WALRing) + capacity * sizeof(WALEntry);
+    WALRing *ring = (WALRing *)allocate_aligned(size, 64);
+    if (!ring)
+        return NULL;
+
+    memset(ring, 0, size);
+    ring->capacity = capacity;
+    flush_range(ring, size);
+    return ring;
+}
+
+static void free_ring(WALRing *ring) {
+    free_memory(ring, sizeof(WALRing) + ring->capacity * sizeof(WALEntry));
+}
+
+// Initialize a log with its partitions in allocated NVRAM space
+static int init_log(WALTable *table, int table_id, int partition_count) {
+    memset(table, 0, sizeof(WALTable));
+    table->table_id = table_id;
+    table->partition_count = partition_count;
+    table->checkpoint = NULL;
+
+    for (int p = 0; p < partition_count; p++) {
+        WALPartition *part = &table->parts[p];
+        part->ring = create_ring(WAL_RING_ENTRIES);
+        if (!part->ring) {
+            printf("Error: Failed to allocate WAL ring for table %d.\n", table_id);
+            while (--p >= 0) {
+                free_ring(table->parts[p].ring);
+            }
+            return 0;
+        }
+        part->head = 0;
+        part->tail = 0;
+        pthread_mutex_init(&part->mutex, NULL);
+    }
+
+    // Initialize mutex
+    pthread_mutex_init(&table->mutex, NULL);
+
+    // Ensure WAL table data is persisted to NVRAM
+    flush_range(table, sizeof(WALTable));
+    return 1;
+}
+
+// Reopen a log found at startup: each partition's records run from its
+// head up to the first slot without a valid record. Only the mutexes
+// (meaningless after a restart) are reinitialized. Sequence numbers resume
+// after the highest one found.
+static void attach_log(WALTable *table) {
+    pthread_mutex_init(&table->mutex, NULL);
+    if (table->checkpoint && table->checkpoint->cut_seq > wal_seq)
+        wal_seq = table->checkpoint->cut_seq;
+
+    for (int p = 0; p < table->partition_count; p++) {
+        WALPartition *part = &table->parts[p];
+        pthread_mutex_init(&part->mutex, NULL);
+        part->tail = part->head;
+        while (part->tail - part->head < part->ring->capacity && record_valid(part->ring, part->tail)) {
+            uint64_t seq = ring_slot(part->ring, part->tail)->seq;
+            if (seq >= wal_seq)
+                wal_seq = seq + 1;
+            part->tail++;
+        }
+
+        // Records sharing a fence (a commit group) can reach NVRAM out of
+        // order, leaving a valid record behind the one that ends the log.
+        // Appends reuse the positions after the tail, so such a record would
+        // rejoin the log once its predecessor is rewritten; clear it first.
+        int cleared = 0;
+        for (uint64_t lsn = part->tail; lsn < part->head + part->ring->capacity; lsn++) {
+            WALEntry *entry = ring_slot(part->ring, lsn);
+            if (entry->lsn >= part->tail) {
+                memset(entry, 0, sizeof(WALEntry));
+                flush_range_nofence(entry, sizeof(WALEntry));
+                cleared = 1;
+            }
+        }
+        if (cleared)
+            persist_fence();
+    }
+}
 
 int wal_create_table(int table_id, void *memory_ptr) {
     if (table_id < 0 || table_id >= MAX_TABLES) {
@@ -33,168 +195,956 @@ int wal_create_table(int table_id, void *memory_ptr) {
         return 0;
     }
 
-    // Initialize the WAL table in allocated NVRAM space
     WALTable *new_table = (WALTable *)memory_ptr;
-    new_table->table_id = table_id;
-    new_table->entry_head = NULL;
-    new_table->entry_tail = NULL;
-    new_table->commit_ptr = NULL;
+    if (!init_log(new_table, table_id, WAL_PARTITIONS))
+        return 0;
 
-    // Initialize mutex
-    pthread_mutex_init(&new_table->mutex, NULL);
+    wal_tables[table_id] = new_table;
+    return 1;
+}
 
-    // Ensure WAL table data is persisted to NVRAM
-    flush_range(new_table, sizeof(WALTable));
+int wal_create_commit_log(void *memory_ptr) {
+    if (wal_commit_log != NULL) {
+        printf("Error: Commit log already exists.\n");
+        return 0;
+    }
 
-    wal_tables[table_id] = new_table;
+    // Group commit already batches the appends, so one partition suffices
+    WALTable *log = (WALTable *)memory_ptr;
+    if (!init_log(log, -1, 1))
+        return 0;
+
+    wal_commit_log = log;
+    return 1;
+}
+
+// Register a WAL table found in NVRAM at startup
+int wal_attach_table(int table_id, void *memory_ptr) {
+    if (table_id < 0 || table_id >= MAX_TABLES || wal_tables[table_id] != NULL) {
+        printf("Error: Cannot attach WAL Table ID %d.\n", table_id);
+        return 0;
+    }
+
+    WALTable *table = (WALTable *)memory_ptr;
+    attach_log(table);
+    wal_tables[table_id] = table;
     return 1;
 }
 
-int wal_add_entry(int table_id, int key, void *data_ptr, int op, void *entry_ptr, size_t data_size) {
+int wal_attach_commit_log(void *memory_ptr) {
+    if (wal_commit_log != NULL) {
+        printf("Error: Commit log already exists.\n");
+        return 0;
+    }
+
+    WALTable *log = (WALTable *)memory_ptr;
+    attach_log(log);
+    wal_commit_log = log;
+    return 1;
+}
+
+// Forget one WAL table
+void wal_detach_table(int table_id) {
+    if (table_id >= 0 && table_id < MAX_TABLES) {
+        wal_tables[table_id] = NULL;
+    }
+}
+
+// Forget all WAL tables (the region is about to be unmapped)
+void wal_detach_all() {
+    for (int i = 0; i < MAX_TABLES; i++) {
+        wal_tables[i] = NULL;
+    }
+    wal_commit_log = NULL;
+
+    // Retired rings are unreachable; the allocator of the next run finds
+    // them free without being told
+    pthread_mutex_lock(&retired_mutex);
+    while (retired_rings) {
+        RetiredRing *next = retired_rings->next;
+        free(retired_rings);
+        retired_rings = next;
+    }
+    pthread_mutex_unlock(&retired_mutex);
+}
+
+// Report the NVRAM blocks of one log
+static void list_log_blocks(WALTable *table, WALBlockFn fn, void *arg) {
+    fn(table, sizeof(WALTable), arg);
+    for (int p = 0; p < table->partition_count; p++) {
+        WALRing *ring = table->parts[p].ring;
+        fn(ring, sizeof(WALRing) + ring->capacity * sizeof(WALEntry), arg);
+    }
+    if (table->checkpoint) {
+        fn(table->checkpoint, sizeof(WALCheckpoint) + table->checkpoint->row_count * sizeof(WALCheckpointRow), arg);
+    }
+}
+
+void wal_list_blocks(WALBlockFn fn, void *arg) {
+    pthread_mutex_lock(&checkpoint_mutex);
+    if (wal_commit_log)
+        list_log_blocks(wal_commit_log, fn, arg);
+    for (int i = 0; i < MAX_TABLES; i++) {
+        if (wal_tables[i])
+            list_log_blocks(wal_tables[i], fn, arg);
+    }
+    pthread_mutex_unlock(&checkpoint_mutex);
+}
+
+// Move a full partition to a ring twice the size (mutex held). The new ring
+// is complete before the single pointer store that switches to it.
+static int grow_ring(WALPartition *part) {
+    WALRing *old = part->ring;
+    WALRing *ring = create_ring(old->capacity * 2);
+    if (!ring) {
+        printf("Error: Failed to grow WAL ring.\n");
+        return 0;
+    }
+
+    for (uint64_t lsn = part->head; lsn < part->tail; lsn++) {
+        *ring_slot(ring, lsn) = *ring_slot(old, lsn);
+    }
+    flush_range(ring, sizeof(WALRing) + ring->capacity * sizeof(WALEntry));
+    atomic_write_64(&part->ring, (uint64_t)ring);
+
+    RetiredRing *retired = (RetiredRing *)malloc(sizeof(RetiredRing));
+    if (retired) {
+        pthread_mutex_lock(&retired_mutex);
+        retired->ring = old;
+        retired->next = retired_rings;
+        retired_rings = retired;
+        pthread_mutex_unlock(&retired_mutex);
+    }
+    return 1;
+}
+
+// Claim the slot of the next position in a partition (mutex held). The
+// record's seq is taken here, so each partition is ordered by seq. The
+// caller fills the slot in and seals it with seal_record.
+static WALEntry *reserve_record(WALPartition *part) {
+    if (part->tail - part->head == part->ring->capacity && !grow_ring(part))
+        return NULL;
+
+    WALEntry *entry = ring_slot(part->ring, part->tail);
+    memset(entry, 0, sizeof(WALEntry));
+    entry->lsn = part->tail;
+    entry->seq = __atomic_fetch_add(&wal_seq, 1, __ATOMIC_SEQ_CST);
+    return entry;
+}
+
+// Checksum a filled-in record, write it back and make it the new tail
+// (mutex held). The caller issues the fence.
+static void seal_record(WALPartition *part, WALEntry *entry) {
+    entry->checksum = record_checksum(entry);
+    flush_range_nofence(entry, sizeof(WALEntry));
+    // Inspectors read the tail without the mutex
+    __atomic_store_n(&part->tail, part->tail + 1, __ATOMIC_RELEASE);
+}
+
+// The partition of a table's log the calling thread appends to
+static WALPartition *thread_partition(WALTable *table) {
+    if (thread_partition_index < 0) {
+        thread_partition_index = (int)(__atomic_fetch_add(&next_partition_index, 1, __ATOMIC_RELAXED) % WAL_PARTITIONS);
+    }
+    return &table->parts[thread_partition_index % table->partition_count];
+}
+
+int wal_add_entry(int table_id, int txn_id, int key, void *data_ptr, int op, size_t data_size) {
     if (table_id < 0 || table_id >= MAX_TABLES || wal_tables[table_id] == NULL) {
         printf("Error: WAL Table %d not found.\n", table_id);
         return 0;
     }
 
-    WALTable *table = wal_tables[table_id];
+    // Threads append to their own partitions, so writers to one table do
+    // not serialize on a single mutex
+    WALPartition *part = thread_partition(wal_tables[table_id]);
+    pthread_mutex_lock(&part->mutex);
 
-    // Lock the WAL table mutex
-    pthread_mutex_lock(&table->mutex);
-
-    // Create WAL entry in allocated NVRAM space
-    WALEntry *entry = (WALEntry *)entry_ptr;
+    WALEntry *entry = reserve_record(part);
+    if (!entry) {
+        pthread_mutex_unlock(&part->mutex);
+        return 0;
+    }
     entry->key = key;
+    entry->txn_id = txn_id;
     entry->data_ptr = data_ptr;
     entry->op_flag = op;
-    entry->data_size = data_size;
-    entry->next = NULL;
-
-    // First, persist the entry content
-    flush_range(entry, sizeof(WALEntry));
-
-    // Add to the end of the linked list
-    if (table->entry_tail == NULL) {
-        // First entry in the list
-        table->entry_head = entry;
-        table->entry_tail = entry;
-        
-        // Persist head and tail pointers
-        flush_range(&table->entry_head, sizeof(void*));
-        flush_range(&table->entry_tail, sizeof(void*));
-    } else {
-        // Append to existing list
-        WALEntry *old_tail = table->entry_tail;
-        old_tail->next = entry;
-        
-        // First persist the next pointer of the old tail
-        flush_range(&old_tail->next, sizeof(void*));
-        
-        // Then update the tail pointer
-        table->entry_tail = entry;
-        flush_range(&table->entry_tail, sizeof(void*));
-    }
-
-    // Unlock the WAL table mutex
-    pthread_mutex_unlock(&table->mutex);
+    entry->data_size = (uint32_t)data_size;
+
+    // One line and one fence; no pointer has to reach NVRAM before it
+    seal_record(part, entry);
+    persist_fence();
+
+    pthread_mutex_unlock(&part->mutex);
     return 1;
 }
 
-void wal_advance_commit_ptr(int table_id, int txn_id) {
+int wal_add_field_entry(int table_id, int txn_id, int key, size_t offset, const uint64_t *words, int word_count) {
     if (table_id < 0 || table_id >= MAX_TABLES || wal_tables[table_id] == NULL) {
         printf("Error: WAL Table %d not found.\n", table_id);
-        return;
+        return 0;
+    }
+    if (word_count < 1 || word_count > WAL_FIELD_MAX_WORDS || offset % 8 != 0) {
+        printf("Error: Invalid field record of %d words at offset %zu.\n", word_count, offset);
+        return 0;
     }
 
-    WALTable *table = wal_tables[table_id];
+    WALPartition *part = thread_partition(wal_tables[table_id]);
+    pthread_mutex_lock(&part->mutex);
 
-    // Lock the WAL table mutex
-    pthread_mutex_lock(&table->mutex);
+    WALEntry *entry = reserve_record(part);
+    if (!entry) {
+        pthread_mutex_unlock(&part->mutex);
+        return 0;
+    }
+
+    // Only the changed words are logged, not the row
+    entry->key = key;
+    entry->txn_id = txn_id;
+    entry->data_ptr = NULL;
+    entry->op_flag = WAL_OP_FIELD;
+    entry->data_size = (uint32_t)(word_count * sizeof(uint64_t));
+    entry->field_offset = (uint32_t)offset;
+    for (int i = 0; i < word_count; i++) {
+        entry->field_words[i] = words[i];
+    }
+
+    seal_record(part, entry);
+    persist_fence();
+
+    pthread_mutex_unlock(&part->mutex);
+    return 1;
+}
+
+void wal_set_group_commit_window(unsigned int usec) {
+    pthread_mutex_lock(&group_mutex);
+    group_window_us = usec;
+    pthread_mutex_unlock(&group_mutex);
+}
+
+// Append a closed group's commit records to the commit log (leader only).
+// The records are consecutive lines that become durable with one fence.
+static void persist_group(GroupMember *first) {
+    WALPartition *log = &wal_commit_log->parts[0];
+
+    pthread_mutex_lock(&log->mutex);
+    for (GroupMember *m = first; m != NULL; m = m->next) {
+        WALEntry *record = reserve_record(log);
+        m->ok = (record != NULL);
+        if (!record)
+            continue;
+        record->op_flag = WAL_OP_COMMIT;
+        record->key = -1;
+        record->txn_id = m->txn_id;
+        record->data_size = m->table_mask;
+        seal_record(log, record);
+    }
+    persist_fence();
+    pthread_mutex_unlock(&log->mutex);
+}
+
+// Close the open group and persist it (group_mutex held, no leader
+// active). The mutex is released while the records are written.
+static void lead_group(int use_window) {
+    group_leader_active = 1;
+
+    // Give other committers the window to join this group
+    if (use_window && group_window_us > 0) {
+        pthread_mutex_unlock(&group_mutex);
+        usleep(group_window_us);
+        pthread_mutex_lock(&group_mutex);
+    }
+
+    // Later arrivals form the next group
+    unsigned long closing = group_open++;
+    GroupMember *first = group_first;
+    group_first = group_last = NULL;
+    pthread_mutex_unlock(&group_mutex);
+
+    persist_group(first);
+
+    // Asynchronous committers have returned already. Synchronous members
+    // are still waiting for this group, so the list stays valid.
+    GroupMember *next;
+    for (GroupMember *m = first; m != NULL; m = next) {
+        next = m->next;
+        if (m->async) {
+            if (!m->ok)
+                printf("Error: Failed to persist commit record of transaction %d.\n", m->txn_id);
+            free(m);
+        }
+    }
+
+    pthread_mutex_lock(&group_mutex);
+    group_durable = closing;
+    group_leader_active = 0;
+    pthread_cond_broadcast(&group_cond);
+}
+
+// Wait until group lsn is durable, leading groups while no one else does
+// (group_mutex held)
+static void wait_group(unsigned long lsn, int use_window) {
+    while (group_durable < lsn) {
+        if (group_leader_active) {
+            // Follower: the leader persists our commit record too
+            pthread_cond_wait(&group_cond, &group_mutex);
+        } else {
+            lead_group(use_window);
+        }
+    }
+}
+
+int wal_group_commit(int txn_id, unsigned int table_mask, int async) {
+    if (wal_commit_log == NULL) {
+        printf("Error: Commit log not found.\n");
+        return 0;
+    }
+
+    GroupMember self = {txn_id, table_mask, 0, 0, NULL};
+    GroupMember *member = &self;
+    if (async) {
+        member = (GroupMember *)malloc(sizeof(GroupMember));
+        if (!member) {
+            printf("Error: Failed to queue asynchronous commit.\n");
+            return 0;
+        }
+        *member = self;
+        member->async = 1;
+    }
+
+    pthread_mutex_lock(&group_mutex);
+    unsigned long my_group = group_open;
+    if (group_last) {
+        group_last->next = member;
+    } else {
+        group_first = member;
+    }
+    group_last = member;
+    thread_commit_lsn = my_group;
+
+    // The record is persisted by a later group leader or the flusher; the
+    // transaction's entries are durable already
+    if (async) {
+        pthread_mutex_unlock(&group_mutex);
+        return 1;
+    }
+
+    wait_group(my_group, 1);
+    pthread_mutex_unlock(&group_mutex);
+    return self.ok;
+}
+
+uint64_t wal_last_commit_lsn() {
+    return thread_commit_lsn;
+}
+
+uint64_t wal_durable_lsn() {
+    pthread_mutex_lock(&group_mutex);
+    uint64_t lsn = group_durable;
+    pthread_mutex_unlock(&group_mutex);
+    return lsn;
+}
+
+uint64_t wal_wait_durable(uint64_t lsn) {
+    pthread_mutex_lock(&group_mutex);
+    // Groups that have not been opened yet have no commits to wait for
+    if (lsn > group_open)
+        lsn = group_open;
+    if (lsn == group_open && group_first == NULL)
+        lsn = group_open - 1;
+    wait_group(lsn, 0);
+    lsn = group_durable;
+    pthread_mutex_unlock(&group_mutex);
+    return lsn;
+}
+
+uint64_t wal_flush_commits() {
+    return wal_wait_durable(UINT64_MAX);
+}
+
+// Sort helper for transaction IDs
+static int compare_txn_ids(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Collect the sorted IDs of durably committed transactions (caller frees)
+static int *committed_txns(int *count) {
+    *count = 0;
+    if (wal_commit_log == NULL)
+        return NULL;
+
+    WALPartition *log = &wal_commit_log->parts[0];
+    pthread_mutex_lock(&log->mutex);
+    int capacity = (int)(log->tail - log->head);
+    int *ids = capacity > 0 ? (int *)malloc(capacity * sizeof(int)) : NULL;
+    for (uint64_t lsn = log->head; ids && lsn < log->tail; lsn++) {
+        ids[(*count)++] = ring_slot(log->ring, lsn)->txn_id;
+    }
+    pthread_mutex_unlock(&log->mutex);
 
-    // Update commit pointer to current tail (last entry)
-    table->commit_ptr = table->entry_tail;
-    
-    // Use atomic write for the commit pointer update
-    atomic_write_64(&table->commit_ptr, (uint64_t)table->entry_tail);
+    if (ids)
+        qsort(ids, *count, sizeof(int), compare_txn_ids);
+    return ids;
+}
+
+// Is a transaction in a sorted list of committed IDs?
+static int txn_is_committed(const int *ids, int count, int txn_id) {
+    return ids && bsearch(&txn_id, ids, count, sizeof(int), compare_txn_ids) != NULL;
+}
+
+// Lock every partition of a table, in order, after the table mutex. This
+// holds off appends and checkpoints while a reader walks the whole log.
+static void lock_partitions(WALTable *table) {
+    pthread_mutex_lock(&table->mutex);
+    for (int p = 0; p < table->partition_count; p++) {
+        pthread_mutex_lock(&table->parts[p].mutex);
+    }
+}
 
-    // Unlock the WAL table mutex
+static void unlock_partitions(WALTable *table) {
+    for (int p = table->partition_count - 1; p >= 0; p--) {
+        pthread_mutex_unlock(&table->parts[p].mutex);
+    }
     pthread_mutex_unlock(&table->mutex);
 }
 
-void wal_show_data() {
-    for (int i = 0; i < MAX_TABLES; i++) {
-        if (wal_tables[i] == NULL)
+// Merges a table's partitions into one sequence ordered by seq
+typedef struct MergeCursor {
+    WALTable *table;
+    uint64_t lsn[WAL_PARTITIONS];
+} MergeCursor;
+
+static void merge_start(MergeCursor *cursor, WALTable *table) {
+    cursor->table = table;
+    for (int p = 0; p < table->partition_count; p++) {
+        cursor->lsn[p] = table->parts[p].head;
+    }
+}
+
+// Next record in seq order, or NULL at the end (partitions locked)
+static const WALEntry *merge_next(MergeCursor *cursor) {
+    WALTable *table = cursor->table;
+    const WALEntry *next = NULL;
+    int next_part = -1;
+    for (int p = 0; p < table->partition_count; p++) {
+        if (cursor->lsn[p] == table->parts[p].tail)
             continue;
+        const WALEntry *entry = ring_slot(table->parts[p].ring, cursor->lsn[p]);
+        if (next == NULL || entry->seq < next->seq) {
+            next = entry;
+            next_part = p;
+        }
+    }
+    if (next_part >= 0)
+        cursor->lsn[next_part]++;
+    return next;
+}
+
+// Records of one partition as seen by a reader that takes no partition
+// mutex (checkpoint_mutex held, so the head and the rings stay put).
+// The tail is read before the ring: records appended after a ring grows
+// go to the new ring, which also holds copies of all earlier ones.
+typedef struct PartitionView {
+    WALRing *ring;
+    uint64_t head;
+    uint64_t tail;
+} PartitionView;
+
+static void view_partition(WALPartition *part, PartitionView *view) {
+    view->tail = __atomic_load_n(&part->tail, __ATOMIC_ACQUIRE);
+    view->ring = __atomic_load_n(&part->ring, __ATOMIC_ACQUIRE);
+    view->head = __atomic_load_n(&part->head, __ATOMIC_ACQUIRE);
+}
+
+// Copy the record at a position of a viewed partition. Records before the
+// tail are sealed and are not reused while checkpoint_mutex is held, but
+// the copy is checked anyway.
+static bool view_record(const PartitionView *view, uint64_t lsn, WALEntry *out) {
+    *out = *ring_slot(view->ring, lsn);
+    return out->lsn == lsn && out->checksum == record_checksum(out);
+}
+
+// committed_txns without the commit log mutex (checkpoint_mutex held)
+static int *viewed_committed_txns(int *count) {
+    *count = 0;
+    if (wal_commit_log == NULL)
+        return NULL;
+
+    PartitionView view;
+    view_partition(&wal_commit_log->parts[0], &view);
+    int capacity = (int)(view.tail - view.head);
+    int *ids = capacity > 0 ? (int *)malloc(capacity * sizeof(int)) : NULL;
+    for (uint64_t lsn = view.head; ids && lsn < view.tail; lsn++) {
+        WALEntry record;
+        if (view_record(&view, lsn, &record))
+            ids[(*count)++] = record.txn_id;
+    }
+
+    if (ids)
+        qsort(ids, *count, sizeof(int), compare_txn_ids);
+    return ids;
+}
+
+int wal_inspect(int table_id, uint64_t start_seq, WALEntryInfo *entries, int limit, WALStats *stats) {
+    if (table_id >= MAX_TABLES || (table_id >= 0 && wal_tables[table_id] == NULL)) {
+        printf("Error: WAL Table %d not found.\n", table_id);
+        return -1;
+    }
 
+    WALStats totals;
+    memset(&totals, 0, sizeof(WALStats));
+    totals.oldest_uncommitted_txn = -1;
+
+    // Only checkpoints move heads and free rings; appends go on meanwhile
+    pthread_mutex_lock(&checkpoint_mutex);
+
+    // Read the commit log last, so every commit of a viewed record that is
+    // durable by then is seen
+    PartitionView views[MAX_TABLES * WAL_PARTITIONS];
+    uint64_t pos[MAX_TABLES * WAL_PARTITIONS];
+    int owner[MAX_TABLES * WAL_PARTITIONS];
+    int view_count = 0;
+    for (int i = 0; i < MAX_TABLES; i++) {
         WALTable *table = wal_tables[i];
+        if (table == NULL || (table_id >= 0 && i != table_id))
+            continue;
+
+        totals.tables++;
+        if (table->checkpoint)
+            totals.checkpoint_rows += table->checkpoint->row_count;
+        for (int p = 0; p < table->partition_count; p++) {
+            view_partition(&table->parts[p], &views[view_count]);
+            pos[view_count] = views[view_count].head;
+            owner[view_count] = i;
+            totals.capacity += views[view_count].ring->capacity;
+            view_count++;
+        }
+    }
 
-        // Lock the WAL table mutex before reading
-        pthread_mutex_lock(&table->mutex);
+    int committed_count;
+    int *committed = viewed_committed_txns(&committed_count);
+    totals.commit_records = committed_count;
 
-        printf("\nTable ID: %d\n", table->table_id);
-        printf("Commit Pointer: %p\n", table->commit_ptr);
+    // Totals over the whole snapshot (a walk of every record)
+    for (int v = 0; stats && v < view_count; v++) {
+        for (uint64_t lsn = views[v].head; lsn < views[v].tail; lsn++) {
+            WALEntry record;
+            if (!view_record(&views[v], lsn, &record))
+                continue;
+            totals.entries++;
+            totals.bytes += sizeof(WALEntry);
+            if (txn_is_committed(committed, committed_count, record.txn_id)) {
+                totals.committed++;
+            } else if (totals.oldest_uncommitted_txn < 0 || record.seq < totals.oldest_uncommitted_seq) {
+                totals.oldest_uncommitted_txn = record.txn_id;
+                totals.oldest_uncommitted_seq = record.seq;
+            }
+        }
+    }
 
-        // Traverse the linked list of entries
-        WALEntry *current = table->entry_head;
-        int entry_count = 0;
-        
-        while (current != NULL) {
-            printf("Entry %d: Key: %d | Operation: %s | Data: %s | Size: %zu | %s\n",
-                   entry_count++,
-                   current->key,
-                   current->op_flag ? "Delete" : "Add",
-                   (char *)current->data_ptr,
-                   current->data_size,
-                   (current == table->commit_ptr) ? "COMMITTED" : "");
-            
-            current = current->next;
+    // The page: records from start_seq on, partitions merged by seq
+    int count = 0;
+    for (int v = 0; v < view_count; v++) {
+        // Partitions are ordered by seq, so the page starts are found by
+        // binary search
+        uint64_t lo = views[v].head, hi = views[v].tail;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (ring_slot(views[v].ring, mid)->seq < start_seq) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        pos[v] = lo;
+    }
+    while (count < limit) {
+        WALEntry next;
+        int next_view = -1;
+        for (int v = 0; v < view_count; v++) {
+            WALEntry record;
+            if (pos[v] == views[v].tail)
+                continue;
+            if (!view_record(&views[v], pos[v], &record)) {
+                pos[v] = views[v].tail;
+                continue;
+            }
+            if (next_view < 0 || record.seq < next.seq) {
+                next = record;
+                next_view = v;
+            }
         }
+        if (next_view < 0)
+            break;
+        pos[next_view]++;
 
-        // Unlock the WAL table mutex after reading
-        pthread_mutex_unlock(&table->mutex);
+        WALEntryInfo *info = &entries[count++];
+        info->table_id = owner[next_view];
+        info->seq = next.seq;
+        info->txn_id = next.txn_id;
+        info->key = next.key;
+        info->op = next.op_flag;
+        info->size = next.data_size;
+        info->committed = txn_is_committed(committed, committed_count, next.txn_id);
     }
+
+    pthread_mutex_unlock(&checkpoint_mutex);
+    free(committed);
+    if (stats)
+        *stats = totals;
+    return count;
 }
 
-// New function for crash recovery
+int wal_replay_table(int table_id, WALReplayFn fn, void *arg) {
+    if (table_id < 0 || table_id >= MAX_TABLES || wal_tables[table_id] == NULL) {
+        printf("Error: WAL Table %d not found.\n", table_id);
+        return -1;
+    }
+
+    int committed_count;
+    int *committed = committed_txns(&committed_count);
+
+    WALTable *table = wal_tables[table_id];
+    lock_partitions(table);
+
+    // Rows folded into the checkpoint come first
+    WALCheckpoint *image = table->checkpoint;
+    uint64_t cut_seq = image ? image->cut_seq : 0;
+    for (uint64_t i = 0; image != NULL && i < image->row_count; i++) {
+        WALEntry row;
+        memset(&row, 0, sizeof(WALEntry));
+        row.op_flag = WAL_OP_INSERT;
+        row.key = image->rows[i].key;
+        row.txn_id = -1;
+        row.data_ptr = image->rows[i].data_ptr;
+        row.data_size = image->rows[i].size;
+        fn(&row, 1, arg);
+    }
+
+    // Each partition streams through its ring; records the checkpoint
+    // already covers are skipped
+    int replayed = 0;
+    MergeCursor cursor;
+    merge_start(&cursor, table);
+    const WALEntry *current;
+    while ((current = merge_next(&cursor)) != NULL) {
+        if (current->seq < cut_seq)
+            continue;
+        int is_committed = txn_is_committed(committed, committed_count, current->txn_id);
+        fn(current, is_committed, arg);
+        replayed += is_committed;
+    }
+
+    unlock_partitions(table);
+    free(committed);
+    return replayed;
+}
+
+// A row operation folded into a checkpoint
+typedef struct CheckpointOp {
+    int key;
+    int op;
+    uint64_t seq;
+    void *data;
+    size_t size;
+} CheckpointOp;
+
+// Sort helper: by key, then by global order
+static int compare_checkpoint_ops(const void *a, const void *b) {
+    const CheckpointOp *x = (const CheckpointOp *)a, *y = (const CheckpointOp *)b;
+    if (x->key != y->key)
+        return (x->key > y->key) - (x->key < y->key);
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+int wal_checkpoint_due(int table_id) {
+    if (table_id < 0 || table_id >= MAX_TABLES || wal_tables[table_id] == NULL)
+        return 0;
+
+    // Rewriting the image costs its size, so wait until the log is a fair
+    // fraction of it
+    WALTable *table = wal_tables[table_id];
+    uint64_t entries = 0;
+    for (int p = 0; p < table->partition_count; p++) {
+        pthread_mutex_lock(&table->parts[p].mutex);
+        entries += table->parts[p].tail - table->parts[p].head;
+        pthread_mutex_unlock(&table->parts[p].mutex);
+    }
+    pthread_mutex_lock(&table->mutex);
+    uint64_t image_rows = table->checkpoint ? table->checkpoint->row_count : 0;
+    pthread_mutex_unlock(&table->mutex);
+    return entries >= WAL_CHECKPOINT_MIN_ENTRIES && entries >= image_rows / WAL_CHECKPOINT_IMAGE_RATIO;
+}
+
+// Partitions of a table as a checkpoint saw them
+typedef struct CheckpointView {
+    int partition_count;
+    WALRing *ring[WAL_PARTITIONS];
+    uint64_t head[WAL_PARTITIONS];
+    uint64_t count[WAL_PARTITIONS]; // Records before the cut
+} CheckpointView;
+
+// Build the image of the old checkpoint plus the committed row operations
+// before the cut (caller frees with free_memory)
+static WALCheckpoint *build_checkpoint(const WALCheckpoint *old, const CheckpointView *view, uint64_t cut_seq,
+                                       const int *committed, int committed_count, size_t *image_size) {
+    size_t old_rows = old ? old->row_count : 0;
+    uint64_t from_seq = old ? old->cut_seq : 0;
+    size_t total = old_rows + 1;
+    for (int p = 0; p < view->partition_count; p++) {
+        total += view->count[p];
+    }
+    CheckpointOp *ops = (CheckpointOp *)malloc(total * sizeof(CheckpointOp));
+    if (!ops)
+        return NULL;
+
+    size_t n = 0;
+    for (size_t i = 0; i < old_rows; i++) {
+        ops[n].key = old->rows[i].key;
+        ops[n].op = WAL_OP_INSERT;
+        ops[n].seq = 0;
+        ops[n].data = old->rows[i].data_ptr;
+        ops[n].size = old->rows[i].size;
+        n++;
+    }
+
+    // Field writes of transactions before the cut were applied to the row
+    // when they committed, so only row versions go into the image. Records
+    // the old image covers (left behind by a crash before the heads moved)
+    // are skipped.
+    for (int p = 0; p < view->partition_count; p++) {
+        for (uint64_t i = 0; i < view->count[p]; i++) {
+            const WALEntry *entry = ring_slot(view->ring[p], view->head[p] + i);
+            if (entry->op_flag != WAL_OP_INSERT && entry->op_flag != WAL_OP_UPDATE && entry->op_flag != WAL_OP_DELETE)
+                continue;
+            if (entry->seq < from_seq || !txn_is_committed(committed, committed_count, entry->txn_id))
+                continue;
+            ops[n].key = entry->key;
+            ops[n].op = entry->op_flag;
+            ops[n].seq = entry->seq;
+            ops[n].data = entry->data_ptr;
+            ops[n].size = entry->data_size;
+            n++;
+        }
+    }
+
+    // The last operation on each key decides whether the row is in the image
+    qsort(ops, n, sizeof(CheckpointOp), compare_checkpoint_ops);
+    size_t rows = 0;
+    for (size_t i = 0; i < n; i++) {
+        bool last = (i + 1 == n || ops[i + 1].key != ops[i].key);
+        if (last && ops[i].op != WAL_OP_DELETE)
+            ops[rows++] = ops[i];
+    }
+
+    *image_size = sizeof(WALCheckpoint) + rows * sizeof(WALCheckpointRow);
+    WALCheckpoint *image = (WALCheckpoint *)allocate_memory(*image_size);
+    if (!image) {
+        free(ops);
+        return NULL;
+    }
+
+    image->row_count = rows;
+    image->cut_seq = cut_seq;
+    for (size_t i = 0; i < rows; i++) {
+        image->rows[i].key = ops[i].key;
+        image->rows[i].size = (uint32_t)ops[i].size;
+        image->rows[i].data_ptr = ops[i].data;
+    }
+    flush_range(image, *image_size);
+
+    free(ops);
+    return image;
+}
+
+// Free the rings retired since the last checkpoint (checkpoint_mutex held)
+static void free_retired_rings() {
+    pthread_mutex_lock(&retired_mutex);
+    RetiredRing *retired = retired_rings;
+    retired_rings = NULL;
+    pthread_mutex_unlock(&retired_mutex);
+
+    while (retired) {
+        RetiredRing *next = retired->next;
+        free_ring(retired->ring);
+        free(retired);
+        retired = next;
+    }
+}
+
+int wal_checkpoint_table(int table_id, int oldest_active) {
+    if (table_id < 0 || table_id >= MAX_TABLES || wal_tables[table_id] == NULL) {
+        printf("Error: WAL Table %d not found.\n", table_id);
+        return -1;
+    }
+
+    WALTable *table = wal_tables[table_id];
+    pthread_mutex_lock(&checkpoint_mutex);
+    free_retired_rings();
+
+    // Every record with a lower seq than this is already in its partition's
+    // tail, because seq is drawn under the partition mutex
+    uint64_t cut_seq = __atomic_load_n(&wal_seq, __ATOMIC_SEQ_CST);
+
+    // Records before a tail never change, and a ring replaced by a larger
+    // one stays allocated until the next checkpoint, so the walks need no
+    // mutex
+    CheckpointView view;
+    uint64_t tail[WAL_PARTITIONS];
+    view.partition_count = table->partition_count;
+    for (int p = 0; p < view.partition_count; p++) {
+        WALPartition *part = &table->parts[p];
+        pthread_mutex_lock(&part->mutex);
+        view.ring[p] = part->ring;
+        view.head[p] = part->head;
+        tail[p] = part->tail;
+        pthread_mutex_unlock(&part->mutex);
+    }
+
+    // The cut is the lowest seq whose outcome may be undecided. Older
+    // transactions have their commit records written already, so the
+    // committed set is read afterwards.
+    for (int p = 0; p < view.partition_count; p++) {
+        for (uint64_t lsn = view.head[p]; lsn < tail[p]; lsn++) {
+            const WALEntry *entry = ring_slot(view.ring[p], lsn);
+            if (entry->txn_id >= oldest_active) {
+                if (entry->seq < cut_seq)
+                    cut_seq = entry->seq;
+                break;
+            }
+        }
+    }
+
+    // Partitions are ordered by seq, so each folds a prefix
+    uint64_t total = 0;
+    for (int p = 0; p < view.partition_count; p++) {
+        view.count[p] = 0;
+        while (view.head[p] + view.count[p] < tail[p] &&
+               ring_slot(view.ring[p], view.head[p] + view.count[p])->seq < cut_seq) {
+            view.count[p]++;
+        }
+        total += view.count[p];
+    }
+    if (total == 0) {
+        pthread_mutex_unlock(&checkpoint_mutex);
+        return 0;
+    }
+
+    int committed_count;
+    int *committed = committed_txns(&committed_count);
+    size_t image_size;
+    WALCheckpoint *old = table->checkpoint;
+    WALCheckpoint *image = build_checkpoint(old, &view, cut_seq, committed, committed_count, &image_size);
+    free(committed);
+    if (!image) {
+        printf("Error: Failed to allocate checkpoint for WAL Table %d.\n", table_id);
+        pthread_mutex_unlock(&checkpoint_mutex);
+        return -1;
+    }
+
+    // Installing the image is the checkpoint: replay skips records before
+    // its cut from then on. Moving the heads afterwards only releases the
+    // folded slots for reuse.
+    pthread_mutex_lock(&table->mutex);
+    atomic_write_64(&table->checkpoint, (uint64_t)image);
+    for (int p = 0; p < view.partition_count; p++) {
+        WALPartition *part = &table->parts[p];
+        pthread_mutex_lock(&part->mutex);
+        atomic_write_64(&part->head, view.head[p] + view.count[p]);
+        pthread_mutex_unlock(&part->mutex);
+    }
+    pthread_mutex_unlock(&table->mutex);
+
+    // Superseded payloads were freed when they were replaced or deleted
+    if (old) {
+        free_memory(old, sizeof(WALCheckpoint) + old->row_count * sizeof(WALCheckpointRow));
+    }
+
+    pthread_mutex_unlock(&checkpoint_mutex);
+    return (int)total;
+}
+
+int wal_trim_commit_log() {
+    if (wal_commit_log == NULL)
+        return 0;
+
+    WALPartition *log = &wal_commit_log->parts[0];
+    pthread_mutex_lock(&checkpoint_mutex);
+
+    // Records written so far belong to transactions whose table entries were
+    // all appended before this point, so the scan below sees them
+    pthread_mutex_lock(&log->mutex);
+    uint64_t tail = log->tail;
+    pthread_mutex_unlock(&log->mutex);
+
+    int capacity = 0, count = 0;
+    int *referenced = NULL;
+    for (int i = 0; i < MAX_TABLES; i++) {
+        WALTable *table = wal_tables[i];
+        if (table == NULL)
+            continue;
+        for (int p = 0; p < table->partition_count; p++) {
+            WALPartition *part = &table->parts[p];
+            pthread_mutex_lock(&part->mutex);
+            for (uint64_t lsn = part->head; lsn < part->tail; lsn++) {
+                if (count == capacity) {
+                    capacity = capacity ? capacity * 2 : 64;
+                    int *grown = (int *)realloc(referenced, capacity * sizeof(int));
+                    if (!grown) {
+                        pthread_mutex_unlock(&part->mutex);
+                        free(referenced);
+                        pthread_mutex_unlock(&checkpoint_mutex);
+                        return -1;
+                    }
+                    referenced = grown;
+                }
+                referenced[count++] = ring_slot(part->ring, lsn)->txn_id;
+            }
+            pthread_mutex_unlock(&part->mutex);
+        }
+    }
+    if (referenced)
+        qsort(referenced, count, sizeof(int), compare_txn_ids);
+
+    // Release the unreferenced records at the head with one pointer store
+    pthread_mutex_lock(&log->mutex);
+    uint64_t head = log->head;
+    while (head < tail && !txn_is_committed(referenced, count, ring_slot(log->ring, head)->txn_id)) {
+        head++;
+    }
+    int trimmed = (int)(head - log->head);
+    if (trimmed > 0) {
+        atomic_write_64(&log->head, head);
+    }
+    pthread_mutex_unlock(&log->mutex);
+
+    free(referenced);
+    pthread_mutex_unlock(&checkpoint_mutex);
+    return trimmed;
+}
+
+// Print one entry of the recovery report
+static void print_replayed_entry(const WALEntry *entry, int committed, void *arg) {
+    (void)arg;
+    if (committed) {
+        printf("Replaying: Key: %d | Operation: %s\n", entry->key, wal_op_name(entry->op_flag));
+    }
+}
+
+// Report what recovery would replay, without applying it
 void wal_recover() {
     printf("Starting WAL recovery...\n");
-    
+
     for (int i = 0; i < MAX_TABLES; i++) {
         if (wal_tables[i] == NULL)
             continue;
 
-        WALTable *table = wal_tables[i];
-        pthread_mutex_lock(&table->mutex);
-        
-        printf("Recovering Table ID: %d\n", table->table_id);
-        
-        WALEntry *current = table->entry_head;
-        WALEntry *commit_point = table->commit_ptr;
-        
-        if (commit_point == NULL) {
-            printf("No committed entries for Table %d\n", table->table_id);
-            pthread_mutex_unlock(&table->mutex);
-            continue;
+        printf("Recovering Table ID: %d\n", wal_tables[i]->table_id);
+        if (wal_replay_table(i, print_replayed_entry, NULL) == 0) {
+            printf("No committed entries for Table %d\n", wal_tables[i]->table_id);
         }
-        
-        // Replay all entries up to the commit point
-        while (current != NULL) {
-            // Apply the operation (in a real implementation, this would call
-            // the appropriate B+ tree functions)
-            printf("Replaying: Key: %d | Operation: %s\n", 
-                   current->key, 
-                   current->op_flag ? "Delete" : "Add");
-            
-            // Stop when we reach the commit point
-            if (current == commit_point) {
-                printf("Reached commit point for Table %d\n", table->table_id);
-                break;
-            }
-            
-            current = current->next;
-        }
-        
-        pthread_mutex_unlock(&table->mutex);
     }
-    
+
     printf("WAL recovery completed.\n");
-}
\ No newline at end of file
+}
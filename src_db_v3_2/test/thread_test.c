@@ -13,9 +13,12 @@
 #define NUM_OPERATIONS 5
 #define CONTENTION_KEYS 3  // Shared keys all threads will try to access
 
+#define CROSSING_KEY_BASE 5000  // Keys inserted in opposite order by two transactions
+
 // Shared table for all threads
 Table *shared_table = NULL;
 pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
+int failures = 0;
 
 // Structure to pass data to thread
 typedef struct {
@@ -23,6 +26,43 @@ typedef struct {
     int start_key;
 } ThreadData;
 
+// Transaction inserting two keys, with both transactions' first inserts
+// done before either tries its second one
+typedef struct {
+    int txn_id;
+    int first_key;
+    int second_key;
+    pthread_barrier_t *barrier;
+    bool committed;
+    bool victim;  // Aborted by the deadlock policy rather than a wait timeout
+} CrossingData;
+
+// Lock request made from another thread, so the caller can release the
+// conflicting lock while it waits
+typedef struct {
+    LockManager *lm;
+    int txn_id;
+    int resource_id;
+    LockMode mode;
+    bool granted;
+    double waited_ms;
+} LockRequestData;
+
+// Record the outcome of a check
+void expect(bool condition, const char *what) {
+    printf("%s: %s\n", condition ? "PASS" : "FAIL", what);
+    if (!condition) {
+        failures++;
+    }
+}
+
+// Milliseconds since start
+double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
 // Thread function for concurrent database operations
 void* thread_worker(void* arg) {
     ThreadData* data = (ThreadData*)arg;
@@ -68,30 +108,28 @@ void* thread_worker(void* arg) {
         printf("Thread %d: Attempting to insert key %d\n", thread_id, key);
         pthread_mutex_unlock(&print_mutex);
         
-        // Loop a few times if we can't get the lock, to better demonstrate waiting behavior
-        bool success = false;
-        int retry_count = 0;
-        while (!success && retry_count < 3) {
-            success = db_put_row(shared_table, txn_id, key, data, strlen(data) + 1);
-            if (!success) {
-                pthread_mutex_lock(&print_mutex);
-                printf("Thread %d: Lock contention on key %d, retrying...\n", thread_id, key);
-                pthread_mutex_unlock(&print_mutex);
-                
-                // Wait a bit before retrying
-                usleep(100000 + (rand() % 200000));  // 100-300ms
-                retry_count++;
-            }
-        }
+        // A conflicting lock is waited for, so one attempt is enough. It fails
+        // only when the wait times out, or when the transaction is made a
+        // deadlock victim, which aborts it.
+        PutStatus status = db_put_row(shared_table, txn_id, key, data, strlen(data) + 1);
         
         pthread_mutex_lock(&print_mutex);
-        if (success) {
+        if (status == PUT_INSERTED) {
             printf("Thread %d: Successfully inserted key %d\n", thread_id, key);
+        } else if (status == PUT_EXISTS) {
+            printf("Thread %d: Key %d already exists\n", thread_id, key);
         } else {
-            printf("Thread %d: Failed to insert key %d after retries (locked by another thread)\n", thread_id, key);
+            printf("Thread %d: Failed to insert key %d (lock wait timed out or deadlock)\n", thread_id, key);
         }
         pthread_mutex_unlock(&print_mutex);
         
+        if (!transaction_is_active(&g_lock_manager, txn_id)) {
+            pthread_mutex_lock(&print_mutex);
+            printf("Thread %d: Transaction %d was aborted to break a deadlock\n", thread_id, txn_id);
+            pthread_mutex_unlock(&print_mutex);
+            return NULL;
+        }
+        
         // Try to read some data
         // Randomly choose between reading a thread-specific key or a shared contention key
         int read_key;
@@ -117,6 +155,13 @@ void* thread_worker(void* arg) {
             printf("Thread %d: Key %d not found or locked\n", thread_id, read_key);
         }
         pthread_mutex_unlock(&print_mutex);
+        
+        if (!transaction_is_active(&g_lock_manager, txn_id)) {
+            pthread_mutex_lock(&print_mutex);
+            printf("Thread %d: Transaction %d was aborted to break a deadlock\n", thread_id, txn_id);
+            pthread_mutex_unlock(&print_mutex);
+            return NULL;
+        }
     }
     
     // Random chance of committing or aborting (80% commit, 20% abort)
@@ -152,34 +197,219 @@ void* thread_worker(void* arg) {
         }
     }
     
-    free(data);
     return NULL;
 }
 
-// Function to demonstrate deadlock scenario
-void demonstrate_deadlock() {
-    printf("\n--- Demonstrating Deadlock Detection/Prevention ---\n");
+// Print a table's WAL records a page at a time
+void show_wal(int table_id) {
+    WALEntryInfo entries[64];
+    WALStats stats;
+    uint64_t start = 0;
+    int count;
+    while ((count = wal_inspect(table_id, start, entries, 64, &stats)) > 0) {
+        for (int i = 0; i < count; i++) {
+            printf("Entry %llu: Txn: %d | Key: %d | Operation: %s | Size: %u | %s\n",
+                   (unsigned long long)entries[i].seq, entries[i].txn_id, entries[i].key,
+                   wal_op_name(entries[i].op), entries[i].size, entries[i].committed ? "COMMITTED" : "");
+        }
+        start = entries[count - 1].seq + 1;
+    }
+    printf("%llu entries, %llu committed\n", (unsigned long long)stats.entries, (unsigned long long)stats.committed);
+}
+
+// Thread function for one of the crossing transactions
+void* crossing_worker(void* arg) {
+    CrossingData* data = (CrossingData*)arg;
+    char value[32];
+    snprintf(value, sizeof(value), "Data from transaction %d", data->txn_id);
     
-    // Create two threads that will attempt to acquire locks in opposite order
-    pthread_t thread1, thread2;
-    ThreadData *data1 = malloc(sizeof(ThreadData));
-    ThreadData *data2 = malloc(sizeof(ThreadData));
+    if (db_put_row(shared_table, data->txn_id, data->first_key, value, strlen(value) + 1) != PUT_INSERTED) {
+        pthread_barrier_wait(data->barrier);
+        db_abort_transaction(data->txn_id);
+        return NULL;
+    }
+    pthread_barrier_wait(data->barrier);
+    
+    // Each transaction now waits for the key the other one holds
+    if (db_put_row(shared_table, data->txn_id, data->second_key, value, strlen(value) + 1) == PUT_INSERTED) {
+        data->committed = db_commit_transaction(data->txn_id);
+    } else if (transaction_is_active(&g_lock_manager, data->txn_id)) {
+        db_abort_transaction(data->txn_id);
+    } else {
+        data->victim = true;
+    }
+    return NULL;
+}
+
+// Function to demonstrate how a deadlock is broken: two transactions insert
+// the same two keys in opposite order
+void demonstrate_deadlock(DeadlockPolicy policy, const char *name) {
+    printf("\n--- Demonstrating Deadlock Handling (%s) ---\n", name);
     
-    data1->thread_id = 100;
-    data1->start_key = 1000;
+    // Under the other policies a long timeout shows the policy, not the
+    // timeout, breaks the deadlock
+    lock_manager_set_deadlock_policy(&g_lock_manager, policy);
+    lock_manager_set_wait_timeout(&g_lock_manager, policy == DEADLOCK_TIMEOUT ? 200 : 10000);
     
-    data2->thread_id = 200;
-    data2->start_key = 2000;
+    int key_a = CROSSING_KEY_BASE + policy * 10;
+    int key_b = key_a + 1;
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, 2);
     
-    // Create threads
-    pthread_create(&thread1, NULL, thread_worker, data1);
-    pthread_create(&thread2, NULL, thread_worker, data2);
+    // The older transaction has the smaller ID
+    CrossingData older = {db_begin_transaction(), key_a, key_b, &barrier, false, false};
+    CrossingData younger = {db_begin_transaction(), key_b, key_a, &barrier, false, false};
     
-    // Wait for threads to complete
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t thread1, thread2;
+    pthread_create(&thread1, NULL, crossing_worker, &older);
+    pthread_create(&thread2, NULL, crossing_worker, &younger);
     pthread_join(thread1, NULL);
     pthread_join(thread2, NULL);
+    double waited = elapsed_ms(&start);
+    pthread_barrier_destroy(&barrier);
+    
+    printf("Transaction %d: %s, transaction %d: %s (%.0f ms)\n",
+           older.txn_id, older.committed ? "committed" : older.victim ? "deadlock victim" : "aborted",
+           younger.txn_id, younger.committed ? "committed" : younger.victim ? "deadlock victim" : "aborted",
+           waited);
+    
+    expect(!(older.committed && younger.committed), "the two transactions do not both commit");
+    if (policy == DEADLOCK_TIMEOUT) {
+        expect(!older.victim && !younger.victim, "only the wait timeout ends the deadlock");
+    } else {
+        expect(older.committed, "the older transaction commits");
+        expect(younger.victim, "the younger transaction is the deadlock victim");
+        expect(waited < 10000, "the deadlock is broken before the wait timeout");
+    }
     
-    printf("--- Deadlock Demonstration Complete ---\n\n");
+    // The rows are those of the transaction that committed, if any
+    int txn_id = db_begin_transaction();
+    int winner = older.committed ? older.txn_id : younger.committed ? younger.txn_id : -1;
+    char expected[32];
+    snprintf(expected, sizeof(expected), "Data from transaction %d", winner);
+    size_t size;
+    char *row_a = db_get_row(shared_table, txn_id, key_a, &size);
+    char *row_b = db_get_row(shared_table, txn_id, key_b, &size);
+    if (winner < 0) {
+        expect(!row_a && !row_b, "no row of an aborted transaction is visible");
+    } else {
+        expect(row_a && row_b && strcmp(row_a, expected) == 0 && strcmp(row_b, expected) == 0,
+               "both rows belong to the transaction that committed");
+    }
+    db_commit_transaction(txn_id);
+    
+    printf("--- Deadlock Demonstration Complete ---\n");
+}
+
+// Thread function making a lock request
+void* lock_request_worker(void* arg) {
+    LockRequestData* data = (LockRequestData*)arg;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    data->granted = lock_acquire(data->lm, data->txn_id, data->resource_id, false, data->mode);
+    data->waited_ms = elapsed_ms(&start);
+    return NULL;
+}
+
+// Start a lock request in another thread, release the conflicting lock by
+// committing holder after delay_ms, and wait for the request
+LockRequestData request_while_held(LockManager *lm, int txn_id, int resource_id, LockMode mode,
+                                   int holder, int delay_ms) {
+    LockRequestData data = {lm, txn_id, resource_id, mode, false, 0};
+    pthread_t thread;
+    pthread_create(&thread, NULL, lock_request_worker, &data);
+    usleep(delay_ms * 1000);
+    transaction_commit(lm, holder);
+    pthread_join(thread, NULL);
+    return data;
+}
+
+// Exercise the lock manager directly: blocking waits, timeouts, re-entrant
+// locking, shared to exclusive upgrades and wounds
+void test_lock_manager() {
+    printf("\n--- Lock Manager Tests ---\n");
+    
+    static LockManager lm;
+    lock_manager_init(&lm);
+    
+    // Re-entrant locking never conflicts with the transaction's own locks
+    lock_manager_set_wait_timeout(&lm, 0);
+    int t1 = transaction_begin(&lm);
+    int t2 = transaction_begin(&lm);
+    expect(lock_acquire(&lm, t1, 1, false, LOCK_SHARED), "shared lock granted");
+    expect(lock_acquire(&lm, t1, 1, false, LOCK_SHARED), "shared lock granted again to its holder");
+    expect(lock_acquire(&lm, t1, 1, false, LOCK_EXCLUSIVE), "sole shared holder upgrades to exclusive");
+    expect(lock_acquire(&lm, t1, 1, false, LOCK_EXCLUSIVE), "exclusive lock granted again to its holder");
+    expect(lock_acquire(&lm, t1, 1, false, LOCK_SHARED), "exclusive holder may also read");
+    expect(!lock_acquire(&lm, t2, 1, false, LOCK_SHARED), "other transaction refused without waiting");
+    transaction_commit(&lm, t1);
+    transaction_commit(&lm, t2);
+    
+    // A conflicting request blocks until the holder releases the lock
+    lock_manager_set_wait_timeout(&lm, 5000);
+    int holder = transaction_begin(&lm);
+    int waiter = transaction_begin(&lm);
+    lock_acquire(&lm, holder, 2, false, LOCK_EXCLUSIVE);
+    LockRequestData data = request_while_held(&lm, waiter, 2, LOCK_EXCLUSIVE, holder, 100);
+    expect(data.granted && data.waited_ms >= 90, "exclusive request waits for the holder's commit");
+    transaction_commit(&lm, waiter);
+    
+    // An upgrade waits for the other shared holders
+    holder = transaction_begin(&lm);
+    waiter = transaction_begin(&lm);
+    lock_acquire(&lm, holder, 3, false, LOCK_SHARED);
+    lock_acquire(&lm, waiter, 3, false, LOCK_SHARED);
+    data = request_while_held(&lm, waiter, 3, LOCK_EXCLUSIVE, holder, 100);
+    expect(data.granted && data.waited_ms >= 90, "upgrade waits for the other shared holder");
+    transaction_commit(&lm, waiter);
+    
+    // A wait that outlasts the timeout fails, and leaves the transaction
+    // running
+    lock_manager_set_wait_timeout(&lm, 100);
+    holder = transaction_begin(&lm);
+    waiter = transaction_begin(&lm);
+    lock_acquire(&lm, holder, 4, false, LOCK_EXCLUSIVE);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool granted = lock_acquire(&lm, waiter, 4, false, LOCK_SHARED);
+    double waited = elapsed_ms(&start);
+    expect(!granted && waited >= 90, "request fails once the wait timeout passes");
+    expect(transaction_is_active(&lm, waiter) && !transaction_is_victim(&lm, waiter),
+           "a timed out transaction keeps running");
+    transaction_commit(&lm, holder);
+    expect(lock_acquire(&lm, waiter, 4, false, LOCK_SHARED), "lock granted after the holder commits");
+    transaction_commit(&lm, waiter);
+    
+    // Under wound-wait an older transaction takes the lock of a younger one
+    // that is not waiting, whose commit then fails
+    lock_manager_set_deadlock_policy(&lm, DEADLOCK_WOUND_WAIT);
+    lock_manager_set_wait_timeout(&lm, 5000);
+    waiter = transaction_begin(&lm);
+    holder = transaction_begin(&lm);
+    lock_acquire(&lm, holder, 5, false, LOCK_EXCLUSIVE);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    granted = lock_acquire(&lm, waiter, 5, false, LOCK_EXCLUSIVE);
+    waited = elapsed_ms(&start);
+    expect(granted && waited < 1000, "older transaction gets the wounded holder's lock at once");
+    expect(!lock_acquire(&lm, holder, 6, false, LOCK_SHARED), "wounded transaction gets no more locks");
+    expect(!transaction_commit(&lm, holder) && transaction_is_victim(&lm, holder),
+           "wounded transaction cannot commit");
+    transaction_abort(&lm, holder);
+    transaction_commit(&lm, waiter);
+    
+    // A transaction that has started committing is not wounded
+    waiter = transaction_begin(&lm);
+    holder = transaction_begin(&lm);
+    lock_acquire(&lm, holder, 7, false, LOCK_EXCLUSIVE);
+    expect(transaction_prepare(&lm, holder), "holder starts committing");
+    data = request_while_held(&lm, waiter, 7, LOCK_EXCLUSIVE, holder, 100);
+    expect(data.granted && data.waited_ms >= 90, "older transaction waits for a committing holder");
+    transaction_commit(&lm, waiter);
+    
+    lock_manager_cleanup(&lm);
+    printf("--- Lock Manager Tests Complete ---\n");
 }
 
 // Main function
@@ -228,7 +458,7 @@ int main() {
     
     // Show the WAL data after concurrent operations
     printf("\n=== Write-Ahead Log After Concurrent Operations ===\n");
-    wal_show_data();
+    show_wal(table_id);
     
     // Demonstrate table contents
     printf("\n=== Table Contents After Concurrent Operations ===\n");
@@ -243,13 +473,20 @@ int main() {
     }
     db_commit_transaction(txn_id);
     
-    // Optionally demonstrate deadlock scenario
-    demonstrate_deadlock();
+    // Break the same deadlock under each policy
+    demonstrate_deadlock(DEADLOCK_DETECT, "detect");
+    demonstrate_deadlock(DEADLOCK_WAIT_DIE, "wait-die");
+    demonstrate_deadlock(DEADLOCK_WOUND_WAIT, "wound-wait");
+    demonstrate_deadlock(DEADLOCK_TIMEOUT, "timeout");
+    lock_manager_set_deadlock_policy(&g_lock_manager, DEADLOCK_DETECT);
+    lock_manager_set_wait_timeout(&g_lock_manager, LOCK_WAIT_TIMEOUT_MS);
+    
+    test_lock_manager();
     
     // Close the table and shutdown
     db_close_table(shared_table);
     db_shutdown();
     
-    printf("\n=== Multithreaded Database Test Complete ===\n");
-    return 0;
+    printf("\n=== Multithreaded Database Test Complete: %d failed checks ===\n", failures);
+    return failures > 0 ? 1 : 0;
 }
\ No newline at end of file